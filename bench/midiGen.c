@@ -0,0 +1,194 @@
+/*
+ * Generates synthetic format 1 MIDI files for the parser benchmarks.
+ *
+ * Track 0 holds the tempo map, every other track is a stream of note on
+ * and note off pairs. The output only depends on the options, the same
+ * options always produce the same file.
+ *
+ * Use:
+ *  ./bin/midiGen out.mid [--tracks N] [--events N] [--density N] [--running-status]
+ *                        [--sysex BYTES] [--sysex-every N] [--tempo-every N] [--seed N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIME_DIV 480
+
+typedef struct {
+    unsigned char *bytes;
+    size_t size;
+    size_t capacity;
+} buffer_t;
+
+typedef struct {
+    unsigned int tracks;     // Note tracks, the tempo track is extra
+    unsigned int events;     // Events per note track
+    unsigned int density;    // Average events per quarter note
+    int runningStatus;       // Omit repeated status bytes, note offs are note ons with velocity 0
+    unsigned int sysexSize;  // Payload of the SysEx blobs, 0 for none
+    unsigned int sysexEvery; // Events between SysEx blobs
+    unsigned int tempoEvery; // Quarter notes between tempo changes, 0 for one tempo
+    unsigned long long seed;
+} genOptions_t;
+
+static unsigned long long randState;
+
+// xorshift64*, so the corpus is the same with every libc
+static unsigned int nextRandom(unsigned int range) {
+    randState ^= randState >> 12;
+    randState ^= randState << 25;
+    randState ^= randState >> 27;
+    return (unsigned int)((randState * 0x2545F4914F6CDD1DULL) >> 32) % range;
+}
+
+// Returns 0 on faliure, 1 on success
+static int put(buffer_t *buffer, const void *bytes, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->size + size) capacity *= 2;
+        unsigned char *grown = (unsigned char *)realloc(buffer->bytes, capacity);
+        if (grown == NULL) return 0;
+        buffer->bytes = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->size, bytes, size);
+    buffer->size += size;
+    return 1;
+}
+
+static int putByte(buffer_t *buffer, unsigned char byte) {
+    return put(buffer, &byte, 1);
+}
+
+static int putVarInt(buffer_t *buffer, unsigned int value) {
+    unsigned char bytes[5];
+    int n = 0;
+    bytes[4 - n++] = value & 0x7F;
+    while ((value >>= 7) != 0) bytes[4 - n++] = (value & 0x7F) | 0x80;
+    return put(buffer, bytes + 5 - n, n);
+}
+
+static int putInt(buffer_t *buffer, unsigned int value, int size) {
+    for (int i = size - 1; i >= 0; i--) {
+        if (!putByte(buffer, (value >> (i * 8)) & 0xFF)) return 0;
+    }
+    return 1;
+}
+
+// Wraps the track events in an MTrk chunk
+static int putTrack(buffer_t *file, const buffer_t *track) {
+    return put(file, "MTrk", 4) && putInt(file, track->size, 4) && put(file, track->bytes, track->size);
+}
+
+// Note track, returns the tick of its last event or 0 on faliure
+static unsigned long long genNoteTrack(buffer_t *track, const genOptions_t *options, unsigned int index) {
+    unsigned long long tick = 0;
+    unsigned int maxDelta = 2 * TIME_DIV / options->density;
+    unsigned char channel = index % 16;
+    unsigned char status = 0;
+    int ok = putVarInt(track, 0) && put(track, "\xFF\x03\x05Track", 8);
+    for (unsigned int i = 0; ok && i + 1 < options->events; i += 2) {
+        if (options->sysexSize != 0 && i % options->sysexEvery == 0) {
+            ok = putVarInt(track, 0) && putByte(track, 0xF0) && putVarInt(track, options->sysexSize + 1);
+            for (unsigned int j = 0; ok && j < options->sysexSize; j++) ok = putByte(track, nextRandom(0x80));
+            ok = ok && putByte(track, 0xF7);
+            // SysEx cancels running status
+            status = 0;
+            i++;
+        }
+        unsigned char note = 21 + nextRandom(88);
+        unsigned int delta = nextRandom(maxDelta + 1);
+        tick += delta;
+        ok = ok && putVarInt(track, delta);
+        if (!options->runningStatus || status != (0x90 | channel)) {
+            status = 0x90 | channel;
+            ok = ok && putByte(track, status);
+        }
+        ok = ok && putByte(track, note) && putByte(track, 64 + nextRandom(64));
+
+        delta = 1 + nextRandom(maxDelta);
+        tick += delta;
+        ok = ok && putVarInt(track, delta);
+        if (options->runningStatus) {
+            ok = ok && putByte(track, note) && putByte(track, 0);
+        } else {
+            status = 0x80 | channel;
+            ok = ok && putByte(track, status) && putByte(track, note) && putByte(track, 0);
+        }
+    }
+    ok = ok && putVarInt(track, 0) && put(track, "\xFF\x2F\x00", 3);
+    return ok ? (tick ? tick : 1) : 0;
+}
+
+// Tempo track covering the song
+// Returns 0 on faliure, 1 on success
+static int genTempoTrack(buffer_t *track, const genOptions_t *options, unsigned long long songEnd) {
+    int ok = putVarInt(track, 0) && put(track, "\xFF\x58\x04\x04\x02\x18\x08", 7);
+    unsigned long long step = options->tempoEvery ? (unsigned long long)options->tempoEvery * TIME_DIV : songEnd + 1;
+    for (unsigned long long tick = 0; ok && tick <= songEnd; tick += step) {
+        unsigned int tempo = 300000 + nextRandom(400000);
+        ok = putVarInt(track, tick ? step : 0) && put(track, "\xFF\x51\x03", 3) && putInt(track, tempo, 3);
+    }
+    return ok && putVarInt(track, 0) && put(track, "\xFF\x2F\x00", 3);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        printf("Use: midiGen [FILENAME] [OPTIONS]\n");
+        printf("  --tracks N        note tracks, default is 8\n");
+        printf("  --events N        events per track, default is 10000\n");
+        printf("  --density N       average events per quarter note, default is 4\n");
+        printf("  --running-status  omit repeated status bytes\n");
+        printf("  --sysex BYTES     add SysEx blobs of this size\n");
+        printf("  --sysex-every N   events between SysEx blobs, default is 64\n");
+        printf("  --tempo-every N   quarter notes between tempo changes, default is one tempo\n");
+        printf("  --seed N          random seed, default is 1\n");
+        return EXIT_FAILURE;
+    }
+    genOptions_t options = {8, 10000, 4, 0, 0, 64, 0, 1};
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--running-status") == 0) options.runningStatus = 1;
+        else if (i + 1 >= argc) break;
+        else if (strcmp(argv[i], "--tracks") == 0) options.tracks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--events") == 0) options.events = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--density") == 0) options.density = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sysex") == 0) options.sysexSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sysex-every") == 0) options.sysexEvery = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--tempo-every") == 0) options.tempoEvery = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0) options.seed = strtoull(argv[++i], NULL, 10);
+    }
+    if (options.tracks < 1 || options.tracks > 0xFFFE) options.tracks = 8;
+    if (options.density < 1 || options.density > TIME_DIV) options.density = 4;
+    if (options.sysexEvery < 1) options.sysexEvery = 64;
+    randState = options.seed ? options.seed : 1;
+
+    buffer_t file = {NULL, 0, 0}, track = {NULL, 0, 0}, notes = {NULL, 0, 0};
+    unsigned long long songEnd = 0;
+    int ok = 1;
+    for (unsigned int i = 0; ok && i < options.tracks; i++) {
+        track.size = 0;
+        unsigned long long end = genNoteTrack(&track, &options, i);
+        if (end > songEnd) songEnd = end;
+        ok = end != 0 && putTrack(&notes, &track);
+    }
+    track.size = 0;
+    ok = ok && put(&file, "MThd", 4) && putInt(&file, 6, 4) && putInt(&file, 1, 2) &&
+         putInt(&file, options.tracks + 1, 2) && putInt(&file, TIME_DIV, 2) &&
+         genTempoTrack(&track, &options, songEnd) && putTrack(&file, &track) && put(&file, notes.bytes, notes.size);
+    if (!ok) {
+        fprintf(stderr, "Not enough memory available!\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = fopen(argv[1], "wb");
+    if (out == NULL || fwrite(file.bytes, 1, file.size, out) != file.size || fclose(out) != 0) {
+        fprintf(stderr, "Error while writing file %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    free(file.bytes);
+    free(track.bytes);
+    free(notes.bytes);
+    return EXIT_SUCCESS;
+}
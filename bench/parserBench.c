@@ -0,0 +1,172 @@
+/*
+ * Measures readMidiFile, initPlayer and freeMidi on a set of MIDI files.
+ *
+ * Every file is measured in its own child process so peak RSS is per
+ * file. Each phase is repeated and the median is reported, with the
+ * throughput and the number of heap allocations it made. Allocations
+ * are counted by linking with -Wl,--wrap=malloc,--wrap=calloc,
+ * --wrap=realloc,--wrap=free.
+ *
+ * Use:
+ *  ./bin/parserBench [--repeat N] [--threads N] song.mid...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "midiParser.h"
+
+#define MAX_REPEAT 64
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+// Heap calls since the start, the parser threads allocate too
+static volatile unsigned long allocN;
+static volatile unsigned long freeN;
+
+void *__wrap_malloc(size_t size) {
+    __sync_fetch_and_add(&allocN, 1);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    __sync_fetch_and_add(&allocN, 1);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __sync_fetch_and_add(&allocN, 1);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr != NULL) __sync_fetch_and_add(&freeN, 1);
+    __real_free(ptr);
+}
+
+// Median and heap calls of one phase
+typedef struct {
+    double ns[MAX_REPEAT];
+    unsigned long allocs;
+    unsigned long frees;
+} phase_t;
+
+static unsigned long long nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * NS_PER_S + now.tv_nsec;
+}
+
+static int compareDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int n) {
+    qsort(values, n, sizeof(double), compareDouble);
+    return values[n / 2];
+}
+
+static void printHeader(void) {
+    printf("%-28s %10s %9s | %-31s | %-22s | %-18s | %s\n", "file", "bytes", "events", "readMidiFile", "initPlayer",
+           "freeMidi", "peak RSS");
+    printf("%-28s %10s %9s | %8s %7s %7s %6s | %8s %7s %5s | %8s %8s | %s\n", "", "", "", "ms", "MB/s", "Mev/s",
+           "allocs", "ms", "Mev/s", "alloc", "ms", "frees", "kB");
+}
+
+// Runs the phases repeat times and prints one row
+// Returns 0 on faliure, 1 on success
+static int benchFile(const char *fileName, int repeat, int threads) {
+    phase_t phases[3];
+    memset(phases, 0, sizeof(phases));
+    size_t fileSize = 0;
+    unsigned long long eventN = 0;
+    for (int i = 0; i < repeat; i++) {
+        if (i == 1) {
+            // Warnings were already shown by the first run
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0) dup2(null, STDERR_FILENO);
+        }
+        midi_t midi;
+        unsigned long allocs = allocN, frees = freeN;
+        unsigned long long start = nowNs();
+        if (!readMidiFileThreads(&midi, fileName, threads)) return 0;
+        unsigned long long read = nowNs();
+        phases[0].allocs = allocN - allocs;
+
+        allocs = allocN;
+        if (!initPlayer(&midi)) {
+            freeMidi(&midi);
+            return 0;
+        }
+        unsigned long long init = nowNs();
+        phases[1].allocs = allocN - allocs;
+
+        fileSize = midi.data.mapSize;
+        eventN = 0;
+        for (unsigned short j = 0; j < midi.data.header.trackN; j++) eventN += midi.data.tracks[j].eventN;
+
+        frees = freeN;
+        unsigned long long freeStart = nowNs();
+        freeMidi(&midi);
+        unsigned long long end = nowNs();
+        phases[2].frees = freeN - frees;
+
+        phases[0].ns[i] = read - start;
+        phases[1].ns[i] = init - read;
+        phases[2].ns[i] = end - freeStart;
+    }
+
+    double readNs = median(phases[0].ns, repeat), initNs = median(phases[1].ns, repeat);
+    double freeNs = median(phases[2].ns, repeat);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const char *name = strrchr(fileName, '/');
+    name = name != NULL ? name + 1 : fileName;
+    printf("%-28.28s %10zu %9llu | %8.3f %7.1f %7.2f %6lu | %8.3f %7.2f %5lu | %8.3f %8lu | %ld\n", name,
+           fileSize, eventN, readNs / 1e6, fileSize / (readNs / 1e9) / 1e6, eventN / (readNs / 1e9) / 1e6,
+           phases[0].allocs, initNs / 1e6, eventN / (initNs / 1e9) / 1e6, phases[1].allocs, freeNs / 1e6,
+           phases[2].frees, usage.ru_maxrss);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int repeat = 5;
+    int threads = 1;
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (strcmp(argv[first], "--repeat") == 0 && first + 1 < argc) repeat = atoi(argv[++first]);
+        else if (strcmp(argv[first], "--threads") == 0 && first + 1 < argc) threads = atoi(argv[++first]);
+    }
+    if (first >= argc) {
+        printf("Use: parserBench [--repeat N] [--threads N] [FILENAME]...\n");
+        return EXIT_FAILURE;
+    }
+    if (repeat < 1) repeat = 1;
+    if (repeat > MAX_REPEAT) repeat = MAX_REPEAT;
+    if (threads < 1) threads = 1;
+
+    printHeader();
+    int failed = 0;
+    for (int i = first; i < argc; i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            int ok = benchFile(argv[i], repeat, threads);
+            fflush(stdout);
+            _exit(ok ? 0 : 1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Benchmark of %s failed\n", argv[i]);
+            failed = 1;
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/*
+ * Compares the loading player (readMidiFile + initPlayer + playNext) with
+ * the streaming player (openMidiStream + streamNext) on one MIDI file.
+ *
+ * Each player runs in its own child process so the RSS numbers don't mix.
+ * Playback runs without sleeping, notes are written to /dev/null and the
+ * player output is discarded.
+ *
+ * Use:
+ *  ./bin/streamBench song.mid
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "midiParser.h"
+#include "midiStream.h"
+
+static double elapsedMs(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Resident set size in kB
+static long currentRss(void) {
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) return 0;
+    if (fscanf(statm, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(statm);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long peakRss(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void report(FILE *out, const char *name, double openMs, double playMs, unsigned long long events,
+                   long steadyRss) {
+    fprintf(out, "%-8s open %10.2f ms  play %10.2f ms  %8.1f ns/event  steady RSS %8ld kB  peak RSS %8ld kB\n",
+            name, openMs, playMs, events ? playMs * 1e6 / events : 0.0, steadyRss, peakRss());
+}
+
+static int benchLoad(const char *fileName, int outFile, FILE *out) {
+    struct timespec start;
+    midi_t midi;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!readMidiFile(&midi, fileName)) return 1;
+    if (!initPlayer(&midi)) return 1;
+    double openMs = elapsedMs(&start);
+
+    unsigned long long events = 0;
+    for (unsigned short i = 0; i < midi.data.header.trackN; i++) events += midi.data.tracks[i].eventN;
+    midi.player.freeRun = 1;
+
+    long steadyRss = 0;
+    unsigned long long steps = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (playNext(&midi, outFile)) {
+        if (++steps == 1000) steadyRss = currentRss();
+    }
+    double playMs = elapsedMs(&start);
+    if (steadyRss == 0) steadyRss = currentRss();
+    report(out, "load", openMs, playMs, events, steadyRss);
+    freeMidi(&midi);
+    return 0;
+}
+
+static int benchStream(const char *fileName, int outFile, FILE *out) {
+    struct timespec start;
+    midiStream_t stream;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!openMidiStream(&stream, fileName)) return 1;
+    double openMs = elapsedMs(&start);
+    stream.player.freeRun = 1;
+
+    long steadyRss = 0;
+    unsigned long long steps = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (streamNext(&stream, outFile)) {
+        if (++steps == 1000) steadyRss = currentRss();
+    }
+    double playMs = elapsedMs(&start);
+    if (steadyRss == 0) steadyRss = currentRss();
+    report(out, "stream", openMs, playMs, stream.eventN, steadyRss);
+    closeMidiStream(&stream);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Use: streamBench [FILENAME]\n");
+        return EXIT_FAILURE;
+    }
+
+    int (*benches[2])(const char *, int, FILE *) = {benchLoad, benchStream};
+    for (int i = 0; i < 2; i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Results go to the original stdout, the player output is discarded
+            FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+            int outFile = open("/dev/null", O_WRONLY);
+            if (out == NULL || outFile < 0 || freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+            int ret = benches[i](argv[1], outFile, out);
+            fclose(out);
+            _exit(ret);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Benchmark failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <fcntl.h>    /* For O_RDWR */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "midi.h"
+
+#include "BatchTest.h"
+
+CPPUNIT_TEST_SUITE_REGISTRATION( BatchTest );
+
+void BatchTest::setUp()
+{
+    printf("-");
+    fflush(stdout);
+
+    file_desc = open("/dev/gpio_driver", O_RDWR);
+    CPPUNIT_ASSERT( file_desc >= 0); //maybe can't open file
+}
+
+void BatchTest::tearDown()
+{
+    unsigned char stop[MAX_STEPPERS * 2];
+    for(int i = 0; i < MAX_STEPPERS; i++)
+    {
+        stop[i * 2] = i;
+        stop[i * 2 + 1] = NOTE_OFF;
+    }
+    write(file_desc, stop, sizeof(stop));
+    close(file_desc);
+}
+
+void BatchTest::chordTest()
+{
+    printf("\nTesting a chord on every stepper in one write\n");
+
+    unsigned char chord[MAX_STEPPERS * 2];
+    for(int i = 0; i < MAX_STEPPERS; i++)
+    {
+        chord[i * 2] = i;
+        chord[i * 2 + 1] = 60 + i * 4;
+    }
+    CPPUNIT_ASSERT_EQUAL((int)write(file_desc, chord, sizeof(chord)), (int)sizeof(chord));
+    usleep(300000);
+}
+
+void BatchTest::fullBatchTest()
+{
+    printf("\nTesting a write of %d pairs\n", DRIVER_BATCH_MAX);
+
+    unsigned char batch[DRIVER_BATCH_LEN];
+    for(int i = 0; i < DRIVER_BATCH_MAX; i++)
+    {
+        batch[i * 2] = i % MAX_STEPPERS;
+        batch[i * 2 + 1] = 40 + i;
+    }
+    CPPUNIT_ASSERT_EQUAL((int)write(file_desc, batch, sizeof(batch)), DRIVER_BATCH_LEN);
+    usleep(300000);
+}
+
+void BatchTest::invalidBatchTest()
+{
+    printf("\nTesting a batch with a stepper that doesn't exist\n");
+
+    unsigned char batch[6] = {0, 69, MAX_STEPPERS, 69, 1, 69};
+    CPPUNIT_ASSERT_EQUAL((int)write(file_desc, batch, sizeof(batch)), -1);
+    CPPUNIT_ASSERT_EQUAL(errno, EINVAL);
+}
+
+void BatchTest::oddLengthTest()
+{
+    printf("\nTesting a write with half a pair\n");
+
+    unsigned char batch[3] = {0, 69, 1};
+    //like other unknown writes it's consumed without playing anything
+    CPPUNIT_ASSERT_EQUAL((int)write(file_desc, batch, sizeof(batch)), 3);
+}
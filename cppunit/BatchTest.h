@@ -0,0 +1,30 @@
+#ifndef BATCHTEST_H_INCLUDED
+#define BATCHTEST_H_INCLUDED
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class BatchTest : public CPPUNIT_NS::TestFixture
+{
+  CPPUNIT_TEST_SUITE( BatchTest );
+  CPPUNIT_TEST( chordTest );
+  CPPUNIT_TEST( fullBatchTest );
+  CPPUNIT_TEST( invalidBatchTest );
+  CPPUNIT_TEST( oddLengthTest );
+  CPPUNIT_TEST_SUITE_END();
+
+protected:
+  int file_desc;
+
+public:
+  void setUp();
+  void tearDown();
+
+protected:
+  void chordTest();        //a note on every stepper in one write
+  void fullBatchTest();    //DRIVER_BATCH_MAX pairs, later pairs win on the same stepper
+  void invalidBatchTest(); //one bad stepper rejects the whole batch
+  void oddLengthTest();    //a half pair isn't a note
+
+};
+
+#endif // BATCHTEST_H_INCLUDED
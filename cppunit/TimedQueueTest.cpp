@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <fcntl.h>    /* For O_RDWR */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "midi.h"
+
+#include "TimedQueueTest.h"
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TimedQueueTest );
+
+void TimedQueueTest::setUp()
+{
+    printf("-");
+    fflush(stdout);
+
+    file_desc = open("/dev/gpio_driver", O_RDWR);
+    CPPUNIT_ASSERT( file_desc >= 0); //maybe can't open file
+}
+
+void TimedQueueTest::tearDown()
+{
+    unsigned char flush = DRIVER_FLUSH;
+    write(file_desc, &flush, 1);
+    close(file_desc);
+}
+
+unsigned long long TimedQueueTest::nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * NS_PER_S + now.tv_nsec;
+}
+
+int TimedQueueTest::writeTimedNote(unsigned char stepper, unsigned char note, unsigned long long deadline)
+{
+    unsigned char record[DRIVER_TIMED_LEN] = {DRIVER_TIMED_NOTE, stepper, note, 0};
+    for(int i = 0; i < 8; i++)
+        record[4 + i] = deadline >> (i * 8);
+    return write(file_desc, record, DRIVER_TIMED_LEN);
+}
+
+void TimedQueueTest::timedNoteTest()
+{
+    printf("\nTesting a timed note on and off on every stepper\n");
+
+    unsigned long long start = nowNs() + 100000000;
+    for(int i = 0; i < MAX_STEPPERS; i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(writeTimedNote(i, 69, start + i * 100000000ULL), DRIVER_TIMED_LEN);
+        CPPUNIT_ASSERT_EQUAL(writeTimedNote(i, NOTE_OFF, start + (i + 1) * 100000000ULL), DRIVER_TIMED_LEN);
+    }
+    //notes written out of order are sorted by the driver
+    CPPUNIT_ASSERT_EQUAL(writeTimedNote(0, 60, start + 50000000), DRIVER_TIMED_LEN);
+    CPPUNIT_ASSERT_EQUAL(writeTimedNote(0, NOTE_OFF, start + 60000000), DRIVER_TIMED_LEN);
+
+    usleep((MAX_STEPPERS + 2) * 100000);
+}
+
+void TimedQueueTest::queueFullTest()
+{
+    printf("\nTesting a full queue\n");
+
+    unsigned long long deadline = nowNs() + 10ULL * NS_PER_S;
+    for(int i = 0; i < DRIVER_QUEUE_LEN; i++)
+        CPPUNIT_ASSERT_EQUAL(writeTimedNote(0, NOTE_OFF, deadline), DRIVER_TIMED_LEN);
+
+    CPPUNIT_ASSERT_EQUAL(writeTimedNote(0, NOTE_OFF, deadline), -1);
+    CPPUNIT_ASSERT_EQUAL(errno, EAGAIN);
+
+    unsigned char flush = DRIVER_FLUSH;
+    CPPUNIT_ASSERT_EQUAL((int)write(file_desc, &flush, 1), 1);
+    CPPUNIT_ASSERT_EQUAL(writeTimedNote(0, NOTE_OFF, deadline), DRIVER_TIMED_LEN);
+}
+
+void TimedQueueTest::invalidTimedStepperTest()
+{
+    printf("\nTesting timed notes on steppers over 4 because they dont exist\n");
+
+    for(int i = MAX_STEPPERS; i < 256; i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(writeTimedNote(i, 69, nowNs()), -1);
+        CPPUNIT_ASSERT_EQUAL(errno, EINVAL);
+    }
+}
+
+void TimedQueueTest::oversizedWriteTest()
+{
+    printf("\nTesting a write longer than the driver buffer\n");
+
+    char buffer[256];
+    memset(buffer, 0, sizeof(buffer));
+    CPPUNIT_ASSERT_EQUAL((int)write(file_desc, buffer, sizeof(buffer)), -1);
+    CPPUNIT_ASSERT_EQUAL(errno, EINVAL);
+}
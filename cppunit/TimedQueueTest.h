@@ -0,0 +1,33 @@
+#ifndef TIMEDQUEUETEST_H_INCLUDED
+#define TIMEDQUEUETEST_H_INCLUDED
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class TimedQueueTest : public CPPUNIT_NS::TestFixture
+{
+  CPPUNIT_TEST_SUITE( TimedQueueTest );
+  CPPUNIT_TEST( timedNoteTest );
+  CPPUNIT_TEST( queueFullTest );
+  CPPUNIT_TEST( invalidTimedStepperTest );
+  CPPUNIT_TEST( oversizedWriteTest );
+  CPPUNIT_TEST_SUITE_END();
+
+protected:
+  int file_desc;
+
+  int writeTimedNote(unsigned char stepper, unsigned char note, unsigned long long deadline);
+  unsigned long long nowNs();
+
+public:
+  void setUp();
+  void tearDown();
+
+protected:
+  void timedNoteTest();           //notes with a deadline are accepted and played
+  void queueFullTest();           //a full queue returns EAGAIN until it's flushed
+  void invalidTimedStepperTest(); //timed notes for steppers that don't exist
+  void oversizedWriteTest();      //writes longer than the driver buffer
+
+};
+
+#endif // TIMEDQUEUETEST_H_INCLUDED
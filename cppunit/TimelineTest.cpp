@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TimelineTest.h"
+
+/* Needs src/midiParser.c and src/logger.c, unlike the driver tests it runs without /dev/gpio_driver */
+CPPUNIT_TEST_SUITE_REGISTRATION( TimelineTest );
+
+#define TEST_FILE "timeline_test.mid"
+#define TICKS_PER_BEAT 96
+#define BEAT_NS 500000000ULL //default tempo, 120 bpm
+
+void TimelineTest::setUp()
+{
+    printf("-");
+    fflush(stdout);
+
+    memset(&song, 0, sizeof(song));
+}
+
+void TimelineTest::tearDown()
+{
+    freeMidi(&song);
+    remove(TEST_FILE);
+}
+
+//writes a format 0 file with one track of events and compiles it for steppers
+void TimelineTest::compile(const unsigned char *events, size_t size, unsigned char steppers)
+{
+    unsigned char header[] = {'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, TICKS_PER_BEAT,
+                              'M', 'T', 'r', 'k', 0, 0, 0, (unsigned char)size};
+    FILE *file = fopen(TEST_FILE, "wb");
+    CPPUNIT_ASSERT(file != NULL); //maybe can't create file
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(events, 1, size, file);
+    fclose(file);
+
+    CPPUNIT_ASSERT(readMidiFile(&song, TEST_FILE));
+    song.steppers = steppers;
+    CPPUNIT_ASSERT(initPlayer(&song));
+}
+
+//note commands in the timeline
+unsigned int TimelineTest::noteCount()
+{
+    unsigned int notes = 0;
+    for(unsigned int i = 0; i < song.timeline.commandN; i++)
+        if(song.timeline.commands[i].type == CMD_NOTE)
+            notes++;
+    return notes;
+}
+
+//checks the note command at index of the timeline, notes only
+void TimelineTest::assertNote(unsigned int index, unsigned long long time, unsigned char stepper, unsigned char note)
+{
+    unsigned int found = 0;
+    for(unsigned int i = 0; i < song.timeline.commandN; i++)
+    {
+        const midiCommand_t *command = &song.timeline.commands[i];
+        if(command->type != CMD_NOTE)
+            continue;
+        if(found++ != index)
+            continue;
+        CPPUNIT_ASSERT_EQUAL(command->time, time);
+        CPPUNIT_ASSERT_EQUAL((int)command->stepper, (int)stepper);
+        CPPUNIT_ASSERT_EQUAL((int)command->note, (int)note);
+        return;
+    }
+    CPPUNIT_FAIL("not enough notes in the timeline");
+}
+
+void TimelineTest::zeroLengthNoteTest()
+{
+    printf("\nTesting a zero length note before a note on one stepper\n");
+
+    const unsigned char events[] = {
+        0x00, 0x90, 60, 100, 0x00, 0x80, 60, 0, //no length, never sounds
+        0x60, 0x90, 62, 100, 0x60, 0x80, 62, 0,
+        0x00, 0xFF, 0x2F, 0x00};
+    compile(events, sizeof(events), 1);
+
+    assertNote(0, BEAT_NS, 0, 62);
+    assertNote(1, 2 * BEAT_NS, 0, NOTE_OFF);
+    CPPUNIT_ASSERT_EQUAL(noteCount(), 2u);
+}
+
+void TimelineTest::zeroLengthSkylineTest()
+{
+    printf("\nTesting a zero length note above a note at the same tick\n");
+
+    const unsigned char events[] = {
+        0x00, 0x90, 72, 100, 0x00, 0x90, 60, 100, 0x00, 0x80, 72, 0, //72 has no length
+        0x60, 0x80, 60, 0,
+        0x00, 0xFF, 0x2F, 0x00};
+    compile(events, sizeof(events), 1);
+
+    //skyline would keep the higher note, 60 is the only one that sounds
+    assertNote(0, 0, 0, 60);
+    assertNote(1, BEAT_NS, 0, NOTE_OFF);
+    CPPUNIT_ASSERT_EQUAL(noteCount(), 2u);
+}
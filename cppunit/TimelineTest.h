@@ -0,0 +1,34 @@
+#ifndef TIMELINETEST_H_INCLUDED
+#define TIMELINETEST_H_INCLUDED
+
+#include <cppunit/extensions/HelperMacros.h>
+
+extern "C" {
+#include "../src/midiParser.h"
+}
+
+class TimelineTest : public CPPUNIT_NS::TestFixture
+{
+  CPPUNIT_TEST_SUITE( TimelineTest );
+  CPPUNIT_TEST( zeroLengthNoteTest );
+  CPPUNIT_TEST( zeroLengthSkylineTest );
+  CPPUNIT_TEST_SUITE_END();
+
+protected:
+  midi_t song;
+
+  void compile(const unsigned char *events, size_t size, unsigned char steppers);
+  unsigned int noteCount();
+  void assertNote(unsigned int index, unsigned long long time, unsigned char stepper, unsigned char note);
+
+public:
+  void setUp();
+  void tearDown();
+
+protected:
+  void zeroLengthNoteTest();    //a note whose on and off share a tick doesn't keep its stepper
+  void zeroLengthSkylineTest(); //a zero length note doesn't take the stepper from a note at the same tick
+
+};
+
+#endif // TIMELINETEST_H_INCLUDED
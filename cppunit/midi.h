@@ -5,6 +5,18 @@
 
 #define NOTE_OFF 0xFF
 
+// Driver commands, a 2 byte write [stepper][note] plays the note immediately
+// A write of up to DRIVER_BATCH_MAX such pairs plays all of them at once, in order, or none if an index is invalid
+#define DRIVER_BATCH_MAX 40
+#define DRIVER_BATCH_LEN (DRIVER_BATCH_MAX * 2)
+// [DRIVER_TIMED_NOTE][stepper][note][0][deadline] queues the note until deadline, an 8 byte little endian
+// CLOCK_MONOTONIC time in ns. The write fails with EAGAIN when DRIVER_QUEUE_LEN notes are queued
+#define DRIVER_TIMED_NOTE 0xF1
+#define DRIVER_TIMED_LEN 12
+#define DRIVER_QUEUE_LEN 256
+// 1 byte write that drops all queued notes
+#define DRIVER_FLUSH 0xF0
+
 // MIDI CONSTANTS
 
 #define HEADER_CHUNK_ID 0x4D546864
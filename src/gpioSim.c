@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include "midi.h"
+
+// Stand-in for /dev/gpio_driver on plain Linux, loaded with LD_PRELOAD
+// Opening the driver node gives a file whose writes are checked like gpio_driver_write does
+// and logged with their CLOCK_MONOTONIC arrival time to GPIOSIM_LOG (gpiosim.csv by default)
+// GPIOSIM_STEPPERS sets steppers_count, it has to match the steppers_count the module is loaded with
+// and is 1 by default like the module parameter
+
+#define SIM_NODE "/dev/gpio_driver"
+// Longest write the driver accepts
+#define SIM_BUF_LEN 80
+// File descriptors that can be tracked
+#define SIM_MAX_FD 1024
+
+static int (*realOpen)(const char *, int, ...);
+static int (*realOpenat)(int, const char *, int, ...);
+static ssize_t (*realWrite)(int, const void *, size_t);
+static int (*realClose)(int);
+
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char simulated[SIM_MAX_FD];
+static FILE *simLog;
+static int steppersCount = 1;
+
+// Deadlines of the queued timed notes in ascending order, notes that are due have left the queue
+static unsigned long long queue[DRIVER_QUEUE_LEN];
+static int queueHead;
+static int queueSize;
+
+static void loadSymbols(void) {
+    if (realWrite != NULL) return;
+    realOpen = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT, "open");
+    realOpenat = (int (*)(int, const char *, int, ...))dlsym(RTLD_NEXT, "openat");
+    realWrite = (ssize_t (*)(int, const void *, size_t))dlsym(RTLD_NEXT, "write");
+    realClose = (int (*)(int))dlsym(RTLD_NEXT, "close");
+}
+
+static unsigned long long nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Appends one command to the log, called with simLock held
+static void logCommand(unsigned long long arrival, const char *type, int stepper, int note,
+                       unsigned long long deadline, long result) {
+    if (simLog == NULL) return;
+    fprintf(simLog, "%llu,%s,%d,%d,%llu,%ld\n", arrival, type, stepper, note, deadline, result);
+}
+
+// Opens the log on the first open of the node, called with simLock held
+static void openLog(void) {
+    if (simLog != NULL) return;
+    const char *steppers = getenv("GPIOSIM_STEPPERS");
+    if (steppers != NULL) steppersCount = atoi(steppers);
+    const char *name = getenv("GPIOSIM_LOG");
+    if (name == NULL) name = "gpiosim.csv";
+    simLog = fopen(name, "w");
+    if (simLog == NULL) {
+        fprintf(stderr, "gpiosim: Error while opening %s, commands are not logged\n", name);
+        return;
+    }
+    setvbuf(simLog, NULL, _IOFBF, 1 << 20);
+    fprintf(simLog, "arrival_ns,type,stepper,note,deadline_ns,result\n");
+}
+
+// Drops the queued notes whose deadline passed, the driver played them already
+static void expireQueue(unsigned long long now) {
+    while (queueSize > 0 && queue[queueHead] <= now) {
+        queueHead = (queueHead + 1) % DRIVER_QUEUE_LEN;
+        queueSize--;
+    }
+}
+
+// Inserts the deadline in order like queue_note
+// Returns 0 on success, -EAGAIN if the queue is full
+static int queueNote(unsigned long long deadline) {
+    if (queueSize == DRIVER_QUEUE_LEN) return -EAGAIN;
+    int i = (queueHead + queueSize) % DRIVER_QUEUE_LEN;
+    while (i != queueHead) {
+        int prev = (i + DRIVER_QUEUE_LEN - 1) % DRIVER_QUEUE_LEN;
+        if (queue[prev] <= deadline) break;
+        queue[i] = queue[prev];
+        i = prev;
+    }
+    queue[i] = deadline;
+    queueSize++;
+    return 0;
+}
+
+// Checks and logs one write like gpio_driver_write
+// Returns what the driver write returns, negative errors are -errno
+static long simWrite(const unsigned char *buffer, size_t len) {
+    unsigned long long arrival = nowNs();
+    long result = len;
+    pthread_mutex_lock(&simLock);
+    expireQueue(arrival);
+    if (len > SIM_BUF_LEN) {
+        result = -EINVAL;
+        logCommand(arrival, "invalid", -1, -1, 0, result);
+    } else if (len == 2 || (len > 2 && len % 2 == 0 && len <= DRIVER_BATCH_LEN && buffer[0] < DRIVER_FLUSH)) {
+        size_t invalid = len;
+        for (size_t i = 0; i < len && invalid == len; i += 2) {
+            if (buffer[i] >= steppersCount) invalid = i;
+        }
+        if (invalid < len) {
+            // The driver returns a positive EINVAL for single notes
+            result = len == 2 ? EINVAL : -EINVAL;
+            logCommand(arrival, "invalid", buffer[invalid], buffer[invalid + 1], 0, result);
+        } else {
+            // A batch is logged as its notes with the same arrival time
+            for (size_t i = 0; i < len; i += 2) {
+                // Notes out of range stop the stepper like NOTE_OFF
+                int playing = buffer[i + 1] != NOTE_OFF && buffer[i + 1] >= NOTE_LOWEST && buffer[i + 1] <= NOTE_HIGHEST;
+                logCommand(arrival, playing ? "note" : "off", buffer[i], buffer[i + 1], 0, result);
+            }
+        }
+    } else if (len == DRIVER_TIMED_LEN && buffer[0] == DRIVER_TIMED_NOTE) {
+        unsigned long long deadline = 0;
+        for (int i = 7; i >= 0; i--) deadline = deadline << 8 | buffer[4 + i];
+        if (buffer[1] >= steppersCount) result = -EINVAL;
+        else if (deadline > arrival && queueNote(deadline) < 0) result = -EAGAIN;
+        logCommand(arrival, "timed", buffer[1], buffer[2], deadline, result);
+    } else if (len == DRIVER_PERIOD_LEN && buffer[0] == DRIVER_PERIOD) {
+        unsigned long long period = 0;
+        for (int i = 3; i >= 0; i--) period = period << 8 | buffer[4 + i];
+        if (buffer[1] >= steppersCount || period < DRIVER_PERIOD_MIN || period > DRIVER_PERIOD_MAX) result = -EINVAL;
+        // The half period is logged in the deadline column
+        logCommand(arrival, "period", buffer[1], -1, period, result);
+    } else if (len == 1 && buffer[0] == DRIVER_FLUSH) {
+        queueHead = 0;
+        queueSize = 0;
+        logCommand(arrival, "flush", -1, -1, 0, result);
+    } else {
+        // The driver only logs unknown writes
+        logCommand(arrival, "invalid", len > 0 ? buffer[0] : -1, -1, 0, result);
+    }
+    pthread_mutex_unlock(&simLock);
+    return result;
+}
+
+// Gives a file for the driver node, other paths are opened normally
+static int simOpen(int fd) {
+    if (fd < 0 || fd >= SIM_MAX_FD) return fd;
+    pthread_mutex_lock(&simLock);
+    openLog();
+    simulated[fd] = 1;
+    logCommand(nowNs(), "open", -1, -1, 0, fd);
+    pthread_mutex_unlock(&simLock);
+    return fd;
+}
+
+int open(const char *path, int flags, ...) {
+    loadSymbols();
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    if (strcmp(path, SIM_NODE) == 0) return simOpen(realOpen("/dev/null", O_RDWR));
+    return realOpen(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+    loadSymbols();
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return open(path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+    loadSymbols();
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    if (strcmp(path, SIM_NODE) == 0) return simOpen(realOpen("/dev/null", O_RDWR));
+    return realOpenat(dirfd, path, flags, mode);
+}
+
+ssize_t write(int fd, const void *buffer, size_t len) {
+    loadSymbols();
+    if (fd < 0 || fd >= SIM_MAX_FD || !simulated[fd]) return realWrite(fd, buffer, len);
+    long result = simWrite((const unsigned char *)buffer, len);
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return result;
+}
+
+int close(int fd) {
+    loadSymbols();
+    if (fd >= 0 && fd < SIM_MAX_FD && simulated[fd]) {
+        // Releasing the driver drops the queued notes
+        pthread_mutex_lock(&simLock);
+        simulated[fd] = 0;
+        queueHead = 0;
+        queueSize = 0;
+        logCommand(nowNs(), "close", -1, -1, 0, 0);
+        if (simLog != NULL) fflush(simLog);
+        pthread_mutex_unlock(&simLock);
+    }
+    return realClose(fd);
+}
+
+// Commands written before exit without a close are kept
+__attribute__((destructor)) static void closeLog(void) {
+    pthread_mutex_lock(&simLock);
+    if (simLog != NULL) fclose(simLog);
+    simLog = NULL;
+    pthread_mutex_unlock(&simLock);
+}
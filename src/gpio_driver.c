@@ -33,7 +33,10 @@
 #include <linux/hrtimer.h>
 #include <linux/uaccess.h>
 #include <linux/interrupt.h>
+#include <linux/spinlock.h>
 #include <linux/gpio.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include "midi.h"
@@ -119,6 +122,9 @@ static int gpio_driver_open(struct inode *, struct file *);
 static int gpio_driver_release(struct inode *, struct file *);
 static ssize_t gpio_driver_read(struct file *, char *buf, size_t , loff_t *);
 static ssize_t gpio_driver_write(struct file *, const char *buf, size_t , loff_t *);
+static enum hrtimer_restart queue_timer_callback(struct hrtimer *);
+static void flush_queue(void);
+static void record_first_edge(int index);
 
 /* Structure that declares the usual file access functions. */
 struct file_operations gpio_driver_fops =
@@ -155,7 +161,44 @@ struct hrtimer_param {
     int stepper_index;
 };
 static struct hrtimer_param pwm_timers[MAX_STEPPERS];   /* Timers array */
-static ktime_t kt[MAX_STEPPERS];
+static ktime_t kt[MAX_STEPPERS];                 /* Half period the note started with */
+static u32 steppers_half_period[MAX_STEPPERS];  /* Half period of the next edge in ns, changed by pitch bends */
+
+/* Note waiting in the queue for its deadline */
+struct timed_note {
+    u64 deadline;           /* CLOCK_MONOTONIC time in ns */
+    unsigned char stepper;
+    unsigned char note;
+};
+/* Ring of queued notes sorted by deadline, fired by queue_timer */
+static struct timed_note note_queue[DRIVER_QUEUE_LEN];
+static int queue_head;      /* Index of the earliest note */
+static int queue_size;
+static DEFINE_SPINLOCK(queue_lock);
+static struct hrtimer queue_timer;
+
+/*
+ * Latency from a note command to the first edge on its step pin, read from /proc/gpio_driver_latency.
+ * A note starts at its write for note pairs and at its deadline for timed notes.
+ * Histograms use the buckets from midi.h, so they line up with the ones steppatron prints.
+ */
+#define LATENCY_PROC_NAME "gpio_driver_latency"
+#define STAGE_START 0   /* Note start to hrtimer_start */
+#define STAGE_EDGE 1    /* Lateness of the first edge, due half a period after hrtimer_start */
+#define STAGE_TOTAL 2   /* Note start to the first edge, includes the half period */
+#define STAGE_COUNT 3
+struct latency_stage {
+    u32 count;
+    u64 sum;                            /* ns */
+    u64 max;                            /* ns */
+    u32 histogram[LATENCY_BUCKETS];     /* Notes by latency in us */
+};
+static struct latency_stage latency_stages[STAGE_COUNT];
+static const char *latency_names[STAGE_COUNT] = {"start to timer", "first edge late", "start to first edge"};
+static DEFINE_SPINLOCK(latency_lock);
+static struct proc_dir_entry *latency_proc;
+static u64 steppers_origin[MAX_STEPPERS];   /* Start of the playing note, CLOCK_MONOTONIC ns */
+static u64 steppers_started[MAX_STEPPERS];  /* When its pwm timer was started */
 
 static int gpio_driver_major;       /* Major number. */
 #define BUF_LEN 80                  /* Buffer to store data. */
@@ -375,6 +418,10 @@ static enum hrtimer_restart pwm_timer_callback(struct hrtimer *param) {
     struct_ptr = container_of(param, struct hrtimer_param, timer);
     index = struct_ptr->stepper_index;
 
+    /* Ticks restart with every note */
+    if (steppers_ticks[index] == 0)
+        record_first_edge(index);
+
     //type_name<decltype(ci)>()
     /* Switch voltage on stepper pin */
     steppers_power[index] ^= 0x1;
@@ -390,7 +437,8 @@ static enum hrtimer_restart pwm_timer_callback(struct hrtimer *param) {
         return HRTIMER_NORESTART;
     } 
 
-    hrtimer_forward(&pwm_timers[index].timer, ktime_get(), kt[index]);
+    /* A bend changes the period from the next edge on, the timer is never restarted */
+    hrtimer_forward(&pwm_timers[index].timer, ktime_get(), ns_to_ktime(READ_ONCE(steppers_half_period[index])));
     return HRTIMER_RESTART;
 }
 
@@ -403,6 +451,115 @@ static irqreturn_t h_irq_gpio3(int irq, void *data) //stops steppers
 }
 
 
+/* Adds one latency in ns to the stage, called from the timer callbacks too */
+static void record_latency(int stage, u64 ns)
+{
+    struct latency_stage *s = &latency_stages[stage];
+    unsigned long flags;
+
+    spin_lock_irqsave(&latency_lock, flags);
+    s->count++;
+    s->sum += ns;
+    if (ns > s->max)
+        s->max = ns;
+    s->histogram[latencyBucket(div_u64(ns, 1000))]++;
+    spin_unlock_irqrestore(&latency_lock, flags);
+}
+
+/* Records when the first edge of the note on the stepper came, called from its pwm timer */
+static void record_first_edge(int index)
+{
+    u64 now = ktime_get_ns();
+    u64 due = steppers_started[index] + ktime_to_ns(kt[index]);
+
+    record_latency(STAGE_EDGE, now > due ? now - due : 0);
+    record_latency(STAGE_TOTAL, now > steppers_origin[index] ? now - steppers_origin[index] : 0);
+}
+
+/* Latency in us that permille of the notes didn't exceed, rounded up to the histogram bucket */
+static u64 latency_percentile(const struct latency_stage *s, u32 permille)
+{
+    u64 rank = div_u64((u64)s->count * permille + 500, 1000);
+    u64 seen = 0;
+    u64 max_us = div_u64(s->max, 1000);
+    int i;
+
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += s->histogram[i];
+        if (seen >= rank)
+            return min(latencyBucketLimit(i), max_us);
+    }
+    return max_us;
+}
+
+/* Prints the stages and their histograms as upper bucket limit in us:notes */
+static int latency_proc_show(struct seq_file *m, void *v)
+{
+    const struct latency_stage *s;
+    int i, b;
+
+    /* Read without the lock, a report taken while notes start can be one note off */
+    seq_printf(m, "Driver latency report:\n");
+    for (i = 0; i < STAGE_COUNT; i++) {
+        s = &latency_stages[i];
+        if (s->count == 0)
+            continue;
+        seq_printf(m, "  %-20s %u notes, mean %lluus, p50 %lluus, p99 %lluus, p99.9 %lluus, max %lluus\n",
+                   latency_names[i], s->count, div_u64(div_u64(s->sum, s->count), 1000),
+                   latency_percentile(s, 500), latency_percentile(s, 990), latency_percentile(s, 999),
+                   div_u64(s->max, 1000));
+    }
+    for (i = 0; i < STAGE_COUNT; i++) {
+        s = &latency_stages[i];
+        if (s->count == 0)
+            continue;
+        seq_printf(m, "  %s histogram:", latency_names[i]);
+        for (b = 0; b < LATENCY_BUCKETS; b++) {
+            if (s->histogram[b] != 0)
+                seq_printf(m, " %llu:%u", latencyBucketLimit(b), s->histogram[b]);
+        }
+        seq_printf(m, "\n");
+    }
+    return 0;
+}
+
+static int latency_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, latency_proc_show, NULL);
+}
+
+/* Any write clears the statistics, the file is only writable by root */
+static ssize_t latency_proc_write(struct file *file, const char __user *buf, size_t len, loff_t *pos)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&latency_lock, flags);
+    memset(latency_stages, 0, sizeof(latency_stages));
+    spin_unlock_irqrestore(&latency_lock, flags);
+    return len;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops latency_proc_ops = {
+    .proc_open      = latency_proc_open,
+    .proc_read      = seq_read,
+    .proc_lseek     = seq_lseek,
+    .proc_release   = single_release,
+    .proc_write     = latency_proc_write,
+};
+#else
+static const struct file_operations latency_proc_ops = {
+    .owner      = THIS_MODULE,
+    .open       = latency_proc_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+    .write      = latency_proc_write,
+};
+#endif
+
 /*
  * Initialization:
  *  1. Register device driver
@@ -475,6 +632,8 @@ int gpio_driver_init(void){
         pwm_timers[i].stepper_index = i;
         hrtimer_init(&pwm_timers[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
     }
+    hrtimer_init(&queue_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    queue_timer.function = &queue_timer_callback;
 
 
     /* Initialize gpio 3 ISR. */
@@ -493,6 +652,11 @@ int gpio_driver_init(void){
         goto fail_irq;
     }
 
+    /* Notes play without the statistics if the proc file can't be made */
+    latency_proc = proc_create(LATENCY_PROC_NAME, 0644, NULL, &latency_proc_ops);
+    if (!latency_proc)
+        printk(KERN_INFO "gpio_driver: cannot create /proc/%s\n", LATENCY_PROC_NAME);
+
     return 0;
 
 fail_irq:
@@ -522,6 +686,11 @@ void gpio_driver_exit(void) {
     
     printk(KERN_INFO "Removing gpio_driver module\n");
 
+    proc_remove(latency_proc);
+
+    /* Queued notes would restart the stepper timers */
+    flush_queue();
+
     /* Clear GPIO pins. */
     for(i = 0; i < steppers_count; i++){
         /* Release high resolution timer. */
@@ -569,6 +738,7 @@ static int gpio_driver_release(struct inode *inode, struct file *filp){
     int i;
 
     /* Stop the timers and disable steppers because no one is writing to node */
+    flush_queue();
 
     for(i = 0; i < steppers_count; i++){
         SetGpioPin(steppers_en[i]);
@@ -719,6 +889,123 @@ const struct MIDIStruct MIDITable[88] = {
         {108,    0.2389 * 1000,   1046}  //    C8
 };
 
+/*
+ * play_note function
+ *  Parameters:
+ *   index  - stepper index, must be below steppers_count;
+ *   note   - MIDI note number, NOTE_OFF or a note out of range stops the stepper;
+ *   origin - CLOCK_MONOTONIC time in ns the note should have started, for the latency statistics
+ *  Operation:
+ *   Stops the previous note of the stepper and starts the pwm timer for the new one.
+ */
+static void play_note(int index, unsigned char note, u64 origin)
+{
+    /* Prekine se prosla nota */
+    hrtimer_cancel(&pwm_timers[index].timer);
+
+    /* Ponovo pocinje merenje vremena za max trajanje note */
+    steppers_ticks[index] = 0;
+
+    /* No stop signal */
+    if (note != NOTE_OFF && note >= NOTE_LOWEST && note <= NOTE_HIGHEST) {
+        /* Enable stepper so it will be able to play the note */
+        ClearGpioPin(steppers_en[index]);
+        /* Postavi max count na vrednost iz tabele puta 40 da duze traje */
+        steppers_max_ticks[index] = MIDITable[note - NOTE_LOWEST].ticks * 80;
+
+        /* Set interval for high resolution timer */
+        kt[index] = ktime_set(0, MIDITable[note - NOTE_LOWEST].period * 500);
+        WRITE_ONCE(steppers_half_period[index], MIDITable[note - NOTE_LOWEST].period * 500);
+        /* Set callback function */
+        pwm_timers[index].timer.function = &pwm_timer_callback;
+        /* Start timer */
+        steppers_origin[index] = origin;
+        steppers_started[index] = ktime_get_ns();
+        record_latency(STAGE_START, steppers_started[index] > origin ? steppers_started[index] - origin : 0);
+        hrtimer_start(&pwm_timers[index].timer, kt[index], HRTIMER_MODE_REL);
+    }
+    /* Stop signal [NOTE_OFF] */
+    else {
+        SetGpioPin(steppers_en[index]); /* Disable stepper to stop wasting current */
+    }
+}
+
+/* Queue timer callback, plays all notes that are due and rearms the timer for the next one */
+static enum hrtimer_restart queue_timer_callback(struct hrtimer *timer)
+{
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+    unsigned long flags;
+    u64 now = ktime_get_ns();
+
+    spin_lock_irqsave(&queue_lock, flags);
+    while (queue_size > 0 && note_queue[queue_head].deadline <= now) {
+        play_note(note_queue[queue_head].stepper, note_queue[queue_head].note, note_queue[queue_head].deadline);
+        queue_head = (queue_head + 1) % DRIVER_QUEUE_LEN;
+        queue_size--;
+    }
+    if (queue_size > 0) {
+        hrtimer_set_expires(timer, ns_to_ktime(note_queue[queue_head].deadline));
+        restart = HRTIMER_RESTART;
+    }
+    spin_unlock_irqrestore(&queue_lock, flags);
+
+    return restart;
+}
+
+/*
+ * queue_note function
+ *  Parameters:
+ *   deadline - CLOCK_MONOTONIC time in ns when the note plays;
+ *   stepper  - stepper index;
+ *   note     - MIDI note number or NOTE_OFF
+ *
+ *   return   - 0 on success, -EAGAIN if the queue is full
+ *  Operation:
+ *   Inserts the note in deadline order, notes with the same deadline keep the order they were written in.
+ *   The queue timer is restarted when the note becomes the earliest one.
+ */
+static int queue_note(u64 deadline, unsigned char stepper, unsigned char note)
+{
+    unsigned long flags;
+    int i, prev;
+
+    spin_lock_irqsave(&queue_lock, flags);
+    if (queue_size == DRIVER_QUEUE_LEN) {
+        spin_unlock_irqrestore(&queue_lock, flags);
+        return -EAGAIN;
+    }
+    /* Notes usually come in deadline order, so this stops at the tail */
+    i = (queue_head + queue_size) % DRIVER_QUEUE_LEN;
+    while (i != queue_head) {
+        prev = (i + DRIVER_QUEUE_LEN - 1) % DRIVER_QUEUE_LEN;
+        if (note_queue[prev].deadline <= deadline)
+            break;
+        note_queue[i] = note_queue[prev];
+        i = prev;
+    }
+    note_queue[i].deadline = deadline;
+    note_queue[i].stepper = stepper;
+    note_queue[i].note = note;
+    queue_size++;
+    if (i == queue_head)
+        hrtimer_start(&queue_timer, ns_to_ktime(deadline), HRTIMER_MODE_ABS);
+    spin_unlock_irqrestore(&queue_lock, flags);
+
+    return 0;
+}
+
+/* Drops all queued notes */
+static void flush_queue(void)
+{
+    unsigned long flags;
+
+    hrtimer_cancel(&queue_timer);
+    spin_lock_irqsave(&queue_lock, flags);
+    queue_head = 0;
+    queue_size = 0;
+    spin_unlock_irqrestore(&queue_lock, flags);
+}
+
 /*
  * File write function
  *  Parameters:
@@ -732,56 +1019,89 @@ const struct MIDIStruct MIDITable[88] = {
  */
 static ssize_t gpio_driver_write(struct file *filp, const char *buf, size_t len, loff_t *f_pos) {
     int index;
-
-    /* Reset memory */
-    memset(gpio_driver_buffer, 0, BUF_LEN);
-    /* Get data from user space */
+    int i;
+    int result;
+    u64 deadline;
+    u32 period;
+    unsigned long flags;
+    u64 entry = ktime_get_ns();     /* Start of immediate notes for the latency statistics */
+
+    /* Longer writes don't fit in the buffer */
+    if (len > BUF_LEN) {
+        printk(KERN_INFO "[Error] Received %zu bytes, at most %d fit\n", len, BUF_LEN);
+        return -EINVAL;
+    }
+    /* Only the written bytes are read, so the buffer isn't cleared */
     if (copy_from_user(gpio_driver_buffer, buf, len) != 0) {
         return -EFAULT;
     }
     else {
-        if(len == 2){ // Got a note
-            index = gpio_driver_buffer[0];
+        /* Any 2 byte write is a note, longer ones are notes unless they start with a command byte */
+        if(len == 2 || (len > 2 && len % 2 == 0 && len <= DRIVER_BATCH_LEN && (unsigned char)gpio_driver_buffer[0] < DRIVER_FLUSH)){ // Got notes
+            /* All pairs are checked first, so a batch plays completely or not at all */
+            for (i = 0; i < len; i += 2) {
+                index = (unsigned char)gpio_driver_buffer[i];
+                if(index >= steppers_count){
+                    printk(KERN_INFO "[ERROR] Invalid stepper index %d\n", index);
+                    printk(KERN_INFO "  steppers_count = %d\n", steppers_count);
+                    printk(KERN_INFO "  max index is %d\n", steppers_count-1);
+                    /* Single notes keep their old positive return value */
+                    return len == 2 ? EINVAL : -EINVAL;
+                }
+            }
+
+            /* The queue timer plays notes on the same steppers, holding its lock starts the whole chord on one tick */
+            spin_lock_irqsave(&queue_lock, flags);
+            for (i = 0; i < len; i += 2)
+                play_note((unsigned char)gpio_driver_buffer[i], gpio_driver_buffer[i + 1], entry);
+            spin_unlock_irqrestore(&queue_lock, flags);
+
+            return len;
+        }
+        else if(len == DRIVER_TIMED_LEN && (unsigned char)gpio_driver_buffer[0] == DRIVER_TIMED_NOTE){ // Got a timed note
+            index = (unsigned char)gpio_driver_buffer[1];
             if(index >= steppers_count){
-                printk(KERN_INFO "[ERROR] Invalid stepper index %d\n", gpio_driver_buffer[0]);
-                printk(KERN_INFO "  steppers_count = %d\n", steppers_count);
-                printk(KERN_INFO "  max index is %d\n", steppers_count-1);
-                return EINVAL;
+                printk(KERN_INFO "[ERROR] Invalid stepper index %d\n", index);
+                return -EINVAL;
             }
 
-            /* Prekine se prosla nota */
-            hrtimer_cancel(&pwm_timers[index].timer);
-
-            /* Ponovo pocinje merenje vremena za max trajanje note */
-            steppers_ticks[index] = 0;
-            
-            /* No stop signal */
-            if (gpio_driver_buffer[1] != NOTE_OFF && (gpio_driver_buffer[1] >= 21 && gpio_driver_buffer[1] <= 108) ) {
-                /* Enable stepper so it will be able to play the note */
-                ClearGpioPin(steppers_en[index]);
-                /* Print for debug */
-                printk(KERN_INFO "%d -> note %d, period = %d\n", gpio_driver_buffer[0], gpio_driver_buffer[1], MIDITable[ gpio_driver_buffer[1] - 21].period);
-                /* Postavi max count na vrednost iz tabele puta 40 da duze traje */
-                steppers_max_ticks[index] = MIDITable[ gpio_driver_buffer[1] - 21 ].ticks * 80;
-                
-                /* Set interval for high resolution timer */
-                kt[index] = ktime_set(0, MIDITable[ gpio_driver_buffer[1] - 21 ].period * 500);
-                /* Set callback function */
-                pwm_timers[index].timer.function = &pwm_timer_callback;
-                /* Start timer */
-                hrtimer_start(&pwm_timers[index].timer, kt[index], HRTIMER_MODE_REL);
-            } 
-            /* Stop signal [NOTE_OFF] */
-            else {
-                SetGpioPin(steppers_en[index]); /* Disable stepper to stop wasting current */
+            /* Deadline is little endian */
+            deadline = 0;
+            for (i = 7; i >= 0; i--)
+                deadline = deadline << 8 | (unsigned char)gpio_driver_buffer[4 + i];
+
+            result = queue_note(deadline, index, gpio_driver_buffer[2]);
+            if (result < 0)
+                return result;
+            return len;
+        }
+        else if(len == DRIVER_PERIOD_LEN && (unsigned char)gpio_driver_buffer[0] == DRIVER_PERIOD){ // Got a pitch bend
+            index = (unsigned char)gpio_driver_buffer[1];
+            if(index >= steppers_count){
+                printk(KERN_INFO "[ERROR] Invalid stepper index %d\n", index);
+                return -EINVAL;
             }
-            
+
+            /* Half period is little endian */
+            period = 0;
+            for (i = 3; i >= 0; i--)
+                period = period << 8 | (unsigned char)gpio_driver_buffer[4 + i];
+            if (period < DRIVER_PERIOD_MIN || period > DRIVER_PERIOD_MAX)
+                return -EINVAL;
+
+            /* The running timer picks it up on its next edge, a silent stepper gets a new period with its next note.
+             * The tick limit stays, so a bent note lasts a little longer or shorter */
+            WRITE_ONCE(steppers_half_period[index], period);
+            return len;
+        }
+        else if(len == 1 && (unsigned char)gpio_driver_buffer[0] == DRIVER_FLUSH){
+            flush_queue();
             return len;
         }
         else{
-            printk(KERN_INFO "[Error] Received %d bytes, expecting 2", len);
+            printk(KERN_INFO "[Error] Received %zu bytes, expecting note pairs, a timed note or a period\n", len);
         }
     }
 
     return len;        
-}
\ No newline at end of file
+}
@@ -0,0 +1,53 @@
+#include <string.h>
+#include "latency.h"
+
+static const char *stageNames[LATENCY_STAGES] = {"kernel to read", "read to allocated", "allocated to written",
+                                                 "input to written"};
+
+// CLOCK_MONOTONIC time in ns
+unsigned long long monotonicNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * NS_PER_S + now.tv_nsec;
+}
+
+void initLiveLatency(liveLatency_t *latency) {
+    memset(latency, 0, sizeof(*latency));
+}
+
+// Records the read and allocation stages of a command, input is 0 if the message has no kernel timestamp
+void latencyAllocated(liveLatency_t *latency, unsigned long long input, unsigned long long read) {
+    latency->input = input;
+    latency->read = read;
+    latency->allocated = monotonicNs();
+    if (input != 0) addDrift(&latency->stages[LATENCY_KERNEL], (long long)(read - input));
+    addDrift(&latency->stages[LATENCY_ALLOC], (long long)(latency->allocated - read));
+}
+
+// Records the write and total stages of the pending command after its write returned
+void latencyWritten(liveLatency_t *latency) {
+    if (latency->allocated == 0) return;
+    unsigned long long written = monotonicNs();
+    addDrift(&latency->stages[LATENCY_WRITE], (long long)(written - latency->allocated));
+    unsigned long long first = latency->input != 0 ? latency->input : latency->read;
+    addDrift(&latency->stages[LATENCY_TOTAL], (long long)(written - first));
+    latency->allocated = 0;
+}
+
+// Prints the stages and the driver statistics if the driver exports them
+void printLatencyReport(const liveLatency_t *latency) {
+    printf("Input latency report:\n");
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        const midiDrift_t *stage = &latency->stages[i];
+        if (stage->count == 0) continue;
+        printf("  %-20s %u notes, mean %lldus, p50 %lluus, p99 %lluus, p99.9 %lluus, max %lldus\n", stageNames[i],
+               stage->count, stage->sum / stage->count / 1000, driftPercentile(stage, 0.5) / 1000,
+               driftPercentile(stage, 0.99) / 1000, driftPercentile(stage, 0.999) / 1000, stage->max / 1000);
+    }
+    // The driver adds the stages after the write, up to the first edge on the step pin
+    FILE *proc = fopen(DRIVER_LATENCY_PROC, "r");
+    if (proc == NULL) return;
+    char line[256];
+    while (fgets(line, sizeof(line), proc) != NULL) fputs(line, stdout);
+    fclose(proc);
+}
@@ -0,0 +1,38 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "midiParser.h"
+
+// Latency of live notes from the keyboard to the driver, split in stages
+
+// Driver statistics, written by the gpio_driver module
+#define DRIVER_LATENCY_PROC "/proc/gpio_driver_latency"
+
+#define LATENCY_KERNEL 0 // Kernel timestamp of the event to the program reading it, sequencer only
+#define LATENCY_ALLOC 1  // Message read from the port to its stepper allocated
+#define LATENCY_WRITE 2  // Stepper allocated to the driver write returning
+#define LATENCY_TOTAL 3  // Earliest known time of the message to the driver write returning
+#define LATENCY_STAGES 4
+
+typedef struct {
+    unsigned long long input;     // Kernel timestamp of the message, 0 if the input has none
+    unsigned long long read;      // Message read by the program
+    unsigned long long allocated; // Stepper allocated, 0 if no command is pending
+    midiDrift_t stages[LATENCY_STAGES];
+} liveLatency_t;
+
+// CLOCK_MONOTONIC time in ns
+unsigned long long monotonicNs(void);
+
+void initLiveLatency(liveLatency_t *latency);
+
+// Records the read and allocation stages of a command, input is 0 if the message has no kernel timestamp
+void latencyAllocated(liveLatency_t *latency, unsigned long long input, unsigned long long read);
+
+// Records the write and total stages of the pending command after its write returned
+void latencyWritten(liveLatency_t *latency);
+
+// Prints the stages and the driver statistics if the driver exports them
+void printLatencyReport(const liveLatency_t *latency);
+
+#endif
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "logger.h"
+
+// Time the logger thread sleeps when the ring is empty, in ns
+#define LOGGER_POLL_NS 10000000
+
+typedef struct {
+    unsigned char level;
+    unsigned char size; // Length of the text, which is not terminated
+    char text[LOG_TEXT_SIZE];
+} logRecord_t;
+
+// Single producer, single consumer ring
+// head is only written by the producer and tail by the logger thread
+static logRecord_t ring[LOG_RING_SIZE];
+static unsigned long head;
+static unsigned long tail;
+static unsigned long dropped;
+
+static int logLevel = LOG_NOTE;
+static volatile int running;
+static volatile int stopping;
+static pthread_t loggerThread;
+
+// Sets the highest level that is shown, LOG_NOTE by default
+void setLogLevel(int level) {
+    logLevel = level;
+}
+
+// Log level from its name: error, warning, info or note
+// Returns the LOG_* level or -1 if the name is unknown
+int parseLogLevel(const char *name) {
+    static const char *names[] = {"error", "warning", "info", "note"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+static void writeRecord(const logRecord_t *record) {
+    fwrite(record->text, 1, record->size, record->level <= LOG_WARNING ? stderr : stdout);
+}
+
+// Writes all records in the ring
+// Returns the number of records written
+static unsigned long drainRing(void) {
+    unsigned long end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    unsigned long start = tail;
+    for (unsigned long i = start; i != end; i++) writeRecord(&ring[i % LOG_RING_SIZE]);
+    __atomic_store_n(&tail, end, __ATOMIC_RELEASE);
+    if (end != start) fflush(stdout);
+    return end - start;
+}
+
+static void *loggerMain(void *arg) {
+    (void)arg;
+    // Output can wait, the playback and input threads can't
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+    const struct timespec poll = {0, LOGGER_POLL_NS};
+    while (!stopping) {
+        if (drainRing() == 0) nanosleep(&poll, NULL);
+    }
+    drainRing();
+    return NULL;
+}
+
+// Starts the logger thread, until then records are written directly
+// Returns 0 on faliure, 1 on success
+int startLogger(void) {
+    if (running) return 1;
+    head = tail = dropped = 0;
+    stopping = 0;
+    if (pthread_create(&loggerThread, NULL, loggerMain, NULL) != 0) {
+        fprintf(stderr, "Error creating the logger thread, logging directly\n");
+        return 0;
+    }
+    running = 1;
+    return 1;
+}
+
+// Writes the remaining records and stops the logger thread, reports the dropped records
+void stopLogger(void) {
+    if (!running) return;
+    stopping = 1;
+    pthread_join(loggerThread, NULL);
+    running = 0;
+    if (dropped != 0) fprintf(stderr, "Warning: %lu log records dropped, the console was too slow\n", dropped);
+}
+
+// Formats a record into the ring, never blocks
+// Only one thread may log while the logger runs, the record is dropped and counted if the ring is full
+void logMessage(int level, const char *format, ...) {
+    if (level > logLevel) return;
+    va_list args;
+    va_start(args, format);
+    if (!running) {
+        vfprintf(level <= LOG_WARNING ? stderr : stdout, format, args);
+        va_end(args);
+        return;
+    }
+
+    unsigned long position = head;
+    if (position - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+    logRecord_t *record = &ring[position % LOG_RING_SIZE];
+    int size = vsnprintf(record->text, LOG_TEXT_SIZE, format, args);
+    va_end(args);
+    record->level = level;
+    record->size = size < 0 ? 0 : size < LOG_TEXT_SIZE ? size : LOG_TEXT_SIZE - 1;
+    // Cut records still end the line
+    if (size >= LOG_TEXT_SIZE) record->text[record->size - 1] = '\n';
+    __atomic_store_n(&head, position + 1, __ATOMIC_RELEASE);
+}
+
+// Records dropped because the ring was full
+unsigned long loggerDropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+// Log levels, a record is shown if its level is at most the logger level
+#define LOG_ERROR 0
+#define LOG_WARNING 1 // Errors and warnings go to stderr, the rest to stdout
+#define LOG_INFO 2    // Song information: tempo, time signature, track names
+#define LOG_NOTE 3    // Every note played
+
+// Records in the ring, a power of two
+#define LOG_RING_SIZE 512
+// Longest record, longer ones are cut
+#define LOG_TEXT_SIZE 250
+
+// Sets the highest level that is shown, LOG_NOTE by default
+void setLogLevel(int level);
+
+// Log level from its name: error, warning, info or note
+// Returns the LOG_* level or -1 if the name is unknown
+int parseLogLevel(const char *name);
+
+// Starts the logger thread, until then records are written directly
+// Returns 0 on faliure, 1 on success
+int startLogger(void);
+
+// Writes the remaining records and stops the logger thread, reports the dropped records
+void stopLogger(void);
+
+// Formats a record into the ring, never blocks
+// Only one thread may log while the logger runs, the record is dropped and counted if the ring is full
+void logMessage(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Records dropped because the ring was full
+unsigned long loggerDropped(void);
+
+#endif
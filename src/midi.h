@@ -5,6 +5,29 @@
 
 #define NOTE_OFF 0xFF
 
+// Notes the driver can play, A0 to C8
+#define NOTE_LOWEST 21
+#define NOTE_HIGHEST 108
+
+// Driver commands, a 2 byte write [stepper][note] plays the note immediately
+// A write of up to DRIVER_BATCH_MAX such pairs plays all of them at once, in order, or none if an index is invalid
+#define DRIVER_BATCH_MAX 40
+#define DRIVER_BATCH_LEN (DRIVER_BATCH_MAX * 2)
+// [DRIVER_TIMED_NOTE][stepper][note][0][deadline] queues the note until deadline, an 8 byte little endian
+// CLOCK_MONOTONIC time in ns. The write fails with EAGAIN when DRIVER_QUEUE_LEN notes are queued
+#define DRIVER_TIMED_NOTE 0xF1
+#define DRIVER_TIMED_LEN 12
+#define DRIVER_QUEUE_LEN 256
+// 1 byte write that drops all queued notes
+#define DRIVER_FLUSH 0xF0
+// [DRIVER_PERIOD][stepper][0][0][half period] changes the half period of the playing note, a 4 byte little
+// endian time in ns, without restarting the stepper's timer. The next edge comes at the new period
+// The write fails with EINVAL if the period is out of range, a silent stepper ignores it
+#define DRIVER_PERIOD 0xF2
+#define DRIVER_PERIOD_LEN 8
+#define DRIVER_PERIOD_MIN 20000     // ns, 25kHz
+#define DRIVER_PERIOD_MAX 100000000 // ns, 5Hz
+
 // MIDI CONSTANTS
 
 #define HEADER_CHUNK_ID 0x4D546864
@@ -67,4 +90,25 @@ static inline unsigned int bpmToMs(unsigned int bpm) {
     return MICROSECONDS_PER_MINUTE / bpm;
 }
 
+// Latency histogram buckets, exact below 16us and then 8 buckets per power of two
+// Shared by the player and the driver, so their histograms can be compared bucket by bucket
+#define LATENCY_BUCKETS 240
+
+// Histogram bucket of a latency in us
+static inline unsigned int latencyBucket(unsigned long long us) {
+    unsigned int msb;
+    if (us < 16) return us;
+    msb = 63 - __builtin_clzll(us);
+    if (msb > 31) return LATENCY_BUCKETS - 1;
+    return 16 + (msb - 4) * 8 + ((us >> (msb - 3)) & 7);
+}
+
+// Largest latency in us that falls into the bucket
+static inline unsigned long long latencyBucketLimit(unsigned int bucket) {
+    unsigned int shift;
+    if (bucket < 16) return bucket;
+    shift = (bucket - 16) / 8 + 1;
+    return ((8ULL + (bucket - 16) % 8 + 1) << shift) - 1;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,498 @@
+/*
+ * Indexes a library of MIDI files so songs that can't be played on the
+ * available steppers can be found before a show.
+ *
+ * The directory tree is scanned, every .mid file is parsed on a pool of
+ * threads and one tab separated row per file is written to the index.
+ * Rows of files whose mtime and size didn't change since the last run are
+ * reused without reading the file, files that were only touched are
+ * recognised by their content hash.
+ *
+ * Use:
+ *  ./bin/midiIndex DIR [--index FILE] [--threads N] [--steppers N]
+ */
+
+#define _GNU_SOURCE
+#include <ftw.h>
+#include <string.h>
+#include <strings.h>
+#include "midiParser.h"
+#include "scoreCache.h"
+
+#define INDEX_DEFAULT_NAME "midiIndex.tsv"
+#define INDEX_HEADER "#path\tmtime\tsize\thash\tstatus\tformat\ttracks\tduration_s\ttempo_changes\tnotes\tlow\thigh\t" \
+                     "out_of_range\tpeak_polyphony\tfits\ttrack_notes\n"
+
+// How the row of a file was produced
+#define ENTRY_PARSED 0
+#define ENTRY_UNCHANGED 1
+#define ENTRY_REHASHED 2
+
+typedef struct {
+    char *path;
+    long long mtime; // ns
+    long long size;
+    unsigned long long hash;
+    int ok;          // 0 if the file couldn't be parsed
+    int source;      // ENTRY_*
+    unsigned short format;
+    unsigned short trackN;
+    double duration; // s
+    unsigned int tempoChanges;
+    unsigned int noteN;
+    unsigned int low;
+    unsigned int high;
+    unsigned int outOfRange; // Notes outside NOTE_LOWEST - NOTE_HIGHEST
+    unsigned int peak;       // Most notes sounding at once
+    char *trackNotes;        // Comma separated note count of every track
+} indexEntry_t;
+
+typedef struct {
+    indexEntry_t *entries;
+    unsigned int entryN;
+    unsigned int entrySize;
+} index_t;
+
+// Note start (+1) or end (-1) for the polyphony sweep line
+typedef struct {
+    unsigned long long tick;
+    int delta;
+} noteEdge_t;
+
+// Tempo change in song ticks, order keeps changes on the same tick in file order
+typedef struct {
+    unsigned long long tick;
+    unsigned int order;
+    unsigned int tempo;
+} tempoChange_t;
+
+typedef struct {
+    index_t *files;
+    const index_t *old;
+    volatile unsigned int next;
+} indexJob_t;
+
+// Files found by the directory walk, nftw has no user pointer
+static index_t *walkFiles;
+
+static int comparePath(const void *a, const void *b) {
+    return strcmp(((const indexEntry_t *)a)->path, ((const indexEntry_t *)b)->path);
+}
+
+static int compareTempo(const void *a, const void *b) {
+    const tempoChange_t *x = (const tempoChange_t *)a, *y = (const tempoChange_t *)b;
+    if (x->tick != y->tick) return x->tick < y->tick ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Adds an empty entry to the index
+// Returns NULL on faliure
+static indexEntry_t *addEntry(index_t *index) {
+    if (index->entryN == index->entrySize) {
+        unsigned int size = index->entrySize ? index->entrySize * 2 : 256;
+        indexEntry_t *entries = (indexEntry_t *)realloc(index->entries, sizeof(indexEntry_t) * size);
+        if (entries == NULL) return NULL;
+        index->entries = entries;
+        index->entrySize = size;
+    }
+    indexEntry_t *entry = &index->entries[index->entryN++];
+    memset(entry, 0, sizeof(indexEntry_t));
+    return entry;
+}
+
+static void freeIndex(index_t *index) {
+    for (unsigned int i = 0; i < index->entryN; i++) {
+        free(index->entries[i].path);
+        free(index->entries[i].trackNotes);
+    }
+    free(index->entries);
+    index->entries = NULL;
+    index->entryN = index->entrySize = 0;
+}
+
+static int isMidiFile(const char *path) {
+    const char *ext = strrchr(path, '.');
+    return ext != NULL && (strcasecmp(ext, ".mid") == 0 || strcasecmp(ext, ".midi") == 0);
+}
+
+static int walkEntry(const char *path, const struct stat *fileStat, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F || !isMidiFile(path)) return 0;
+    if (strpbrk(path, "\t\n") != NULL) {
+        fprintf(stderr, "Warning: Skipping %s, tabs and newlines can't be stored in the index\n", path);
+        return 0;
+    }
+    indexEntry_t *entry = addEntry(walkFiles);
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        fprintf(stderr, "Not enough memory available!\n");
+        return -1;
+    }
+    entry->mtime = (long long)fileStat->st_mtim.tv_sec * NS_PER_S + fileStat->st_mtim.tv_nsec;
+    entry->size = fileStat->st_size;
+    return 0;
+}
+
+// Finds all MIDI files under dir, sorted by path
+// Returns 0 on faliure, 1 on success
+static int findFiles(index_t *files, const char *dir) {
+    walkFiles = files;
+    if (nftw(dir, walkEntry, 32, FTW_PHYS) != 0) {
+        fprintf(stderr, "Error while scanning %s\n", dir);
+        return 0;
+    }
+    qsort(files->entries, files->entryN, sizeof(indexEntry_t), comparePath);
+    return 1;
+}
+
+// Reads the index of the previous run, a missing index is an empty one
+// Returns 0 on faliure, 1 on success
+static int readIndex(index_t *index, const char *indexName) {
+    FILE *file = fopen(indexName, "r");
+    if (file == NULL) return 1;
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t len;
+    while ((len = getline(&line, &lineSize, file)) > 0) {
+        if (line[0] == '#') continue;
+        if (line[len - 1] == '\n') line[len - 1] = '\0';
+
+        char *fields[16];
+        int fieldN = 0;
+        for (char *field = line; fieldN < 16; fieldN++) {
+            fields[fieldN] = field;
+            field = strchr(field, '\t');
+            if (field == NULL) {
+                fieldN++;
+                break;
+            }
+            *field++ = '\0';
+        }
+        // Broken rows are dropped and the file is parsed again
+        if (fieldN != 16) continue;
+
+        indexEntry_t *entry = addEntry(index);
+        if (entry == NULL) {
+            fprintf(stderr, "Not enough memory available!\n");
+            break;
+        }
+        entry->path = strdup(fields[0]);
+        entry->mtime = strtoll(fields[1], NULL, 10);
+        entry->size = strtoll(fields[2], NULL, 10);
+        entry->hash = strtoull(fields[3], NULL, 16);
+        entry->ok = strcmp(fields[4], "ok") == 0;
+        entry->format = atoi(fields[5]);
+        entry->trackN = atoi(fields[6]);
+        entry->duration = strtod(fields[7], NULL);
+        entry->tempoChanges = strtoul(fields[8], NULL, 10);
+        entry->noteN = strtoul(fields[9], NULL, 10);
+        entry->low = strtoul(fields[10], NULL, 10);
+        entry->high = strtoul(fields[11], NULL, 10);
+        entry->outOfRange = strtoul(fields[12], NULL, 10);
+        entry->peak = strtoul(fields[13], NULL, 10);
+        entry->trackNotes = strdup(fields[15]);
+        if (entry->path == NULL || entry->trackNotes == NULL) {
+            fprintf(stderr, "Not enough memory available!\n");
+            index->entryN--;
+            free(entry->path);
+            free(entry->trackNotes);
+            break;
+        }
+    }
+    free(line);
+    fclose(file);
+    qsort(index->entries, index->entryN, sizeof(indexEntry_t), comparePath);
+    return 1;
+}
+
+// Collects the note, tempo and length statistics of a song
+// Format 2 tracks are independent songs, they are measured as played one after another
+// Returns 0 on faliure, 1 on success
+static int analyzeSong(const midiData_t *data, indexEntry_t *entry) {
+    size_t eventN = 0;
+    for (unsigned short i = 0; i < data->header.trackN; i++) eventN += data->tracks[i].eventN;
+    // Every note on has a start and an end edge
+    noteEdge_t *edges = (noteEdge_t *)malloc(sizeof(noteEdge_t) * 2 * (eventN ? eventN : 1));
+    tempoChange_t *tempos = (tempoChange_t *)malloc(sizeof(tempoChange_t) * (eventN ? eventN : 1));
+    // Edges of track i are edges[trackEdges[i]] to edges[trackEdges[i + 1]], already in tick order
+    size_t *trackEdges = (size_t *)malloc(sizeof(size_t) * (data->header.trackN + 1));
+    trackCursor_t *heap = (trackCursor_t *)malloc(sizeof(trackCursor_t) * (data->header.trackN ? data->header.trackN : 1));
+    size_t trackNotesSize = (size_t)data->header.trackN * 11 + 1;
+    entry->trackNotes = (char *)malloc(trackNotesSize);
+    if (edges == NULL || tempos == NULL || trackEdges == NULL || heap == NULL || entry->trackNotes == NULL) {
+        fprintf(stderr, "Not enough memory available!\n");
+        free(edges);
+        free(tempos);
+        free(trackEdges);
+        free(heap);
+        return 0;
+    }
+    entry->trackNotes[0] = '\0';
+
+    size_t edgeN = 0, tempoN = 0, trackNotesLen = 0;
+    unsigned long long songEnd = 0, trackStart = 0;
+    entry->low = 127;
+    for (unsigned short i = 0; i < data->header.trackN; i++) {
+        const midiTrack_t *track = &data->tracks[i];
+        trackEdges[i] = edgeN;
+        unsigned short sounding[16][128];
+        unsigned int trackNoteN = 0;
+        memset(sounding, 0, sizeof(sounding));
+        unsigned long long tick = trackStart;
+        for (unsigned int j = 0; j < track->eventN; j++) {
+            const midiEvent_t *event = &track->events[j];
+            tick += event->delta;
+            if (event->status == STATUS_META) {
+                const unsigned char *bytes = data->map + track->eventData[j].offset;
+                if (event->param1 == META_TEMPO && track->eventData[j].size >= 3) {
+                    tempos[tempoN] = (tempoChange_t){tick, (unsigned int)tempoN, bytes[0] << 16 | bytes[1] << 8 | bytes[2]};
+                    tempoN++;
+                }
+                continue;
+            }
+            if (event->status >= STATUS_SYSEX) continue;
+            unsigned char statusUpper = event->status & 0xF0;
+            unsigned char channel = event->status & 0x0F;
+            unsigned char note = event->param1 & 0x7F;
+            if (statusUpper == MSG_NOTE_ON && event->param2 != 0) {
+                sounding[channel][note]++;
+                edges[edgeN++] = (noteEdge_t){tick, 1};
+                trackNoteN++;
+                if (note < entry->low) entry->low = note;
+                if (note > entry->high) entry->high = note;
+                if (note < NOTE_LOWEST || note > NOTE_HIGHEST) entry->outOfRange++;
+            } else if ((statusUpper == MSG_NOTE_OFF || statusUpper == MSG_NOTE_ON) && sounding[channel][note] > 0) {
+                // Note offs without a matching note on are ignored
+                sounding[channel][note]--;
+                edges[edgeN++] = (noteEdge_t){tick, -1};
+            }
+        }
+        // Notes still sounding end with the track
+        for (int channel = 0; channel < 16; channel++) {
+            for (int note = 0; note < 128; note++) {
+                for (; sounding[channel][note] > 0; sounding[channel][note]--) edges[edgeN++] = (noteEdge_t){tick, -1};
+            }
+        }
+        if (tick > songEnd) songEnd = tick;
+        if (data->header.format == 2) trackStart = tick;
+        entry->noteN += trackNoteN;
+        trackNotesLen += snprintf(entry->trackNotes + trackNotesLen, trackNotesSize - trackNotesLen,
+                                  i ? ",%u" : "%u", trackNoteN);
+    }
+    trackEdges[data->header.trackN] = edgeN;
+    if (entry->noteN == 0) entry->low = 0;
+
+    // Sweep line over the tracks merged in tick order, counted once all edges of a tick are applied
+    // so notes ending on a tick don't overlap notes starting on it
+    unsigned int heapSize = 0;
+    for (unsigned short i = 0; i < data->header.trackN; i++) {
+        if (trackEdges[i] == trackEdges[i + 1]) continue;
+        heap[heapSize++] = (trackCursor_t){edges[trackEdges[i]].tick, (unsigned int)trackEdges[i], i};
+        heapUp(heap, heapSize);
+    }
+    int active = 0;
+    while (heapSize > 0) {
+        unsigned long long tick = heap[0].tick;
+        while (heapSize > 0 && heap[0].tick == tick) {
+            trackCursor_t *cursor = &heap[0];
+            active += edges[cursor->index].delta;
+            if (++cursor->index < trackEdges[cursor->track + 1]) {
+                cursor->tick = edges[cursor->index].tick;
+            } else {
+                heap[0] = heap[--heapSize];
+            }
+            if (heapSize > 0) heapDown(heap, heapSize);
+        }
+        if (active > (int)entry->peak) entry->peak = active;
+    }
+
+    // Length through the tempo map
+    qsort(tempos, tempoN, sizeof(tempoChange_t), compareTempo);
+    unsigned short timeDiv = data->header.timediv & 0x7FFF;
+    midiCompiler_t compiler;
+    initCompiler(&compiler, timeDiv ? timeDiv : 1);
+    for (size_t i = 0; i < tempoN; i++) compilerSetTempo(&compiler, tempos[i].tick, tempos[i].tempo);
+    entry->duration = timeDiv ? compilerTime(&compiler, songEnd) / 1e9 : 0;
+    entry->tempoChanges = tempoN;
+
+    free(edges);
+    free(tempos);
+    free(trackEdges);
+    free(heap);
+    return 1;
+}
+
+// Binary search in the sorted previous index
+static const indexEntry_t *findEntry(const index_t *index, const char *path) {
+    unsigned int low = 0, high = index->entryN;
+    while (low < high) {
+        unsigned int mid = (low + high) / 2;
+        int cmp = strcmp(index->entries[mid].path, path);
+        if (cmp == 0) return &index->entries[mid];
+        if (cmp < 0) low = mid + 1;
+        else high = mid;
+    }
+    return NULL;
+}
+
+// Copies the statistics of a previous row into the entry
+// Returns 0 on faliure, 1 on success
+static int reuseEntry(indexEntry_t *entry, const indexEntry_t *old, int source) {
+    char *path = entry->path;
+    long long mtime = entry->mtime;
+    *entry = *old;
+    entry->path = path;
+    entry->mtime = mtime;
+    entry->source = source;
+    entry->trackNotes = strdup(old->trackNotes);
+    return entry->trackNotes != NULL;
+}
+
+// Hashes the content of the file without decoding it
+// Returns 0 on faliure, 1 on success
+static int hashFile(const char *path, unsigned long long *hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error while opening file %s\n", path);
+        return 0;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0 || fileStat.st_size == 0) {
+        fprintf(stderr, "Error while reading file %s\n", path);
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error while mapping file %s\n", path);
+        return 0;
+    }
+    madvise(map, fileStat.st_size, MADV_SEQUENTIAL);
+    *hash = hashBytes((const unsigned char *)map, fileStat.st_size);
+    munmap(map, fileStat.st_size);
+    return 1;
+}
+
+// Fills one index row, reading the file only if it changed since the previous index
+static void indexFile(indexEntry_t *entry, const index_t *old) {
+    const indexEntry_t *previous = findEntry(old, entry->path);
+    if (previous != NULL && previous->mtime == entry->mtime && previous->size == entry->size) {
+        if (reuseEntry(entry, previous, ENTRY_UNCHANGED)) return;
+    }
+
+    // Touched files keep their row if the content is the same
+    if (!hashFile(entry->path, &entry->hash)) {
+        entry->ok = 0;
+        entry->source = ENTRY_PARSED;
+        return;
+    }
+    if (previous != NULL && previous->hash == entry->hash && previous->size == entry->size &&
+        reuseEntry(entry, previous, ENTRY_REHASHED)) {
+        return;
+    }
+
+    midi_t midi;
+    if (!readMidiFile(&midi, entry->path)) {
+        entry->ok = 0;
+        entry->source = ENTRY_PARSED;
+        return;
+    }
+    entry->source = ENTRY_PARSED;
+    entry->format = midi.data.header.format;
+    entry->trackN = midi.data.header.trackN;
+    entry->ok = analyzeSong(&midi.data, entry);
+    freeMidi(&midi);
+}
+
+static void *indexWorker(void *arg) {
+    indexJob_t *job = (indexJob_t *)arg;
+    unsigned int i;
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->files->entryN) {
+        indexFile(&job->files->entries[i], job->old);
+    }
+    return NULL;
+}
+
+// Writes the index to a temporary file and renames it over the old one
+// Returns 0 on faliure, 1 on success
+static int writeIndex(const index_t *index, const char *indexName, unsigned int steppers) {
+    char tempName[4096];
+    if (snprintf(tempName, sizeof(tempName), "%s.%d.tmp", indexName, (int)getpid()) >= (int)sizeof(tempName)) return 0;
+    FILE *file = fopen(tempName, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error while opening file %s\n", tempName);
+        return 0;
+    }
+    fputs(INDEX_HEADER, file);
+    for (unsigned int i = 0; i < index->entryN; i++) {
+        const indexEntry_t *entry = &index->entries[i];
+        int fits = entry->ok && entry->peak <= steppers && entry->outOfRange == 0;
+        fprintf(file, "%s\t%lld\t%lld\t%016llx\t%s\t%u\t%u\t%.3f\t%u\t%u\t%u\t%u\t%u\t%u\t%s\t%s\n", entry->path,
+                entry->mtime, entry->size, entry->hash, entry->ok ? "ok" : "error", entry->format, entry->trackN,
+                entry->duration, entry->tempoChanges, entry->noteN, entry->low, entry->high, entry->outOfRange,
+                entry->peak, fits ? "yes" : "no", entry->trackNotes ? entry->trackNotes : "");
+    }
+    if (fclose(file) != 0 || rename(tempName, indexName) < 0) {
+        fprintf(stderr, "Error while writing file %s\n", indexName);
+        unlink(tempName);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        printf("Use: midiIndex [DIR] [OPTIONS]\n");
+        printf("  --index FILE   index to update, default is %s\n", INDEX_DEFAULT_NAME);
+        printf("  --threads N    threads used to parse files, default is the number of cores\n");
+        printf("  --steppers N   steppers available when deciding if a song fits, default is %d\n", MAX_STEPPERS);
+        return EXIT_FAILURE;
+    }
+    const char *indexName = INDEX_DEFAULT_NAME;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int steppers = MAX_STEPPERS;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--index") == 0 && i + 1 < argc) indexName = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--steppers") == 0 && i + 1 < argc) steppers = atoi(argv[++i]);
+    }
+    if (threads < 1) threads = 1;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    index_t files = {NULL, 0, 0}, old = {NULL, 0, 0};
+    if (!findFiles(&files, argv[1]) || !readIndex(&old, indexName)) {
+        freeIndex(&files);
+        freeIndex(&old);
+        return EXIT_FAILURE;
+    }
+
+    indexJob_t job = {&files, &old, 0};
+    if (threads > (long)files.entryN) threads = files.entryN ? files.entryN : 1;
+    pthread_t workers[MAX_PARSE_THREADS];
+    unsigned int workerN = 0;
+    while (workerN + 1 < (unsigned long)threads && workerN < MAX_PARSE_THREADS &&
+           pthread_create(&workers[workerN], NULL, indexWorker, &job) == 0) {
+        workerN++;
+    }
+    indexWorker(&job);
+    for (unsigned int i = 0; i < workerN; i++) pthread_join(workers[i], NULL);
+
+    int ret = writeIndex(&files, indexName, steppers);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    unsigned int counts[3] = {0, 0, 0}, errors = 0, fitting = 0;
+    for (unsigned int i = 0; i < files.entryN; i++) {
+        const indexEntry_t *entry = &files.entries[i];
+        counts[entry->source]++;
+        if (!entry->ok) errors++;
+        else if (entry->peak <= steppers && entry->outOfRange == 0) fitting++;
+    }
+    fprintf(stderr, "Indexed %u files in %.1f ms: %u parsed, %u unchanged, %u rehashed, %u errors, %u fit %u steppers\n",
+            files.entryN, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+            counts[ENTRY_PARSED], counts[ENTRY_UNCHANGED], counts[ENTRY_REHASHED], errors, fitting, steppers);
+
+    freeIndex(&files);
+    freeIndex(&old);
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
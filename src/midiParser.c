@@ -1,102 +1,99 @@
+#include <string.h>
+#include <errno.h>
 #include "midiParser.h"
+#include "logger.h"
 
-static inline unsigned long deltaToNs(unsigned int delta, unsigned int tempo, unsigned short timeDiv) {
-    double retVal = delta;
-    retVal /= timeDiv;
-    retVal *= tempo * 1000;
-    return retVal;
+static inline void addNs(struct timespec *time, unsigned long long ns) {
+    ns += time->tv_nsec;
+    time->tv_sec += ns / NS_PER_S;
+    time->tv_nsec = ns % NS_PER_S;
 }
 
-listMidiEvent_t newList() { return (listMidiEvent_t){NULL, NULL}; }
-
-void listAdd(const midiEvent_t *event, listMidiEvent_t *list) {
-    nodeMidiEvent_t *newItem = (nodeMidiEvent_t *)malloc(sizeof(nodeMidiEvent_t));
-    newItem->event = *event;
-    newItem->next = NULL;
-
-    if (list->first == NULL) {
-        list->first = newItem;
-    } else {
-        list->last->next = newItem;
+static inline void subNs(struct timespec *time, unsigned long long ns) {
+    long long nsec = time->tv_nsec - (long long)(ns % NS_PER_S);
+    time->tv_sec -= ns / NS_PER_S;
+    if (nsec < 0) {
+        nsec += NS_PER_S;
+        time->tv_sec--;
     }
-    list->last = newItem;
+    time->tv_nsec = nsec;
 }
 
-void listFree(listMidiEvent_t *list) {
-    nodeMidiEvent_t *curr = list->first;
-    nodeMidiEvent_t *old;
-
-    while (curr->next != NULL) {
-        old = curr;
-        curr = curr->next;
-        free(old->event.data);
-        free(old);
-    }
-
-    free(curr->event.data);
-    free(curr);
-    list->first = NULL;
-    list->last = NULL;
+static inline long long diffNs(const struct timespec *a, const struct timespec *b) {
+    return (long long)(a->tv_sec - b->tv_sec) * NS_PER_S + (a->tv_nsec - b->tv_nsec);
 }
 
 void freeMidiData(midiData_t *data) {
-    // In case we didn't read the track number yet
-    if (data->header.format != HEADER_CHUNK_ID) return;
-    for (size_t i = 0; i < data->header.trackN; i++) {
-        listFree(&data->tracks[i].eventList);
-    }
+    // Tracks and all of their events live in one arena
     free(data->tracks);
+    data->tracks = NULL;
+    if (data->map != NULL) {
+        munmap((void *)data->map, data->mapSize);
+        data->map = NULL;
+    }
 }
 
-// Reads size bytes from midiFile and outputs the result as a little-endian integer
-unsigned int readInt(int size, FILE *midiFile) {
+// Reads size bytes from the mapped file and outputs the result as a big-endian integer
+unsigned int readInt(int size, midiReader_t *reader) {
     if (size > 4)
         return 0;
+    if (reader->end - reader->pos < size) {
+        reader->error = 1;
+        return 0;
+    }
     unsigned int retVal = 0;
-    unsigned char buffer;
-    size--;
-    while (size >= 0) {
-        fread(&buffer, 1, 1, midiFile);
-        retVal += buffer << (8 * size);
+    while (size > 0) {
+        retVal = (retVal << 8) | *reader->pos++;
         size--;
     }
     return retVal;
 }
 
-// Reads a variable-lenght value from midiFile and outputs the result as a little-endian integer
-unsigned int readVarInt(FILE *midiFile) {
+// Reads a variable-lenght value from the mapped file and outputs the result as a little-endian integer
+unsigned int readVarInt(midiReader_t *reader) {
     unsigned int retVal = 0;
-    unsigned char buffer[4];
-    int i = 0;
-    while (i < 4) {
-        fread(buffer + i, 1, 1, midiFile);
-        // If most significant bit is 1
-        if (buffer[i] & 0x80) {
-            // There are more bytes
-            buffer[i] ^= 0x80;
-            i++;
-        } else {
-            // This is the last byte
-            for (int j = 0; j <= i; j++) {
-                retVal += buffer[j] << (7 * (i - j));
-            }
-            return retVal;
+    for (int i = 0; i < 4; i++) {
+        if (reader->pos >= reader->end) {
+            reader->error = 1;
+            return 0;
         }
+        unsigned char byte = *reader->pos++;
+        retVal = (retVal << 7) | (byte & 0x7F);
+        // If most significant bit is 0 this is the last byte
+        if (!(byte & 0x80)) return retVal;
     }
+    reader->error = 1;
     return 0;
 }
 
+// Returns a view of size bytes from the mapped file and skips over them
+const unsigned char *readData(unsigned int size, midiReader_t *reader) {
+    if (size == 0) return NULL;
+    if ((size_t)(reader->end - reader->pos) < size) {
+        reader->error = 1;
+        return NULL;
+    }
+    const unsigned char *data = reader->pos;
+    reader->pos += size;
+    return data;
+}
+
 // Reads othe MIDI file header
 // Returns 0 on faliure, 1 on success
-int readHeader(midiHeader_t *header, FILE *midiFile) {
-    if (readInt(4, midiFile) != HEADER_CHUNK_ID) {
+int readHeader(midiHeader_t *header, midiReader_t *reader) {
+    if (readInt(4, reader) != HEADER_CHUNK_ID) {
         fprintf(stderr, "Wrong file type or file corrupted!\n");
         return 0;
     }
-    readInt(4, midiFile); // Read the header size bytes, don't store them
-    header->format = readInt(2, midiFile);
-    header->trackN = readInt(2, midiFile);
-    header->timediv = readInt(2, midiFile);
+    unsigned int headerSize = readInt(4, reader);
+    midiReader_t headerReader = {reader->pos, reader->pos + headerSize, 0, 0};
+    header->format = readInt(2, &headerReader);
+    header->trackN = readInt(2, &headerReader);
+    header->timediv = readInt(2, &headerReader);
+    if (headerReader.error || readData(headerSize, reader) == NULL) {
+        fprintf(stderr, "Error while reading header - file truncated\n");
+        return 0;
+    }
     // Check if timing is metrical or timecode
     if (header->timediv & 0x8000) {
         fprintf(stderr, "Timecode timing not yet supported!\n");
@@ -105,225 +102,1165 @@ int readHeader(midiHeader_t *header, FILE *midiFile) {
     return 1;
 }
 
-// Reads one MIDI event from file
+// Reads one MIDI event from the mapped file
+// Meta and SysEx payloads are stored as offsets into the mapping, not copies
 // Returns 0 on faliure, 1 on success
-int readEvent(listMidiEvent_t *list, FILE *midiFile) {
-    midiEvent_t event;
-    event.delta = readVarInt(midiFile);
-    event.status = readInt(1, midiFile);
-    if (event.status == 0xFF) {
-        // Meta event
-        event.param1 = readInt(1, midiFile);
-        event.param2 = 0;
-        event.dataSize = readVarInt(midiFile);
-        if (event.dataSize != 0) {
-            event.data = (unsigned char *)malloc(event.dataSize);
-            fread(event.data, 1, event.dataSize, midiFile);
-        } else {
-            event.data = NULL;
+int readEvent(midiEvent_t *event, midiEventData_t *eventData, const unsigned char *map, midiReader_t *reader) {
+    const unsigned char *data = NULL;
+    eventData->size = 0;
+    event->delta = readVarInt(reader);
+    event->status = readInt(1, reader);
+    if (reader->error) return 0;
+    if (event->status < 0x80) {
+        // Running status, the byte we read is the first parameter
+        if (reader->runningStatus == 0) {
+            fprintf(stderr, "Error while reading midi event - running status without a previous status\n");
+            return 0;
         }
-    } else if (event.status == 0xF0 || event.status == 0xF7) {
+        reader->pos--;
+        event->status = reader->runningStatus;
+    }
+    if (event->status == 0xFF) {
+        // Meta event
+        event->param1 = readInt(1, reader);
+        event->param2 = 0;
+        eventData->size = readVarInt(reader);
+        data = readData(eventData->size, reader);
+    } else if (event->status == 0xF0 || event->status == 0xF7) {
         // SysEx event
-        event.param1 = 0;
-        event.param2 = 0;
-        event.dataSize = readVarInt(midiFile);
-        if (event.dataSize != 0) {
-            event.data = (unsigned char *)malloc(event.dataSize);
-            fread(event.data, 1, event.dataSize, midiFile);
-        } else {
-            event.data = NULL;
-        }
-    } else if (event.status >= 0x80 && event.status <= 0xEF) {
+        event->param1 = 0;
+        event->param2 = 0;
+        eventData->size = readVarInt(reader);
+        data = readData(eventData->size, reader);
+        // SysEx cancels running status
+        reader->runningStatus = 0;
+    } else if (event->status >= 0x80 && event->status <= 0xEF) {
         // MIDI event
-        event.dataSize = 0;
-        event.data = NULL;
-        event.param1 = readInt(1, midiFile);
-        unsigned char type = event.status & 0xF0;
+        event->param1 = readInt(1, reader);
+        event->param2 = 0;
+        unsigned char type = event->status & 0xF0;
         if (type != 0xC0 && type != 0xD0) {
-            event.param2 = readInt(1, midiFile);
+            event->param2 = readInt(1, reader);
         }
+        reader->runningStatus = event->status;
     } else {
-        fprintf(stderr, "Error while reading midi event - invalid status byte %02X\n", event.status);
+        fprintf(stderr, "Error while reading midi event - invalid status byte %02X\n", event->status);
         return 0;
     }
-    listAdd(&event, list);
+    // Truncation is reported by the caller, the streaming reader refills and retries
+    if (reader->error) return 0;
+    eventData->offset = data != NULL ? data - map : 0;
     return 1;
 }
 
-// Reads one track from file
+// Finds the next track chunk in the mapped file, the chunk is length prefixed so it's not decoded
 // Returns 0 on faliure, 1 on success
-int readTrack(midiTrack_t *track, FILE *midiFile) {
-    if (readInt(4, midiFile) != TRACK_CHUNK_ID) {
+int readTrackHeader(midiTrack_t *track, const unsigned char *map, midiReader_t *reader) {
+    if (readInt(4, reader) != TRACK_CHUNK_ID) {
         fprintf(stderr, "Error while reading track header - invalid ID\n");
         return 0;
     }
-    track->size = readInt(4, midiFile);
-    track->eventList = newList();
-    long startPos = ftell(midiFile);
+    track->size = readInt(4, reader);
+    const unsigned char *start = readData(track->size, reader);
+    if (reader->error) {
+        fprintf(stderr, "Error while reading track - file truncated\n");
+        return 0;
+    }
+    track->offset = start != NULL ? start - map : 0;
+    track->eventN = 0;
+    return 1;
+}
 
-    while (ftell(midiFile) - startPos < track->size) {
-        if (!readEvent(&track->eventList, midiFile)) return 0;
+// Counts the events of a track and checks that they can be decoded
+// Returns 0 on faliure, 1 on success
+int countTrack(midiTrack_t *track, const unsigned char *map) {
+    midiEvent_t event;
+    midiEventData_t eventData;
+    const unsigned char *start = map + track->offset;
+    midiReader_t trackReader = {start, start + track->size, 0, 0};
+    track->eventN = 0;
+    while (trackReader.pos < trackReader.end) {
+        if (!readEvent(&event, &eventData, map, &trackReader)) {
+            if (trackReader.error) fprintf(stderr, "Error while reading midi event - track truncated\n");
+            return 0;
+        }
+        track->eventN++;
     }
     return 1;
 }
 
-// Reads all data from file
+// Decodes the events of a track into its arrays, the track was already checked by countTrack
+int readTrack(midiTrack_t *track, const unsigned char *map) {
+    const unsigned char *start = map + track->offset;
+    midiReader_t trackReader = {start, start + track->size, 0, 0};
+    for (unsigned int i = 0; i < track->eventN; i++) {
+        readEvent(&track->events[i], &track->eventData[i], map, &trackReader);
+    }
+    return 1;
+}
+
+// Grows the track array into the arena: [tracks][events][event data]
 // Returns 0 on faliure, 1 on success
-int readMidiData(midiData_t *midiData, FILE *midiFile) {
-    if (!readHeader(&midiData->header, midiFile)) return 0;
+int allocArena(midiData_t *midiData) {
+    unsigned short trackN = midiData->header.trackN;
+    size_t tracksSize = sizeof(midiTrack_t) * trackN;
+    size_t eventN = 0;
+    for (size_t i = 0; i < trackN; i++) eventN += midiData->tracks[i].eventN;
 
-    midiData->tracks = (midiTrack_t *)malloc(sizeof(midiTrack_t) * midiData->header.trackN);
-    if (midiData->tracks == NULL) {
+    size_t arenaSize = tracksSize + eventN * (sizeof(midiEvent_t) + sizeof(midiEventData_t));
+    char *arena = (char *)realloc(midiData->tracks, arenaSize ? arenaSize : 1);
+    if (arena == NULL) {
         fprintf(stderr, "Not enough memory available!\n");
         return 0;
     }
-    for (size_t i = 0; i < midiData->header.trackN; i++) {
-        if (!readTrack(&midiData->tracks[i], midiFile)) return 0;
+    midiData->tracks = (midiTrack_t *)arena;
+    midiEvent_t *events = (midiEvent_t *)(arena + tracksSize);
+    midiEventData_t *eventData = (midiEventData_t *)(events + eventN);
+    for (size_t i = 0; i < trackN; i++) {
+        midiData->tracks[i].events = events;
+        midiData->tracks[i].eventData = eventData;
+        events += midiData->tracks[i].eventN;
+        eventData += midiData->tracks[i].eventN;
     }
     return 1;
 }
 
+// Work shared by the parser threads, tracks are taken one at a time from a shared counter
+typedef struct {
+    midiData_t *data;
+    unsigned int next; // Next track to take
+    int (*pass)(midiTrack_t *, const unsigned char *);
+    volatile int failed;
+} parseJob_t;
+
+// Parser thread, runs the pass on tracks until all of them are taken
+void *parseWorker(void *arg) {
+    parseJob_t *job = (parseJob_t *)arg;
+    unsigned int i;
+    while (!job->failed && (i = __sync_fetch_and_add(&job->next, 1)) < job->data->header.trackN) {
+        if (!job->pass(&job->data->tracks[i], job->data->map)) job->failed = 1;
+    }
+    return NULL;
+}
+
+// Runs pass on all tracks using the calling thread and up to threads - 1 more
+// Returns 0 on faliure, 1 on success
+int parseTracks(midiData_t *midiData, int (*pass)(midiTrack_t *, const unsigned char *), unsigned int threads) {
+    parseJob_t job = {midiData, 0, pass, 0};
+    pthread_t workers[MAX_PARSE_THREADS];
+    unsigned int started = 0;
+    if (threads > MAX_PARSE_THREADS) threads = MAX_PARSE_THREADS;
+    if (threads > midiData->header.trackN) threads = midiData->header.trackN;
+    // If a thread can't be started the remaining ones just take more tracks
+    while (started + 1 < threads && pthread_create(&workers[started], NULL, parseWorker, &job) == 0) started++;
+    parseWorker(&job);
+    for (unsigned int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    return !job.failed;
+}
+
+// Reads all data from the mapped file
+// All tracks and events are stored in one arena, sized by a first counting pass
+// Tracks are counted and decoded on threads, the result doesn't depend on the thread count
+// Returns 0 on faliure, 1 on success
+int readMidiData(midiData_t *midiData, midiReader_t *reader, unsigned int threads) {
+    if (!readHeader(&midiData->header, reader)) return 0;
+
+    unsigned short trackN = midiData->header.trackN;
+    midiData->tracks = (midiTrack_t *)malloc(sizeof(midiTrack_t) * (trackN ? trackN : 1));
+    if (midiData->tracks == NULL) {
+        fprintf(stderr, "Not enough memory available!\n");
+        return 0;
+    }
+    for (size_t i = 0; i < trackN; i++) {
+        if (!readTrackHeader(&midiData->tracks[i], midiData->map, reader)) return 0;
+    }
+
+    if (!parseTracks(midiData, countTrack, threads)) return 0;
+    if (!allocArena(midiData)) return 0;
+    return parseTracks(midiData, readTrack, threads);
+}
+
 // Reads the entire MIDI file and stores it in midiData
+// The file is memory mapped and stays mapped until freeMidi
 // Returns 0 on faliure, 1 on success
 int readMidiFile(midi_t *handler, const char *midiFileName) {
-    FILE *midiFile = fopen(midiFileName, "rb");
-    if (midiFile == NULL) {
+    return readMidiFileThreads(handler, midiFileName, 1);
+}
+
+// Reads the entire MIDI file, decoding the tracks on up to threads threads
+// Returns 0 on faliure, 1 on success
+int readMidiFileThreads(midi_t *handler, const char *midiFileName, unsigned int threads) {
+    midiData_t *data = &handler->data;
+    handler->timeline.commands = NULL;
+    handler->timeline.commandN = 0;
+    handler->timeline.cacheMap = NULL;
+    handler->checkpoints = NULL;
+    handler->meters = NULL;
+    handler->steppers = MAX_STEPPERS;
+    handler->policy = VOICE_SKYLINE;
+    data->tracks = NULL;
+    data->header.trackN = 0;
+    data->map = NULL;
+    data->mapSize = 0;
+
+    int fd = open(midiFileName, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "Error while opening file %s\n", midiFileName);
         return 0;
     }
-    if (!readMidiData(&handler->data, midiFile)) {
-        fclose(midiFile);
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0 || fileStat.st_size == 0) {
+        fprintf(stderr, "Error while reading file %s\n", midiFileName);
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error while mapping file %s\n", midiFileName);
+        return 0;
+    }
+    madvise(map, fileStat.st_size, MADV_SEQUENTIAL);
+    data->map = (const unsigned char *)map;
+    data->mapSize = fileStat.st_size;
+
+    midiReader_t reader = {data->map, data->map + data->mapSize, 0, 0};
+    if (!readMidiData(data, &reader, threads)) {
+        freeMidiData(data);
         return 0;
     }
-    fclose(midiFile);
     return 1;
 }
 
-// Initializes the parser module handler
+static inline int cursorLess(const trackCursor_t *a, const trackCursor_t *b) {
+    return a->tick < b->tick || (a->tick == b->tick && a->track < b->track);
+}
+
+// Restores the min-heap property after the root was replaced
+void heapDown(trackCursor_t *heap, unsigned int size) {
+    unsigned int i = 0;
+    trackCursor_t root = heap[0];
+    while (2 * i + 1 < size) {
+        unsigned int child = 2 * i + 1;
+        if (child + 1 < size && cursorLess(&heap[child + 1], &heap[child])) child++;
+        if (!cursorLess(&heap[child], &root)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = root;
+}
+
+// Restores the min-heap property after an item was added at the end
+void heapUp(trackCursor_t *heap, unsigned int size) {
+    unsigned int i = size - 1;
+    trackCursor_t last = heap[i];
+    while (i > 0 && cursorLess(&last, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = last;
+}
+
+// Initializes the compiler state at the start of the song
+void initCompiler(midiCompiler_t *compiler, unsigned short timeDiv) {
+    compiler->segmentTick = 0;
+    compiler->segmentNs = 0;
+    compiler->tempo = 500000;
+    compiler->timeDiv = timeDiv;
+    compiler->format = 1;
+    compiler->steppers = MAX_STEPPERS;
+    compiler->policy = VOICE_SKYLINE;
+    compiler->droppedNotes = 0;
+    compiler->cutNotes = 0;
+    for (int i = 0; i < MAX_STEPPERS; i++) compiler->voices[i] = (midiVoice_t){0, 0, NOTE_OFF, 0};
+}
+
+// Converts a tick to ns from the start of the song, using the current tempo segment
+// The tick must not be before the start of the segment
+unsigned long long compilerTime(const midiCompiler_t *compiler, unsigned long long tick) {
+    // Tempo map segment: time(tick) = (segmentNs + (tick - segmentTick) * tempo * 1000) / timeDiv
+    // segmentNs is kept multiplied by timeDiv so no rounding error builds up between segments
+    return (compiler->segmentNs + (tick - compiler->segmentTick) * compiler->tempo * 1000) / compiler->timeDiv;
+}
+
+// Starts a new tempo segment at tick, tempo is in us per quarter note
+void compilerSetTempo(midiCompiler_t *compiler, unsigned long long tick, unsigned int tempo) {
+    compiler->segmentNs += (tick - compiler->segmentTick) * compiler->tempo * 1000;
+    compiler->segmentTick = tick;
+    compiler->tempo = tempo;
+}
+
+// Converts one event to a timeline command, name offsets are relative to text
+// Returns 1 if the event produced a command, 0 if it's ignored
+int compileEvent(midiCompiler_t *compiler, midiCommand_t *command, unsigned short track, unsigned long long tick,
+                 const midiEvent_t *event, const unsigned char *eventBytes, unsigned int dataSize,
+                 const unsigned char *text) {
+    command->time = compilerTime(compiler, tick);
+    command->tick = tick;
+    command->track = track;
+    command->value = 0;
+    command->stepper = 0;
+    command->note = 0;
+    command->size = 0;
+
+    if (event->status == STATUS_META) {
+        switch (event->param1) {
+        case META_TIME_SIGNATURE:
+            if (dataSize < 2) return 0;
+            if (track != 0 && compiler->format == 1) fprintf(stderr, "Warning: TimeSig event outside tempo track!\n");
+            command->type = CMD_TIME_SIGNATURE;
+            command->value = eventBytes[0] | eventBytes[1] << 8;
+            return 1;
+        case META_TEMPO:
+            if (dataSize < 3) return 0;
+            if (track != 0 && compiler->format == 1) fprintf(stderr, "Warning: Tempo event outside tempo track!\n");
+            compilerSetTempo(compiler, tick, eventBytes[0] << 16 | eventBytes[1] << 8 | eventBytes[2]);
+            command->type = CMD_TEMPO;
+            command->value = compiler->tempo;
+            return 1;
+        case META_TRACK_NAME:
+            command->type = CMD_TRACK_NAME;
+            command->value = eventBytes - text;
+            command->size = dataSize > 0xFF ? 0xFF : dataSize;
+            return 1;
+        default:
+            return 0;
+        }
+    } else if (event->status < STATUS_SYSEX) {
+        // MIDI event, the stepper is chosen later by the voice allocation
+        unsigned char statusUpper = event->status & 0xF0;
+        int noteOn = statusUpper == MSG_NOTE_ON && event->param2 != 0;
+        int noteOff = statusUpper == MSG_NOTE_OFF || (statusUpper == MSG_NOTE_ON && event->param2 == 0);
+        if (noteOn || noteOff) {
+            command->type = CMD_NOTE;
+            command->value = (unsigned int)track << 4 | (event->status & 0x0F);
+            command->note = event->param1 & 0x7F;
+            command->size = noteOn ? event->param2 : 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Finds a stepper for a starting note, following the allocation policy
+// Returns the stepper or -1 if the note is dropped
+int allocNoteOn(midiCompiler_t *compiler, unsigned int key, unsigned char note) {
+    midiVoice_t *voices = compiler->voices;
+    int chosen = -1;
+    for (int i = 0; i < compiler->steppers; i++) {
+        // The same note again on the same voice restarts on its stepper
+        if (voices[i].active && voices[i].key == key && voices[i].note == note) return i;
+        if (!voices[i].active && (chosen < 0 || voices[i].released < voices[chosen].released)) chosen = i;
+    }
+    if (chosen < 0) {
+        // All steppers busy, the lowest priority note loses
+        for (int i = 0; i < compiler->steppers; i++) {
+            if (compiler->policy == VOICE_SKYLINE && (chosen < 0 || voices[i].note < voices[chosen].note)) chosen = i;
+            if (compiler->policy == VOICE_BASS && (chosen < 0 || voices[i].note > voices[chosen].note)) chosen = i;
+        }
+        if (chosen < 0 || (compiler->policy == VOICE_SKYLINE && note <= voices[chosen].note) ||
+            (compiler->policy == VOICE_BASS && note >= voices[chosen].note)) {
+            compiler->droppedNotes++;
+            return -1;
+        }
+        compiler->cutNotes++;
+    }
+    voices[chosen].key = key;
+    voices[chosen].note = note;
+    voices[chosen].active = 1;
+    return chosen;
+}
+
+// Frees the stepper of the note with the voice key
+// Returns the stepper or -1 if the note has no stepper
+int allocNoteOff(midiCompiler_t *compiler, unsigned int key, unsigned char note, unsigned long long time) {
+    for (int i = 0; i < compiler->steppers; i++) {
+        midiVoice_t *voice = &compiler->voices[i];
+        if (voice->active && voice->key == key && voice->note == note) {
+            voice->active = 0;
+            voice->released = time;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Allocates the stepper of one compiled note command as it's played
+// Returns 1 if the command should be played, 0 if it's dropped
+int allocateCommand(midiCompiler_t *compiler, midiCommand_t *command) {
+    if (command->type != CMD_NOTE) return 1;
+    int stepper = command->size != 0 ? allocNoteOn(compiler, command->value, command->note)
+                                     : allocNoteOff(compiler, command->value, command->note, command->time);
+    if (stepper < 0) return 0;
+    command->stepper = stepper;
+    if (command->size == 0) command->note = NOTE_OFF;
+    return 1;
+}
+
+// Voice allocation policy from its name: skyline, bass or first
+// Returns the VOICE_* policy or -1 if the name is unknown
+int parseVoicePolicy(const char *name) {
+    static const char *names[] = {"skyline", "bass", "first"};
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Assigns steppers to the notes of the timeline in place
+// Commands with the same time are handled together: ends first so their steppers can be reused,
+// and a stepper that is taken again right away doesn't get a note off
 // Returns 0 on faliure, 1 on success
-int initPlayer(midi_t *handler) {
-    if (handler->data.header.format != 1) {
-        fprintf(stderr, "Only format 1 MIDI files supported\n");
+static int allocateTimeline(midiTimeline_t *timeline, midiCompiler_t *compiler) {
+    midiCommand_t *group = NULL;
+    unsigned int groupSize = 0;
+    unsigned int out = 0;
+    for (unsigned int start = 0; start < timeline->commandN;) {
+        unsigned long long time = timeline->commands[start].time;
+        unsigned int end = start;
+        while (end < timeline->commandN && timeline->commands[end].time == time) end++;
+        if (end - start == 1) {
+            // Alone at its time, nothing to reorder
+            midiCommand_t command = timeline->commands[start++];
+            if (allocateCommand(compiler, &command)) timeline->commands[out++] = command;
+            continue;
+        }
+        if (end - start > groupSize) {
+            midiCommand_t *grown = (midiCommand_t *)realloc(group, sizeof(midiCommand_t) * (end - start));
+            if (grown == NULL) {
+                fprintf(stderr, "Not enough memory available!\n");
+                free(group);
+                return 0;
+            }
+            group = grown;
+            groupSize = end - start;
+        }
+        // The output never overtakes the input, but the group is read twice
+        memcpy(group, &timeline->commands[start], sizeof(midiCommand_t) * (end - start));
+        // A note whose on and off share the time has no length. Ends are handled first, so its off would
+        // find no voice and its on would keep the stepper, both are dropped instead
+        unsigned int n = 0;
+        for (unsigned int i = 0; i < end - start; i++) {
+            int zeroLength = 0;
+            if (group[i].type == CMD_NOTE && group[i].size == 0) {
+                for (unsigned int j = n; j-- > 0 && !zeroLength;) {
+                    if (group[j].type != CMD_NOTE || group[j].size == 0 || group[j].value != group[i].value ||
+                        group[j].note != group[i].note) {
+                        continue;
+                    }
+                    memmove(&group[j], &group[j + 1], sizeof(midiCommand_t) * (n - j - 1));
+                    n--;
+                    zeroLength = 1;
+                }
+            }
+            if (!zeroLength) group[n++] = group[i];
+        }
+
+        const midiCommand_t *offs[MAX_STEPPERS] = {NULL};
+        for (unsigned int i = 0; i < n; i++) {
+            if (group[i].type != CMD_NOTE) {
+                timeline->commands[out++] = group[i];
+            } else if (group[i].size == 0) {
+                int stepper = allocNoteOff(compiler, group[i].value, group[i].note, time);
+                if (stepper >= 0) offs[stepper] = &group[i];
+            }
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            if (group[i].type != CMD_NOTE || group[i].size == 0) continue;
+            int stepper = allocNoteOn(compiler, group[i].value, group[i].note);
+            if (stepper < 0) continue;
+            offs[stepper] = NULL;
+            timeline->commands[out] = group[i];
+            timeline->commands[out++].stepper = stepper;
+        }
+        for (int i = 0; i < compiler->steppers; i++) {
+            if (offs[i] == NULL) continue;
+            timeline->commands[out] = *offs[i];
+            timeline->commands[out].stepper = i;
+            timeline->commands[out++].note = NOTE_OFF;
+        }
+        start = end;
+    }
+    free(group);
+    timeline->commandN = out;
+    return 1;
+}
+
+// Ends a format 2 sequence at tick: releases the notes it left on and goes back to the default tempo
+static void endSequence(midiCompiler_t *compiler, midiTimeline_t *timeline, unsigned short track, unsigned long long tick,
+                        unsigned char sounding[16][128]) {
+    unsigned long long time = compilerTime(compiler, tick);
+    for (unsigned char channel = 0; channel < 16; channel++) {
+        for (unsigned char note = 0; note < 128; note++) {
+            if (!sounding[channel][note]) continue;
+            sounding[channel][note] = 0;
+            timeline->commands[timeline->commandN++] =
+                (midiCommand_t){time, tick, (unsigned int)track << 4 | channel, track, CMD_NOTE, 0, note, 0};
+        }
+    }
+    compilerSetTempo(compiler, tick, 500000);
+    timeline->commands[timeline->commandN++] = (midiCommand_t){time, tick, 500000, track, CMD_TEMPO, 0, 0, 0};
+}
+
+// Merges all tracks into the timeline, applying the tempo map with exact integer arithmetic
+// Returns 0 on faliure, 1 on success
+int compileTimeline(midi_t *handler) {
+    midiData_t *data = &handler->data;
+    midiTimeline_t *timeline = &handler->timeline;
+    unsigned short timeDiv = data->header.timediv & 0x7FFF;
+    if (timeDiv == 0) {
+        fprintf(stderr, "Invalid time division\n");
         return 0;
     }
 
-    handler->currEvents = (nodeMidiEvent_t **)malloc(sizeof(nodeMidiEvent_t *) * handler->data.header.trackN);
-    if (handler->currEvents == NULL) {
+    // Format 2 tracks are separate sequences played one after another, each one starts with the default
+    // tempo and the notes it leaves on are ended, so up to one extra command per event and per track
+    int sequential = data->header.format == 2;
+    size_t eventN = 0;
+    for (size_t i = 0; i < data->header.trackN; i++) eventN += data->tracks[i].eventN;
+    size_t capacity = sequential ? 2 * eventN + data->header.trackN : eventN;
+    timeline->commands = (midiCommand_t *)malloc(sizeof(midiCommand_t) * (capacity ? capacity : 1));
+    trackCursor_t *heap = (trackCursor_t *)malloc(sizeof(trackCursor_t) * (data->header.trackN ? data->header.trackN : 1));
+    if (timeline->commands == NULL || heap == NULL) {
         fprintf(stderr, "Not enough memory available!\n");
+        free(heap);
         return 0;
     }
-    for (int i = 0; i < handler->data.header.trackN; i++) {
-        handler->currEvents[i] = handler->data.tracks[i].eventList.first;
+    timeline->commandN = 0;
+    timeline->text = data->map;
+
+    unsigned int heapSize = 0;
+    unsigned long long trackStart = 0;
+    for (unsigned short i = 0; i < data->header.trackN; i++) {
+        const midiTrack_t *track = &data->tracks[i];
+        if (track->eventN == 0) continue;
+        heap[heapSize++] = (trackCursor_t){trackStart + track->events[0].delta, 0, i};
+        heapUp(heap, heapSize);
+        if (!sequential) continue;
+        for (unsigned int j = 0; j < track->eventN; j++) trackStart += track->events[j].delta;
     }
 
-    for (int i = 0; i < MAX_STEPPERS; i++) {
-        handler->currNotes[i] = NOTE_OFF;
+    midiCompiler_t compiler;
+    initCompiler(&compiler, timeDiv);
+    if (handler->steppers >= 1 && handler->steppers <= MAX_STEPPERS) compiler.steppers = handler->steppers;
+    compiler.policy = handler->policy;
+    compiler.format = data->header.format;
+    unsigned char sounding[16][128];
+    memset(sounding, 0, sizeof(sounding));
+    int sequence = -1;
+    unsigned long long lastTick = 0;
+    while (heapSize > 0) {
+        trackCursor_t *cursor = &heap[0];
+        midiTrack_t *track = &data->tracks[cursor->track];
+        const midiEventData_t *eventData = &track->eventData[cursor->index];
+        if (sequential && cursor->track != sequence) {
+            if (sequence >= 0) endSequence(&compiler, timeline, sequence, lastTick, sounding);
+            sequence = cursor->track;
+        }
+        midiCommand_t *command = &timeline->commands[timeline->commandN];
+        if (compileEvent(&compiler, command, cursor->track, cursor->tick, &track->events[cursor->index],
+                         data->map + eventData->offset, eventData->size, data->map)) {
+            timeline->commandN++;
+            if (sequential && command->type == CMD_NOTE) sounding[command->value & 0x0F][command->note] = command->size != 0;
+        }
+        lastTick = cursor->tick;
+
+        // Advance the track, remove it from the heap when it's finished
+        if (++cursor->index < track->eventN) {
+            cursor->tick += track->events[cursor->index].delta;
+        } else {
+            heap[0] = heap[--heapSize];
+        }
+        if (heapSize > 0) heapDown(heap, heapSize);
     }
+    free(heap);
 
-    handler->timeDiv = handler->data.header.timediv & 0x7FFF;
-    handler->timeSig[0] = 4;
-    handler->timeSig[1] = 2;
-    handler->currTempo = 500000;
-    handler->done = 0;
-    handler->nextEventTime.tv_sec = 0;
+    // Notes are given to steppers once over the whole song, playback makes no decisions
+    if (!allocateTimeline(timeline, &compiler)) return 0;
+    if (compiler.droppedNotes || compiler.cutNotes) {
+        fprintf(stderr, "Warning: The song needs more than %d steppers, %u notes dropped and %u cut short\n",
+                compiler.steppers, compiler.droppedNotes, compiler.cutNotes);
+    }
+    if (timeline->commandN != 0 && timeline->commandN < capacity) {
+        midiCommand_t *shrunk = (midiCommand_t *)realloc(timeline->commands, sizeof(midiCommand_t) * timeline->commandN);
+        if (shrunk != NULL) timeline->commands = shrunk;
+    }
+    return 1;
+}
+
+// Resets the playback state to the start of the song
+void initPlayerState(midiPlayer_t *player) {
+    player->timeSig[0] = 4;
+    player->timeSig[1] = 2;
+    player->currTempo = 500000;
+    player->startTime.tv_sec = 0;
+    player->startTime.tv_nsec = 0;
+    memset(&player->drift, 0, sizeof(player->drift));
+    player->freeRun = 0;
+    player->render = NULL;
+    player->spinNs = 0;
+    player->lookahead = 0;
+    player->mutedSteppers = 0;
+    for (int i = 0; i < MAX_STEPPERS; i++) player->notes[i] = NOTE_OFF;
+    player->batchSize = 0;
+    player->anchorTime = 0;
+    player->speed = SPEED_NORMAL;
+    player->paused = 0;
+    player->requestedSpeed = SPEED_NORMAL;
+    player->requestedPause = 0;
+}
 
+// Applies the state change of one command to a checkpoint
+static void stepCheckpoint(midiCheckpoint_t *state, const midiCommand_t *command) {
+    switch (command->type) {
+    case CMD_TEMPO:
+        state->tempo = command->value;
+        break;
+    case CMD_TIME_SIGNATURE:
+        state->timeSig[0] = command->value & 0xFF;
+        state->timeSig[1] = command->value >> 8;
+        break;
+    case CMD_NOTE:
+        if (command->stepper < MAX_STEPPERS) state->notes[command->stepper] = command->note;
+        break;
+    default:
+        break;
+    }
+}
+
+static unsigned long long ticksPerBar(const unsigned char timeSig[2], unsigned short timeDiv) {
+    unsigned long long ticks = ((unsigned long long)timeSig[0] * timeDiv * 4) >> timeSig[1];
+    return ticks ? ticks : (unsigned long long)timeDiv * 4;
+}
+
+// Records the player state every SEEK_INTERVAL commands and the time signature regions
+// Returns 0 on faliure, 1 on success
+static int buildSeekIndex(midi_t *handler) {
+    const midiTimeline_t *timeline = &handler->timeline;
+    unsigned int meterN = 1;
+    for (unsigned int i = 0; i < timeline->commandN; i++) {
+        if (timeline->commands[i].type == CMD_TIME_SIGNATURE) meterN++;
+    }
+    handler->checkpointN = timeline->commandN / SEEK_INTERVAL + 1;
+    handler->checkpoints = (midiCheckpoint_t *)malloc(sizeof(midiCheckpoint_t) * handler->checkpointN);
+    handler->meters = (midiMeter_t *)malloc(sizeof(midiMeter_t) * meterN);
+    if (handler->checkpoints == NULL || handler->meters == NULL) {
+        fprintf(stderr, "Not enough memory available!\n");
+        return 0;
+    }
+
+    midiCheckpoint_t state = {500000, {4, 2}, {0}};
+    for (int i = 0; i < MAX_STEPPERS; i++) state.notes[i] = NOTE_OFF;
+    handler->meters[0] = (midiMeter_t){0, 1, {4, 2}};
+    handler->meterN = 1;
+    for (unsigned int i = 0; i < timeline->commandN; i++) {
+        const midiCommand_t *command = &timeline->commands[i];
+        if (i % SEEK_INTERVAL == 0) handler->checkpoints[i / SEEK_INTERVAL] = state;
+        stepCheckpoint(&state, command);
+        if (command->type != CMD_TIME_SIGNATURE) continue;
+
+        // A new time signature starts a bar, even if the previous one didn't finish
+        midiMeter_t *meter = &handler->meters[handler->meterN - 1];
+        if (command->tick > meter->tick) {
+            unsigned long long barTicks = ticksPerBar(meter->timeSig, handler->timeDiv);
+            unsigned int bars = (command->tick - meter->tick + barTicks - 1) / barTicks;
+            handler->meters[handler->meterN++] = (midiMeter_t){command->tick, meter->bar + bars, {state.timeSig[0], state.timeSig[1]}};
+        } else {
+            meter->timeSig[0] = state.timeSig[0];
+            meter->timeSig[1] = state.timeSig[1];
+        }
+    }
+    if (timeline->commandN % SEEK_INTERVAL == 0) handler->checkpoints[handler->checkpointN - 1] = state;
     return 1;
 }
 
+// Initializes the parser module handler
+// Returns 0 on faliure, 1 on success
+int initPlayer(midi_t *handler) {
+    if (handler->timeline.commands == NULL) {
+        if (handler->data.header.format > 2) {
+            fprintf(stderr, "Only format 0, 1 and 2 MIDI files supported\n");
+            return 0;
+        }
+        if (!compileTimeline(handler)) return 0;
+    }
+
+    handler->timeDiv = handler->data.header.timediv & 0x7FFF;
+    handler->position = 0;
+    handler->loopStart = 0;
+    handler->loopEnd = 0;
+    initPlayerState(&handler->player);
+
+    return buildSeekIndex(handler);
+}
+
 // Frees the memory 
 void freeMidi(midi_t *handler) {
-    free(handler->currEvents);
+    if (handler->timeline.cacheMap != NULL) {
+        munmap(handler->timeline.cacheMap, handler->timeline.cacheMapSize);
+        handler->timeline.cacheMap = NULL;
+    } else {
+        free(handler->timeline.commands);
+    }
+    handler->timeline.commands = NULL;
+    free(handler->checkpoints);
+    handler->checkpoints = NULL;
+    free(handler->meters);
+    handler->meters = NULL;
     freeMidiData(&handler->data);
 }
 
-// Plays the next events in the MIDI file, this function is blocking
-// Returns 0 on faliure, 1 on success
-int playNext(midi_t *handler, int outFile) {
-    if (handler->done >= handler->data.header.trackN) {
-        return 0;
+// Histogram bucket of a lateness in ns
+static unsigned int driftBucket(long long ns) {
+    return latencyBucket(ns > 0 ? (unsigned long long)ns / 1000 : 0);
+}
+
+// Sleeps until time ns after the start of the song and records how late the wakeup was
+// Returns 0 if interrupted by a signal, 1 on success
+int playerWait(midiPlayer_t *player, unsigned long long time) {
+    if (player->freeRun) {
+        playerDueTime(player, time, &player->nextEventTime);
+        return 1;
     }
-    
-    if (handler->nextEventTime.tv_sec == 0) {
-        clock_gettime(CLOCK_MONOTONIC, &handler->nextEventTime);
+    if (player->startTime.tv_sec == 0 && player->startTime.tv_nsec == 0) {
+        // With lookahead the song starts later, so the first notes are queued in time too
+        clock_gettime(CLOCK_MONOTONIC, &player->startTime);
+        addNs(&player->startTime, player->lookahead);
+    }
+    playerDueTime(player, time, &player->nextEventTime);
+    struct timespec wake = player->nextEventTime;
+    subNs(&wake, player->lookahead);
+    struct timespec now;
+    if (player->spinNs != 0) {
+        struct timespec sleep = wake;
+        subNs(&sleep, player->spinNs);
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sleep, NULL) != 0) {
+            return 0;
+        }
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while (diffNs(&now, &wake) < 0);
     } else {
-        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &handler->nextEventTime, NULL);
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) != 0) {
+            return 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+
+    addDrift(&player->drift, diffNs(&now, &wake));
+    return 1;
+}
+
+// Absolute time the command at time ns after the start of the song is due, following the speed changes
+void playerDueTime(const midiPlayer_t *player, unsigned long long time, struct timespec *due) {
+    *due = player->startTime;
+    // Commands before the anchor were due before the last speed change, they are late already
+    if (time <= player->anchorTime) return;
+    if (player->speed == SPEED_NORMAL) addNs(due, time - player->anchorTime);
+    else addNs(due, (time - player->anchorTime) * SPEED_NORMAL / player->speed);
+}
+
+// Song time in ns that plays at the absolute time
+static unsigned long long playerSongTime(const midiPlayer_t *player, const struct timespec *time) {
+    long long elapsed = diffNs(time, &player->startTime);
+    if (elapsed <= 0) return player->anchorTime;
+    return player->anchorTime + (unsigned long long)elapsed * player->speed / SPEED_NORMAL;
+}
+
+// Requests a playback speed in 1/SPEED_NORMAL, clamped to [SPEED_MIN,SPEED_MAX], can be called from any thread
+void playerSetSpeed(midiPlayer_t *player, unsigned int speed) {
+    if (speed < SPEED_MIN) speed = SPEED_MIN;
+    if (speed > SPEED_MAX) speed = SPEED_MAX;
+    __atomic_store_n(&player->requestedSpeed, speed, __ATOMIC_RELEASE);
+}
+
+// Requests pause or resume, while paused the steppers are silent, can be called from any thread
+void playerSetPause(midiPlayer_t *player, unsigned char paused) {
+    __atomic_store_n(&player->requestedPause, paused, __ATOMIC_RELEASE);
+}
+
+// Lowest stepper the driver rejected, notes for it and the steppers above are left out from then on
+static unsigned char driverSteppers = MAX_STEPPERS;
+
+// Writes a driver command, notes for steppers the driver doesn't have are left out
+// The driver rejects a whole batch if one stepper is over its steppers_count, such a batch is written again
+// pair by pair, which finds the missing steppers, so later batches take one write again
+// Returns the length of the command on success, -1 if a write failed
+long writeDriverCommand(int outFile, const unsigned char *command, unsigned int length) {
+    unsigned char steppers = __atomic_load_n(&driverSteppers, __ATOMIC_RELAXED);
+    if (length == DRIVER_PERIOD_LEN && command[0] == DRIVER_PERIOD) {
+        // The driver fails a period for a missing stepper, its notes were left out already
+        if (command[1] >= steppers) return length;
+        return write(outFile, command, length);
+    }
+    if (length == 0 || length % 2 != 0 || length > DRIVER_BATCH_LEN || command[0] >= DRIVER_FLUSH) {
+        return write(outFile, command, length);
+    }
+
+    unsigned char batch[DRIVER_BATCH_LEN];
+    unsigned int size = 0;
+    for (unsigned int i = 0; i < length; i += 2) {
+        if (command[i] >= steppers) continue;
+        batch[size++] = command[i];
+        batch[size++] = command[i + 1];
+    }
+    if (size == 0) return length;
+    long result = write(outFile, batch, size);
+    if (size > 2 && result < 0 && errno == EINVAL) {
+        result = 0;
+        for (unsigned int i = 0; i < size && result >= 0; i += 2) {
+            result = write(outFile, batch + i, 2);
+            // A single note for a missing stepper fails with a positive EINVAL
+            if (result == EINVAL && batch[i] < steppers) steppers = batch[i];
+        }
+    } else if (size == 2 && result == EINVAL) {
+        steppers = batch[0];
+    }
+    if (result < 0) return result;
+    if (steppers < __atomic_load_n(&driverSteppers, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&driverSteppers, steppers, __ATOMIC_RELAXED);
+        logMessage(LOG_WARNING, "The driver has no stepper %d, its notes are left out, check its steppers_count\n",
+                   steppers);
+    }
+    return length;
+}
+
+// Writes the held notes to the driver at once
+void playerFlush(midiPlayer_t *player, int outFile) {
+    if (player->batchSize == 0) return;
+    writeDriverCommand(outFile, player->batch, player->batchSize);
+    player->batchSize = 0;
+}
+
+// Writes a note change to the driver, it's queued in the driver until due when the player runs ahead
+// Notes to play now are held until playerFlush, when rendering they're logged with their due time instead
+static void writeNote(midiPlayer_t *player, unsigned char stepper, unsigned char note, const struct timespec *due,
+                      int outFile) {
+    if (player->render != NULL) {
+        // Free running from a zero start time, so the due time is the time in the song
+        fprintf(player->render, "%llu,%u,%u\n", (unsigned long long)due->tv_sec * NS_PER_S + due->tv_nsec, stepper,
+                note);
+        return;
     }
-    unsigned int minDelta = -1;
+    if (player->lookahead == 0 || (due->tv_sec == 0 && due->tv_nsec == 0)) {
+        if (player->batchSize == DRIVER_BATCH_LEN) playerFlush(player, outFile);
+        player->batch[player->batchSize++] = stepper;
+        player->batch[player->batchSize++] = note;
+        return;
+    }
+    // Held notes were due before this one
+    playerFlush(player, outFile);
+    unsigned long long deadline = (unsigned long long)due->tv_sec * NS_PER_S + due->tv_nsec;
+    unsigned char record[DRIVER_TIMED_LEN] = {DRIVER_TIMED_NOTE, stepper, note, 0};
+    for (int i = 0; i < 8; i++) record[4 + i] = deadline >> (i * 8);
+    // The driver queue is full, wait for it to play some of the notes
+    const struct timespec retry = {0, 1000000};
+    while (write(outFile, record, DRIVER_TIMED_LEN) < 0 && errno == EAGAIN) {
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &retry, NULL);
+    }
+}
+
+// Executes one timeline command, name offsets are relative to text
+void playerRun(midiPlayer_t *player, const midiCommand_t *command, const unsigned char *text, int outFile) {
     unsigned char buffer[2];
-    for (int i = 0; i < handler->data.header.trackN; i++) {
-        while (handler->currEvents[i] != NULL && handler->currEvents[i]->event.delta == 0) {
-            // Parse the event
-            if (handler->currEvents[i]->event.status == STATUS_META) {
-                // Meta event
-                switch (handler->currEvents[i]->event.param1) {
-                case META_TIME_SIGNATURE:
-                    // TODO parse the remaining two bytes
-                    if (i != 0) fprintf(stderr, "Warning: TimeSig event outside tempo track!\n");
-                    handler->timeSig[0] = handler->currEvents[i]->event.data[0];
-                    handler->timeSig[1] = handler->currEvents[i]->event.data[1];
-                    printf("Time signature: %d/%d\n", handler->timeSig[0], 1 << handler->timeSig[1]);
-                    break;
-                case META_TEMPO:
-                    if (i != 0) fprintf(stderr, "Warning: Tempo event outside tempo track!\n");
-                    handler->currTempo = handler->currEvents[i]->event.data[2];
-                    handler->currTempo += handler->currEvents[i]->event.data[1] << 8;
-                    handler->currTempo += handler->currEvents[i]->event.data[0] << 16;
-                    printf("Tempo: %fbpm\n", msToBpm(handler->currTempo));
-                    break;
-                case META_END_OF_TRACK:
-                    handler->done++;
-                    break;
-                case META_TRACK_NAME:
-                    if (i == 0) {
-                        printf("Sequence name: ");
-                    } else {
-                        printf("Track %d name: ", i);
-                    }
-                    printf("%.*s\n", handler->currEvents[i]->event.dataSize, handler->currEvents[i]->event.data);
-                    break;
-                default:
-                    fprintf(stderr, "Error while parsing meta event\n");
-                    break;
-                }
-            } else {
-                // MIDI event
-                unsigned char statusUpper = handler->currEvents[i]->event.status & 0xF0;
-                switch (statusUpper) {
-                case MSG_NOTE_ON:
-                    handler->currNotes[i - 1] = handler->currEvents[i]->event.param1;
-                    buffer[0] = i - 1;
-                    buffer[1] = handler->currNotes[i - 1];
-                    printf("Note %d on stepper %d ON\n", buffer[1], buffer[0]);
-                    write(outFile, buffer, 2);
-                    break;
-                case MSG_NOTE_OFF:
-                    if (handler->currEvents[i]->event.param1 == handler->currNotes[i - 1]) {
-                        handler->currNotes[i - 1] = NOTE_OFF;
-                        buffer[0] = i - 1;
-                        buffer[1] = NOTE_OFF;
-                        printf("Note on stepper %d OFF\n", buffer[0]);
-                        write(outFile, buffer, 2);
-                    }
-                    break;
-                default:
-                    break;
-                }
-            }
-            // Go to next event
-            handler->currEvents[i] = handler->currEvents[i]->next;
+    struct timespec due;
+    switch (command->type) {
+    case CMD_TIME_SIGNATURE:
+        player->timeSig[0] = command->value & 0xFF;
+        player->timeSig[1] = command->value >> 8;
+        logMessage(LOG_INFO, "Time signature: %d/%d\n", player->timeSig[0], 1 << player->timeSig[1]);
+        break;
+    case CMD_TEMPO:
+        player->currTempo = command->value;
+        logMessage(LOG_INFO, "Tempo: %fbpm\n", msToBpm(player->currTempo));
+        break;
+    case CMD_TRACK_NAME:
+        if (command->track == 0) {
+            logMessage(LOG_INFO, "Sequence name: %.*s\n", command->size, text + command->value);
+        } else {
+            logMessage(LOG_INFO, "Track %d name: %.*s\n", command->track, command->size, text + command->value);
         }
-        if (handler->currEvents[i] != NULL && handler->currEvents[i]->event.delta < minDelta) minDelta = handler->currEvents[i]->event.delta;
+        break;
+    case CMD_NOTE:
+        if (command->stepper < MAX_STEPPERS && (player->mutedSteppers >> command->stepper & 1)) break;
+        buffer[0] = command->stepper;
+        buffer[1] = command->note;
+        if (command->note != NOTE_OFF) {
+            logMessage(LOG_NOTE, "Note %d on stepper %d ON\n", buffer[1], buffer[0]);
+        } else {
+            logMessage(LOG_NOTE, "Note on stepper %d OFF\n", buffer[0]);
+        }
+        if (command->stepper < MAX_STEPPERS) player->notes[command->stepper] = command->note;
+        playerDueTime(player, command->time, &due);
+        writeNote(player, buffer[0], buffer[1], &due, outFile);
+        break;
+    default:
+        break;
+    }
+}
+
+// Stops the notes still playing on the steppers that aren't muted, due with the command last waited for
+void playerSilence(midiPlayer_t *player, int outFile) {
+    for (unsigned char i = 0; i < MAX_STEPPERS; i++) {
+        if (player->notes[i] == NOTE_OFF || (player->mutedSteppers >> i & 1)) continue;
+        player->notes[i] = NOTE_OFF;
+        writeNote(player, i, NOTE_OFF, &player->nextEventTime, outFile);
+    }
+    playerFlush(player, outFile);
+}
+
+// Stops all notes right away, the notes queued in the driver are dropped
+void playerStop(midiPlayer_t *player, int outFile) {
+    if (player->lookahead != 0) {
+        unsigned char flush = DRIVER_FLUSH;
+        write(outFile, &flush, 1);
+    }
+    const struct timespec now = {0, 0};
+    for (unsigned char i = 0; i < MAX_STEPPERS; i++) {
+        if (player->notes[i] == NOTE_OFF || (player->mutedSteppers >> i & 1)) continue;
+        player->notes[i] = NOTE_OFF;
+        writeNote(player, i, NOTE_OFF, &now, outFile);
+    }
+    playerFlush(player, outFile);
+}
+
+// Applies the requested speed and pause at the song time reached now
+// The schedule is rebased there, so the commands after it keep their spacing at the new speed
+static void applyTransport(midi_t *handler, unsigned int speed, unsigned char paused, int outFile) {
+    midiPlayer_t *player = &handler->player;
+    if (player->startTime.tv_sec == 0 && player->startTime.tv_nsec == 0) {
+        // Not started yet, playerWait starts the schedule
+        player->speed = speed;
+        player->paused = paused;
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned char resuming = player->paused && !paused;
+    if (speed != player->speed) logMessage(LOG_INFO, "Speed: %.2fx\n", (double)speed / SPEED_NORMAL);
+    if (paused != player->paused) logMessage(LOG_INFO, paused ? "Paused\n" : "Resumed\n");
+    if (!player->paused) {
+        player->anchorTime = playerSongTime(player, &now);
+        unsigned int position = findTime(&handler->timeline, player->anchorTime);
+        if (player->lookahead != 0 && position < handler->position) {
+            // The commands sent ahead were scheduled at the old speed, send them again
+            unsigned char flush = DRIVER_FLUSH;
+            write(outFile, &flush, 1);
+            player->nextEventTime.tv_sec = 0;
+            player->nextEventTime.tv_nsec = 0;
+            seekPosition(handler, position, outFile);
+        }
+    }
+    player->speed = speed;
+    player->paused = paused;
+    if (paused) {
+        playerStop(player, outFile);
+        return;
     }
-    if (minDelta == -1) {
+    player->startTime = now;
+    if (resuming) {
+        // Notes held at the pause sound again when the song continues
+        addNs(&player->startTime, player->lookahead);
+        player->nextEventTime = player->startTime;
+        seekPosition(handler, handler->position, outFile);
+    }
+}
+
+// Plays the next events in the MIDI file, this function is blocking
+// Returns 0 on faliure, 1 on success
+int playNext(midi_t *handler, int outFile) {
+    const midiTimeline_t *timeline = &handler->timeline;
+    midiPlayer_t *player = &handler->player;
+    unsigned int speed = __atomic_load_n(&player->requestedSpeed, __ATOMIC_ACQUIRE);
+    unsigned char paused = __atomic_load_n(&player->requestedPause, __ATOMIC_ACQUIRE);
+    if (speed != player->speed || paused != player->paused) applyTransport(handler, speed, paused, outFile);
+    if (player->paused) {
+        // The control thread wakes the playback thread with a signal on resume
+        const struct timespec idle = {0, 100000000};
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &idle, NULL);
+        return 1;
+    }
+
+    if (handler->loopEnd != 0 &&
+        (handler->position >= timeline->commandN || timeline->commands[handler->position].time >= handler->loopEnd)) {
+        // Back to the start of the loop, the schedule continues from the loop end so no time is lost
+        if (!playerWait(player, handler->loopEnd)) return 1;
+        seekPosition(handler, findTime(timeline, handler->loopStart), outFile);
+        struct timespec end;
+        playerDueTime(player, handler->loopEnd, &end);
+        player->startTime = end;
+        player->anchorTime = handler->loopStart;
+        return 1;
+    }
+    if (handler->position >= timeline->commandN) {
         return 0;
-    } 
+    }
+
+    unsigned long long time = timeline->commands[handler->position].time;
+    if (!playerWait(&handler->player, time)) {
+        // Interrupted by a signal, the caller decides whether to continue
+        return 1;
+    }
+    while (handler->position < timeline->commandN && timeline->commands[handler->position].time == time) {
+        playerRun(&handler->player, &timeline->commands[handler->position], timeline->text, outFile);
+        handler->position++;
+    }
+    playerFlush(&handler->player, outFile);
+
+    return 1;
+}
+
+// Index of the first command at or after time ns, commandN if there is none
+unsigned int findTime(const midiTimeline_t *timeline, unsigned long long time) {
+    unsigned int low = 0, high = timeline->commandN;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (timeline->commands[mid].time < time) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Index of the first command at or after tick, commandN if there is none
+unsigned int findTick(const midiTimeline_t *timeline, unsigned long long tick) {
+    unsigned int low = 0, high = timeline->commandN;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (timeline->commands[mid].tick < tick) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Player state before the command at position, from the closest checkpoint
+static void stateAt(const midi_t *handler, unsigned int position, midiCheckpoint_t *state) {
+    unsigned int checkpoint = position / SEEK_INTERVAL;
+    *state = handler->checkpoints[checkpoint];
+    for (unsigned int i = checkpoint * SEEK_INTERVAL; i < position; i++) {
+        stepCheckpoint(state, &handler->timeline.commands[i]);
+    }
+}
+
+// Converts a tick to ns through the tempo map of the timeline
+unsigned long long tickTime(const midi_t *handler, unsigned long long tick) {
+    const midiTimeline_t *timeline = &handler->timeline;
+    unsigned int position = findTick(timeline, tick);
+    if (position < timeline->commandN && timeline->commands[position].tick == tick) {
+        return timeline->commands[position].time;
+    }
+    // Continue from the previous command with the tempo in effect after it
+    midiCheckpoint_t state;
+    stateAt(handler, position, &state);
+    unsigned long long prevTick = 0, prevTime = 0;
+    if (position > 0) {
+        prevTick = timeline->commands[position - 1].tick;
+        prevTime = timeline->commands[position - 1].time;
+    }
+    return prevTime + (tick - prevTick) * state.tempo * 1000 / handler->timeDiv;
+}
+
+// Tick of the start of bar (counted from 1), following the time signature changes
+unsigned long long barTick(const midi_t *handler, unsigned int bar) {
+    unsigned int low = 0, high = handler->meterN;
+    if (bar < 1) bar = 1;
+    // Last region starting at or before the bar
+    while (high - low > 1) {
+        unsigned int mid = low + (high - low) / 2;
+        if (handler->meters[mid].bar <= bar) low = mid;
+        else high = mid;
+    }
+    const midiMeter_t *meter = &handler->meters[low];
+    return meter->tick + (bar - meter->bar) * ticksPerBar(meter->timeSig, handler->timeDiv);
+}
+
+// Moves playback to the command at position, restoring the tempo, time signature and the notes on the steppers
+// Notes that differ from the ones playing are written to outFile, the schedule is not changed
+void seekPosition(midi_t *handler, unsigned int position, int outFile) {
+    midiPlayer_t *player = &handler->player;
+    midiCheckpoint_t state;
+    if (position > handler->timeline.commandN) position = handler->timeline.commandN;
+    stateAt(handler, position, &state);
+
+    player->currTempo = state.tempo;
+    player->timeSig[0] = state.timeSig[0];
+    player->timeSig[1] = state.timeSig[1];
+    for (unsigned char i = 0; i < MAX_STEPPERS; i++) {
+        if (player->notes[i] == state.notes[i]) continue;
+        player->notes[i] = state.notes[i];
+        // Due with the command the player last waited for, which is the loop end when looping
+        writeNote(player, i, state.notes[i], &player->nextEventTime, outFile);
+    }
+    playerFlush(player, outFile);
+    handler->position = position;
+}
 
-    for (int i = 0; i < handler->data.header.trackN; i++) {
-        if (handler->currEvents[i] != NULL) handler->currEvents[i]->event.delta -= minDelta;
+// Moves playback to time ns, the next command plays when it's due relative to time
+void seekTime(midi_t *handler, unsigned long long time, int outFile) {
+    if (handler->player.lookahead != 0) {
+        // Notes queued for the old position must not play
+        unsigned char flush = DRIVER_FLUSH;
+        write(outFile, &flush, 1);
     }
-    unsigned long deltaNs = deltaToNs(minDelta, handler->currTempo, handler->timeDiv);
-    handler->nextEventTime.tv_sec += (deltaNs + handler->nextEventTime.tv_nsec) / NS_PER_S;
-    handler->nextEventTime.tv_nsec = (deltaNs + handler->nextEventTime.tv_nsec) % NS_PER_S;
+    seekPosition(handler, findTime(&handler->timeline, time), outFile);
+    // The schedule counts from time, the next notes are queued lookahead ns ahead
+    struct timespec *start = &handler->player.startTime;
+    clock_gettime(CLOCK_MONOTONIC, start);
+    addNs(start, handler->player.lookahead);
+    handler->player.anchorTime = time;
+}
 
+// Plays the region from start to end ns in a loop, end 0 turns the loop off
+// Returns 0 on faliure, 1 on success
+int setLoop(midi_t *handler, unsigned long long start, unsigned long long end) {
+    if (end != 0 && end <= start) {
+        fprintf(stderr, "Loop end must be after the loop start\n");
+        return 0;
+    }
+    handler->loopStart = start;
+    handler->loopEnd = end;
     return 1;
-}
\ No newline at end of file
+}
+
+// Lateness in ns that the fraction of the wakeups didn't exceed, rounded up to the histogram bucket
+unsigned long long driftPercentile(const midiDrift_t *drift, double fraction) {
+    unsigned long long rank = (unsigned long long)(fraction * drift->count + 0.5);
+    if (rank < 1) rank = 1;
+    unsigned long long seen = 0;
+    for (unsigned int i = 0; i < DRIFT_BUCKETS; i++) {
+        seen += drift->histogram[i];
+        if (seen >= rank) {
+            unsigned long long limit = (latencyBucketLimit(i) + 1) * 1000 - 1;
+            return drift->max >= 0 && limit > (unsigned long long)drift->max ? (unsigned long long)drift->max : limit;
+        }
+    }
+    return drift->max > 0 ? drift->max : 0;
+}
+
+// Records one latency in ns in the histogram
+void addDrift(midiDrift_t *drift, long long ns) {
+    drift->count++;
+    drift->sum += ns;
+    drift->last = ns;
+    if (ns > drift->max) drift->max = ns;
+    drift->histogram[driftBucket(ns)]++;
+}
+
+// Adds the wakeups recorded in from to into
+void mergeDrift(midiDrift_t *into, const midiDrift_t *from) {
+    if (from->count == 0) return;
+    into->count += from->count;
+    into->sum += from->sum;
+    into->last = from->last;
+    if (from->max > into->max) into->max = from->max;
+    for (int i = 0; i < DRIFT_BUCKETS; i++) into->histogram[i] += from->histogram[i];
+}
+
+// Prints how late the played commands were compared to the tempo map
+void printDriftReport(const midiPlayer_t *player) {
+    if (player->drift.count == 0) return;
+    printf("Drift report: %u wakeups, mean %lldus, max %lldus, last %lldus late\n", player->drift.count,
+           player->drift.sum / player->drift.count / 1000, player->drift.max / 1000, player->drift.last / 1000);
+    printf("Wakeup latency: p50 %lluus, p99 %lluus, p99.9 %lluus, max %lldus\n",
+           driftPercentile(&player->drift, 0.5) / 1000, driftPercentile(&player->drift, 0.99) / 1000,
+           driftPercentile(&player->drift, 0.999) / 1000, player->drift.max / 1000);
+}
@@ -5,6 +5,10 @@
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "midi.h"
 
 typedef struct {
@@ -13,53 +17,282 @@ typedef struct {
     unsigned short timediv;
 } midiHeader_t;
 
+// Hot part of a MIDI event, read on every playback step
 typedef struct {
     unsigned int delta; // DeltaTime before this event
     unsigned char status;
     unsigned char param1; // Event type for meta events, param1 for midi
     unsigned char param2;
-    unsigned int dataSize;
-    unsigned char *data; // Data for meta and SysEx events if applicable
 } midiEvent_t;
 
-typedef struct nodeMidiEvent {
-    struct nodeMidiEvent *next;
-    midiEvent_t event;
-} nodeMidiEvent_t;
-
+// Cold part of a MIDI event, only meta and SysEx events have data
 typedef struct {
-    nodeMidiEvent_t *first;
-    nodeMidiEvent_t *last;
-} listMidiEvent_t;
+    unsigned int offset; // Offset of the data in the mapped file
+    unsigned int size;
+} midiEventData_t;
 
+// Events of one track, both arrays have eventN elements and live in the midiData_t arena
 typedef struct {
+    unsigned int offset; // Offset of the track data in the mapped file
     unsigned int size;
-    listMidiEvent_t eventList;
+    unsigned int eventN;
+    midiEvent_t *events;
+    midiEventData_t *eventData;
 } midiTrack_t;
 
 typedef struct {
     midiHeader_t header;
-    midiTrack_t *tracks;
+    midiTrack_t *tracks; // Start of the arena holding all tracks and events
+    const unsigned char *map; // Memory mapped MIDI file, event data points into it
+    size_t mapSize;
 } midiData_t;
 
-// Contains all the data stored by the parser and the player
-// Represents one midi file
+// Upper limit for the number of threads decoding tracks
+#define MAX_PARSE_THREADS 64
+
+// Cursor over a part of the mapped MIDI file
+typedef struct {
+    const unsigned char *pos;
+    const unsigned char *end;
+    unsigned char runningStatus; // Last MIDI status byte, 0 if none
+    unsigned char error;         // Set when a read would go past end
+} midiReader_t;
+
+// Types of compiled timeline commands
+#define CMD_NOTE 0           // Note on the stepper, note is the note number or NOTE_OFF
+                             // Before voice allocation value is the voice key and size the velocity, 0 for note off
+#define CMD_TEMPO 1          // value is the new tempo in microseconds per beat
+#define CMD_TIME_SIGNATURE 2 // value is numerator | denominator exponent << 8
+#define CMD_TRACK_NAME 3     // value and size are the offset and length of the name in the timeline text
+
+// One entry of the compiled timeline
+typedef struct {
+    unsigned long long time; // Absolute time from the start of the song in ns
+    unsigned int tick;       // Absolute time from the start of the song in ticks
+    unsigned int value;
+    unsigned short track;    // Track the command came from
+    unsigned char type;
+    unsigned char stepper;   // Target stepper for note commands
+    unsigned char note;
+    unsigned char size;
+} midiCommand_t;
+
+// All tracks merged into one time sorted command array
+typedef struct {
+    midiCommand_t *commands;
+    unsigned int commandN;
+    const unsigned char *text; // Base for the track name offsets
+    void *cacheMap;            // Mapped compiled score if the timeline was loaded from the cache
+    size_t cacheMapSize;
+} midiTimeline_t;
+
+// Wakeup lateness histogram buckets, exact below 16us and then 8 buckets per power of two
+#define DRIFT_BUCKETS LATENCY_BUCKETS
+
+// Difference between the actual and the ideal time of played commands
+typedef struct {
+    unsigned int count;
+    long long sum;  // ns
+    long long max;  // ns
+    long long last; // ns
+    unsigned int histogram[DRIFT_BUCKETS]; // Wakeups by lateness in us
+} midiDrift_t;
+
+// Playback speed of the file's tempo, in 1/SPEED_NORMAL
+#define SPEED_NORMAL 1000
+#define SPEED_MIN 100  // 0.1x
+#define SPEED_MAX 4000 // 4x
+
+// Playback state shared by the compiled and the streaming player
 typedef struct {
-    midiData_t data;
-    unsigned short timeDiv;   // Ticks per beat
     unsigned char timeSig[2]; // Time signature (timeSig[0] / 2^timeSig[1]) - default 4/4
     unsigned int currTempo;   // Track tempo in microseconds per beat - default 120bpm
-    unsigned short done;      // Number of tracks finished playing
-    unsigned char currNotes[MAX_STEPPERS];
-    nodeMidiEvent_t **currEvents;
+    struct timespec startTime;     // Absolute time anchorTime plays at
+    unsigned long long anchorTime; // Song time in ns the schedule counts from, moved when the speed changes
     struct timespec nextEventTime; // Absolute time of the next closest midi event
+    midiDrift_t drift;
+    unsigned char freeRun; // Don't sleep, play as fast as possible
+    FILE *render;          // Driver commands are written here as CSV with their due time instead of to outFile
+    unsigned int spinNs;   // Sleep until this long before each command and busy wait the rest, 0 to only sleep
+    unsigned long long lookahead; // Notes are sent this many ns early and queued in the driver until due
+    unsigned char mutedSteppers;  // Bit mask of steppers the player doesn't write to, used while crossfading
+    unsigned char notes[MAX_STEPPERS]; // Note playing on each stepper
+    unsigned char batch[DRIVER_BATCH_LEN]; // Immediate notes not written yet, the ones due together go in one write
+    unsigned char batchSize;
+    unsigned int speed;    // SPEED_NORMAL plays at the tempo of the file
+    unsigned char paused;
+    // Transport requested by another thread, applied by playNext before its next command
+    unsigned int requestedSpeed;
+    unsigned char requestedPause;
+} midiPlayer_t;
+
+// Commands between two seek checkpoints
+#define SEEK_INTERVAL 256
+
+// Player state before the command at a checkpoint, seeking replays at most SEEK_INTERVAL commands from it
+typedef struct {
+    unsigned int tempo;
+    unsigned char timeSig[2];
+    unsigned char notes[MAX_STEPPERS];
+} midiCheckpoint_t;
+
+// Time signature region, bars are counted from 1
+typedef struct {
+    unsigned long long tick; // Start of the region
+    unsigned int bar;        // Bar starting at tick
+    unsigned char timeSig[2];
+} midiMeter_t;
+
+// Voice allocation policies, decide which note loses when more notes play than there are steppers
+#define VOICE_SKYLINE 0 // Keep the highest notes, the melody is usually on top
+#define VOICE_BASS 1    // Keep the lowest notes
+#define VOICE_FIRST 2   // Keep the notes that started first, new notes are dropped
+
+// Note playing on a stepper
+typedef struct {
+    unsigned long long released; // Time the stepper became free, the longest free stepper is used first
+    unsigned int key;            // Voice key (track << 4 | channel) of the note
+    unsigned char note;
+    unsigned char active;
+} midiVoice_t;
+
+// State of the event to command conversion: tempo map segment and notes on the steppers
+typedef struct {
+    unsigned long long segmentTick; // Tick where the current tempo started
+    unsigned long long segmentNs;   // Time where the current tempo started, in ns * timeDiv
+    unsigned long long tempo;       // Microseconds per beat
+    unsigned short timeDiv;
+    unsigned short format;  // Tempo and time signature belong on track 0 only in format 1
+    unsigned char steppers; // Steppers notes are allocated to, at most MAX_STEPPERS
+    unsigned char policy;   // VOICE_*
+    midiVoice_t voices[MAX_STEPPERS];
+    unsigned int droppedNotes; // Notes that never got a stepper
+    unsigned int cutNotes;     // Notes that lost their stepper to a higher priority note
+} midiCompiler_t;
+
+// Position of a track while merging, ordered by tick and then by track number
+typedef struct {
+    unsigned long long tick;
+    unsigned int index;
+    unsigned short track;
+} trackCursor_t;
+
+// Contains all the data stored by the parser and the player
+// Represents one midi file
+typedef struct {
+    midiData_t data;
+    midiTimeline_t timeline;
+    unsigned short timeDiv; // Ticks per beat
+    unsigned int position;  // Index of the next command in the timeline
+    midiPlayer_t player;
+    midiCheckpoint_t *checkpoints; // Checkpoint i is the state before command i * SEEK_INTERVAL
+    unsigned int checkpointN;
+    midiMeter_t *meters; // Time signature regions in tick order, meters[0] starts at tick 0
+    unsigned int meterN;
+    unsigned char steppers; // Steppers the timeline is compiled for, set before initPlayer
+    unsigned char policy;   // Voice allocation policy, VOICE_*
+    unsigned long long loopStart; // A/B loop in ns, off when loopEnd is 0
+    unsigned long long loopEnd;
 } midi_t;
 
+// Reads size bytes as a big-endian integer, sets reader->error if there are not enough bytes
+unsigned int readInt(int size, midiReader_t *reader);
+
+// Reads the MIDI file header
+// Returns 0 on faliure, 1 on success
+int readHeader(midiHeader_t *header, midiReader_t *reader);
+
+// Reads one MIDI event, meta and SysEx data is stored as an offset from map
+// Sets reader->error if the event doesn't fit before reader->end
+// Returns 0 on faliure, 1 on success
+int readEvent(midiEvent_t *event, midiEventData_t *eventData, const unsigned char *map, midiReader_t *reader);
+
+// Min-heap of track cursors used to merge tracks
+void heapDown(trackCursor_t *heap, unsigned int size);
+void heapUp(trackCursor_t *heap, unsigned int size);
+
+// Initializes the compiler state at the start of the song
+void initCompiler(midiCompiler_t *compiler, unsigned short timeDiv);
+
+// Converts a tick to ns from the start of the song, using the current tempo segment
+unsigned long long compilerTime(const midiCompiler_t *compiler, unsigned long long tick);
+
+// Starts a new tempo segment at tick, tempo is in us per quarter note
+void compilerSetTempo(midiCompiler_t *compiler, unsigned long long tick, unsigned int tempo);
+
+// Finds a stepper for a starting note, following the allocation policy
+// Returns the stepper or -1 if the note is dropped
+int allocNoteOn(midiCompiler_t *compiler, unsigned int key, unsigned char note);
+
+// Frees the stepper of the note with the voice key
+// Returns the stepper or -1 if the note has no stepper
+int allocNoteOff(midiCompiler_t *compiler, unsigned int key, unsigned char note, unsigned long long time);
+
+// Allocates the stepper of one compiled note command as it's played
+// Returns 1 if the command should be played, 0 if it's dropped
+int allocateCommand(midiCompiler_t *compiler, midiCommand_t *command);
+
+// Voice allocation policy from its name: skyline, bass or first
+// Returns the VOICE_* policy or -1 if the name is unknown
+int parseVoicePolicy(const char *name);
+
+// Converts one event to a timeline command, name offsets are relative to text
+// Returns 1 if the event produced a command, 0 if it's ignored
+int compileEvent(midiCompiler_t *compiler, midiCommand_t *command, unsigned short track, unsigned long long tick,
+                 const midiEvent_t *event, const unsigned char *eventBytes, unsigned int dataSize,
+                 const unsigned char *text);
+
+// Resets the playback state to the start of the song
+void initPlayerState(midiPlayer_t *player);
+
+// Sleeps until time ns after the start of the song and records how late the wakeup was
+// With spinNs set the last part of the wait is a busy loop, which is not delayed by the scheduler wakeup
+// With lookahead set it returns lookahead ns before time
+// Returns 0 if interrupted by a signal, 1 on success
+int playerWait(midiPlayer_t *player, unsigned long long time);
+
+// Absolute time the command at time ns after the start of the song is due, following the speed changes
+void playerDueTime(const midiPlayer_t *player, unsigned long long time, struct timespec *due);
+
+// Requests a playback speed in 1/SPEED_NORMAL, clamped to [SPEED_MIN,SPEED_MAX], can be called from any thread
+void playerSetSpeed(midiPlayer_t *player, unsigned int speed);
+
+// Requests pause or resume, while paused the steppers are silent, can be called from any thread
+void playerSetPause(midiPlayer_t *player, unsigned char paused);
+
+// Stops all notes right away, the notes queued in the driver are dropped
+void playerStop(midiPlayer_t *player, int outFile);
+
+// Executes one timeline command, name offsets are relative to text
+// Notes without lookahead are held until playerFlush, so the notes of one time go to the driver in one write
+void playerRun(midiPlayer_t *player, const midiCommand_t *command, const unsigned char *text, int outFile);
+
+// Writes the held notes to the driver at once
+void playerFlush(midiPlayer_t *player, int outFile);
+
+// Writes a driver command, notes for steppers the driver doesn't have are left out
+// The driver rejects a whole batch if one stepper is over its steppers_count, such a batch is written again
+// pair by pair, which finds the missing steppers, so later batches take one write again
+// Returns the length of the command on success, -1 if a write failed
+long writeDriverCommand(int outFile, const unsigned char *command, unsigned int length);
+
+// Stops the notes still playing on the steppers that aren't muted, due with the command last waited for
+void playerSilence(midiPlayer_t *player, int outFile);
+
 // Reads the entire MIDI file and stores it in midiData
 // Returns 0 on faliure, 1 on success
 int readMidiFile(midi_t *handler, const char *midiFileName);
 
-// Initializes the parser module handler
+// Reads the entire MIDI file, decoding the tracks on up to threads threads
+// The result is the same as readMidiFile
+// Returns 0 on faliure, 1 on success
+int readMidiFileThreads(midi_t *handler, const char *midiFileName, unsigned int threads);
+
+// Merges all tracks into the timeline, applying the tempo map with exact integer arithmetic
+// Returns 0 on faliure, 1 on success
+int compileTimeline(midi_t *handler);
+
+// Initializes the parser module handler, compiles the timeline if it's not loaded from the cache
 // Returns 0 on faliure, 1 on success
 int initPlayer(midi_t *handler);
 
@@ -67,8 +300,47 @@ int initPlayer(midi_t *handler);
 void freeMidi(midi_t *handler);
 
 // Plays the next events in the MIDI file, this function is blocking
+// Sleeps once until the time of the next command and plays all commands with that time
+// At the end of the A/B loop playback jumps back to its start
+// Speed and pause requests are applied first, a paused player sleeps until woken
 // Writes the steppatron commands to outFile
 // Returns 0 on faliure, 1 on success
 int playNext(midi_t *handler, int outFile);
 
+// Index of the first command at or after time ns, commandN if there is none
+unsigned int findTime(const midiTimeline_t *timeline, unsigned long long time);
+
+// Index of the first command at or after tick, commandN if there is none
+unsigned int findTick(const midiTimeline_t *timeline, unsigned long long tick);
+
+// Converts a tick to ns through the tempo map of the timeline
+unsigned long long tickTime(const midi_t *handler, unsigned long long tick);
+
+// Tick of the start of bar (counted from 1), following the time signature changes
+unsigned long long barTick(const midi_t *handler, unsigned int bar);
+
+// Moves playback to the command at position, restoring the tempo, time signature and the notes on the steppers
+// Notes that differ from the ones playing are written to outFile, the schedule is not changed
+void seekPosition(midi_t *handler, unsigned int position, int outFile);
+
+// Moves playback to time ns, the next command plays when it's due relative to time
+// With lookahead the notes queued in the driver are dropped first
+void seekTime(midi_t *handler, unsigned long long time, int outFile);
+
+// Plays the region from start to end ns in a loop, end 0 turns the loop off
+// Returns 0 on faliure, 1 on success
+int setLoop(midi_t *handler, unsigned long long start, unsigned long long end);
+
+// Lateness in ns that the fraction of the wakeups didn't exceed, rounded up to the histogram bucket
+unsigned long long driftPercentile(const midiDrift_t *drift, double fraction);
+
+// Records one latency in ns in the histogram
+void addDrift(midiDrift_t *drift, long long ns);
+
+// Adds the wakeups recorded in from to into
+void mergeDrift(midiDrift_t *into, const midiDrift_t *from);
+
+// Prints how late the played commands were compared to the tempo map
+void printDriftReport(const midiPlayer_t *player);
+
 #endif
\ No newline at end of file
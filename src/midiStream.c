@@ -0,0 +1,179 @@
+#include "midiStream.h"
+#include <string.h>
+
+// Reads more of the track into the buffer, moving the undecoded bytes to its start
+// The buffer only grows when a single event doesn't fit in it
+// Returns 0 on faliure, 1 on success
+int fillCursor(midiStreamCursor_t *cursor, int fd) {
+    if (cursor->offset >= cursor->end) return 0;
+    if (cursor->bufferPos > 0) {
+        memmove(cursor->buffer, cursor->buffer + cursor->bufferPos, cursor->bufferLen - cursor->bufferPos);
+        cursor->bufferLen -= cursor->bufferPos;
+        cursor->bufferPos = 0;
+    } else if (cursor->bufferLen == cursor->bufferSize) {
+        unsigned char *buffer = (unsigned char *)realloc(cursor->buffer, cursor->bufferSize * 2);
+        if (buffer == NULL) {
+            fprintf(stderr, "Not enough memory available!\n");
+            return 0;
+        }
+        cursor->buffer = buffer;
+        cursor->bufferSize *= 2;
+    }
+
+    size_t size = cursor->bufferSize - cursor->bufferLen;
+    if ((off_t)size > cursor->end - cursor->offset) size = cursor->end - cursor->offset;
+    ssize_t count = pread(fd, cursor->buffer + cursor->bufferLen, size, cursor->offset);
+    if (count <= 0) return 0;
+    cursor->bufferLen += count;
+    cursor->offset += count;
+    return 1;
+}
+
+// Decodes the next event of the track into cursor->event
+// Returns 0 at the end of the track or on faliure, 1 on success
+int nextCursorEvent(midiStreamCursor_t *cursor, int fd) {
+    while (cursor->bufferPos < cursor->bufferLen || cursor->offset < cursor->end) {
+        midiReader_t reader = {cursor->buffer + cursor->bufferPos, cursor->buffer + cursor->bufferLen, cursor->runningStatus, 0};
+        if (readEvent(&cursor->event, &cursor->eventData, cursor->buffer, &reader)) {
+            cursor->bufferPos = reader.pos - cursor->buffer;
+            cursor->runningStatus = reader.runningStatus;
+            return 1;
+        }
+        // Invalid event, readEvent already reported it
+        if (!reader.error) return 0;
+        // The event continues past the buffer
+        if (!fillCursor(cursor, fd)) {
+            fprintf(stderr, "Error while reading midi event - track truncated\n");
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Opens the MIDI file and reads the first event of every track
+// Returns 0 on faliure, 1 on success
+int openMidiStream(midiStream_t *stream, const char *midiFileName) {
+    memset(stream, 0, sizeof(midiStream_t));
+    stream->fd = open(midiFileName, O_RDONLY);
+    if (stream->fd < 0) {
+        fprintf(stderr, "Error while opening file %s\n", midiFileName);
+        return 0;
+    }
+
+    // Header chunk: ID, size and at least format, track count and time division
+    unsigned char chunk[64];
+    ssize_t count = pread(stream->fd, chunk, sizeof(chunk), 0);
+    midiReader_t reader = {chunk, chunk + (count > 0 ? count : 0), 0, 0};
+    if (!readHeader(&stream->header, &reader)) {
+        closeMidiStream(stream);
+        return 0;
+    }
+    if (stream->header.format > 1) {
+        // Format 2 sequences need the track lengths before playing, load those files instead
+        fprintf(stderr, "Only format 0 and 1 MIDI files can be streamed\n");
+        closeMidiStream(stream);
+        return 0;
+    }
+    unsigned short timeDiv = stream->header.timediv & 0x7FFF;
+    if (timeDiv == 0) {
+        fprintf(stderr, "Invalid time division\n");
+        closeMidiStream(stream);
+        return 0;
+    }
+
+    unsigned short trackN = stream->header.trackN;
+    stream->cursors = (midiStreamCursor_t *)calloc(trackN ? trackN : 1, sizeof(midiStreamCursor_t));
+    stream->heap = (trackCursor_t *)malloc(sizeof(trackCursor_t) * (trackN ? trackN : 1));
+    if (stream->cursors == NULL || stream->heap == NULL) {
+        fprintf(stderr, "Not enough memory available!\n");
+        closeMidiStream(stream);
+        return 0;
+    }
+
+    // Skim the track chunk headers, each track is only read when it's played
+    off_t offset = reader.pos - chunk;
+    for (unsigned short i = 0; i < trackN; i++) {
+        midiStreamCursor_t *cursor = &stream->cursors[i];
+        count = pread(stream->fd, chunk, 8, offset);
+        reader = (midiReader_t){chunk, chunk + (count > 0 ? count : 0), 0, 0};
+        if (readInt(4, &reader) != TRACK_CHUNK_ID) {
+            fprintf(stderr, "Error while reading track header - invalid ID\n");
+            closeMidiStream(stream);
+            return 0;
+        }
+        unsigned int size = readInt(4, &reader);
+        cursor->offset = offset + 8;
+        cursor->end = cursor->offset + size;
+        offset = cursor->end;
+        cursor->bufferSize = STREAM_BUFFER_SIZE;
+        cursor->buffer = (unsigned char *)malloc(cursor->bufferSize);
+        if (cursor->buffer == NULL) {
+            fprintf(stderr, "Not enough memory available!\n");
+            closeMidiStream(stream);
+            return 0;
+        }
+        if (nextCursorEvent(cursor, stream->fd)) {
+            stream->heap[stream->heapSize++] = (trackCursor_t){cursor->event.delta, 0, i};
+            heapUp(stream->heap, stream->heapSize);
+        }
+    }
+
+    initCompiler(&stream->compiler, timeDiv);
+    stream->compiler.format = stream->header.format;
+    initPlayerState(&stream->player);
+    return 1;
+}
+
+// Plays the next events in the MIDI file, this function is blocking
+// Returns 0 when the song is finished or on faliure, 1 on success
+int streamNext(midiStream_t *stream, int outFile) {
+    if (stream->heapSize == 0) {
+        return 0;
+    }
+
+    // Tempo changes only affect later ticks, so the time of the earliest event is already known
+    unsigned long long time = compilerTime(&stream->compiler, stream->heap[0].tick);
+    if (!playerWait(&stream->player, time)) {
+        // Interrupted by a signal, the caller decides whether to continue
+        return 1;
+    }
+
+    midiCommand_t command;
+    while (stream->heapSize > 0 && compilerTime(&stream->compiler, stream->heap[0].tick) == time) {
+        trackCursor_t *top = &stream->heap[0];
+        midiStreamCursor_t *cursor = &stream->cursors[top->track];
+        if (compileEvent(&stream->compiler, &command, top->track, top->tick, &cursor->event,
+                         cursor->buffer + cursor->eventData.offset, cursor->eventData.size, cursor->buffer) &&
+            allocateCommand(&stream->compiler, &command)) {
+            playerRun(&stream->player, &command, cursor->buffer, outFile);
+        }
+        stream->eventN++;
+
+        // Advance the track, remove it from the heap when it's finished
+        if (nextCursorEvent(cursor, stream->fd)) {
+            top->tick += cursor->event.delta;
+        } else {
+            stream->heap[0] = stream->heap[--stream->heapSize];
+        }
+        if (stream->heapSize > 0) heapDown(stream->heap, stream->heapSize);
+    }
+    playerFlush(&stream->player, outFile);
+
+    return 1;
+}
+
+// Closes the file and frees the memory
+void closeMidiStream(midiStream_t *stream) {
+    if (stream->cursors != NULL) {
+        for (unsigned short i = 0; i < stream->header.trackN; i++) {
+            free(stream->cursors[i].buffer);
+        }
+    }
+    free(stream->cursors);
+    free(stream->heap);
+    stream->cursors = NULL;
+    stream->heap = NULL;
+    stream->heapSize = 0;
+    if (stream->fd >= 0) close(stream->fd);
+    stream->fd = -1;
+}
@@ -0,0 +1,48 @@
+#ifndef MIDISTREAM_H
+#define MIDISTREAM_H
+
+#include "midiParser.h"
+
+// Initial size of the read buffer of each track, grows only for events that don't fit
+#define STREAM_BUFFER_SIZE 4096
+
+// Lazy cursor over one track, decodes events on demand from the file
+typedef struct {
+    off_t offset; // File offset of the next byte to read into the buffer
+    off_t end;    // File offset of the end of the track
+    unsigned char *buffer;
+    unsigned int bufferSize;
+    unsigned int bufferPos; // Next undecoded byte in the buffer
+    unsigned int bufferLen; // Valid bytes in the buffer
+    unsigned char runningStatus;
+    midiEvent_t event;         // Current event
+    midiEventData_t eventData; // Current event data, offset is relative to the buffer
+} midiStreamCursor_t;
+
+// Streaming player, memory is bounded by the number of tracks and not by the song length
+// Tracks are merged with a min-heap keyed on the next event tick
+// Voices are allocated as the notes play, notes ending on the tick of a new note may not free their stepper in time
+typedef struct {
+    int fd;
+    midiHeader_t header;
+    midiStreamCursor_t *cursors;
+    trackCursor_t *heap;
+    unsigned int heapSize;
+    midiCompiler_t compiler; // Steppers and voice policy can be set after opening
+    midiPlayer_t player;
+    unsigned long long eventN; // Number of events decoded so far
+} midiStream_t;
+
+// Opens the MIDI file and reads the first event of every track
+// Returns 0 on faliure, 1 on success
+int openMidiStream(midiStream_t *stream, const char *midiFileName);
+
+// Plays the next events in the MIDI file, this function is blocking
+// Writes the steppatron commands to outFile
+// Returns 0 when the song is finished or on faliure, 1 on success
+int streamNext(midiStream_t *stream, int outFile);
+
+// Closes the file and frees the memory
+void closeMidiStream(midiStream_t *stream);
+
+#endif
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "netMidi.h"
+#include "logger.h"
+
+static void putBig(unsigned char *buffer, unsigned long long value, int size) {
+    for (int i = size - 1; i >= 0; i--) {
+        buffer[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static unsigned long long getBig(const unsigned char *buffer, int size) {
+    unsigned long long value = 0;
+    for (int i = 0; i < size; i++) value = value << 8 | buffer[i];
+    return value;
+}
+
+// Writes a datagram with the messages to buffer, which must hold NET_DATAGRAM_SIZE bytes
+// Returns the size of the datagram, 0 if there are too many messages
+unsigned int packNetDatagram(unsigned char *buffer, unsigned int sequence, unsigned long long time,
+                             const netMessage_t *messages, unsigned int messageN) {
+    if (messageN > NET_MAX_MESSAGES) return 0;
+    buffer[0] = 'S';
+    buffer[1] = 'M';
+    buffer[2] = NET_VERSION;
+    buffer[3] = messageN;
+    putBig(buffer + 4, sequence, 4);
+    putBig(buffer + 8, time, 8);
+    unsigned char *entry = buffer + NET_HEADER_SIZE;
+    for (unsigned int i = 0; i < messageN; i++, entry += NET_MESSAGE_SIZE) {
+        const midiMessage_t *message = &messages[i].message;
+        putBig(entry, messages[i].offset, 2);
+        entry[2] = message->type | message->channel;
+        entry[3] = message->param1 & 0x7F;
+        entry[4] = message->param2 & 0x7F;
+    }
+    return NET_HEADER_SIZE + messageN * NET_MESSAGE_SIZE;
+}
+
+// Reads the header of a datagram
+// Returns the number of messages, -1 if the datagram isn't in the format
+int unpackNetHeader(const unsigned char *buffer, unsigned int size, unsigned int *sequence,
+                    unsigned long long *time) {
+    if (size < NET_HEADER_SIZE || buffer[0] != 'S' || buffer[1] != 'M' || buffer[2] != NET_VERSION) return -1;
+    if (size != NET_HEADER_SIZE + buffer[3] * (unsigned int)NET_MESSAGE_SIZE) return -1;
+    *sequence = getBig(buffer + 4, 4);
+    *time = getBig(buffer + 8, 8);
+    return buffer[3];
+}
+
+// Reads message i of a datagram that unpackNetHeader accepted
+void unpackNetMessage(const unsigned char *buffer, unsigned int i, netMessage_t *message) {
+    const unsigned char *entry = buffer + NET_HEADER_SIZE + i * NET_MESSAGE_SIZE;
+    message->offset = getBig(entry, 2);
+    message->message.type = entry[2] & 0xF0;
+    message->message.channel = entry[2] & 0x0F;
+    message->message.param1 = entry[3] & 0x7F;
+    message->message.param2 = entry[4] & 0x7F;
+}
+
+// Inserts a message in the jitter buffer, from the back since messages mostly arrive in order
+// Returns 0 if the buffer is full, 1 on success
+static int pushPending(netMidi_t *net, unsigned long long due, const midiMessage_t *message) {
+    if (net->pendingN == NET_BUFFER_SIZE) return 0;
+    unsigned int i = net->pendingN++;
+    while (i > 0) {
+        netPending_t *prev = &net->pending[(net->head + i - 1) & (NET_BUFFER_SIZE - 1)];
+        // Equal times keep their arrival order
+        if (prev->due <= due) break;
+        net->pending[(net->head + i) & (NET_BUFFER_SIZE - 1)] = *prev;
+        i--;
+    }
+    netPending_t *slot = &net->pending[(net->head + i) & (NET_BUFFER_SIZE - 1)];
+    slot->due = due;
+    slot->message = *message;
+    return 1;
+}
+
+// Checks the sequence number of a datagram that arrived at arrival
+static void trackSequence(netMidi_t *net, unsigned int sequence, unsigned long long time,
+                          unsigned long long arrival) {
+    int gap = (int)(sequence - net->expected);
+    if (!net->synced || gap < -NET_RESTART_GAP || gap > NET_RESTART_GAP) {
+        if (net->synced) logMessage(LOG_WARNING, "Warning: Network sender restarted\n");
+        net->synced = 1;
+        net->offset = (long long)(arrival - time);
+        net->expected = sequence + 1;
+        return;
+    }
+    if (gap > 0) {
+        net->lost += gap;
+        logMessage(LOG_WARNING, "Warning: %d network datagrams lost before %u\n", gap, sequence);
+    } else if (gap < 0) {
+        // It was counted as lost when the later datagram came
+        net->reordered++;
+        if (net->lost > 0) net->lost--;
+        return;
+    }
+    net->expected = sequence + 1;
+}
+
+// Queues the messages of one datagram for playout
+static void receiveDatagram(netMidi_t *net, const unsigned char *buffer, unsigned int size,
+                            unsigned long long arrival) {
+    unsigned int sequence;
+    unsigned long long time;
+    int messageN = unpackNetHeader(buffer, size, &sequence, &time);
+    if (messageN < 0) {
+        net->invalid++;
+        return;
+    }
+    net->datagrams++;
+    trackSequence(net, sequence, time, arrival);
+    // The fastest datagram had the least queueing, the others play later by their extra delay
+    // A slower datagram moves the offset up a little, so a sender clock drifting behind isn't left behind
+    long long offset = (long long)(arrival - time);
+    if (offset < net->offset) net->offset = offset;
+    else net->offset += (offset - net->offset) >> 12;
+
+    unsigned long long base = time + net->offset + net->delay;
+    for (int i = 0; i < messageN; i++) {
+        netMessage_t message;
+        unpackNetMessage(buffer, i, &message);
+        unsigned long long due = base + message.offset * 1000ULL;
+        net->messages++;
+        if (due < arrival) {
+            // Playing it late keeps the note, dropping a note off would leave a stepper on
+            net->late++;
+            due = arrival;
+        }
+        if (!pushPending(net, due, &message.message)) {
+            net->dropped++;
+            logMessage(LOG_WARNING, "Warning: Network jitter buffer full, message dropped\n");
+        }
+    }
+}
+
+// Reads every datagram waiting on the socket
+// Returns 0 if the socket failed, 1 on success
+static int drainSocket(netMidi_t *net) {
+    unsigned char buffer[NET_DATAGRAM_SIZE + 1];
+    while (1) {
+        ssize_t size = recv(net->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 1;
+            logMessage(LOG_ERROR, "Problem reading the network socket: %s\n", strerror(errno));
+            return 0;
+        }
+        receiveDatagram(net, buffer, size, monotonicNs());
+    }
+}
+
+// Takes the due messages from the jitter buffer, the notes among them go to the driver in one write
+// Returns the length of the command, 0 if no note was due
+static int playDue(netMidi_t *net, unsigned char *command, liveLatency_t *latency) {
+    int length = 0;
+    unsigned long long now = monotonicNs();
+    while (net->pendingN > 0 && length < DRIVER_BATCH_LEN) {
+        netPending_t *pending = &net->pending[net->head];
+        if (pending->due > now) break;
+        midiMessage_t message = pending->message;
+        net->head = (net->head + 1) & (NET_BUFFER_SIZE - 1);
+        net->pendingN--;
+        unsigned char *note = command + length;
+        if (!voiceMessageCommand(&net->voices, message.channel, &message, note)) {
+            bendMessage(&net->bends, message.channel, &message, now);
+            continue;
+        }
+        bendNoteCommand(&net->bends, message.channel, note, now);
+        length += 2;
+        if (note[1] != NOTE_OFF) {
+            logMessage(LOG_NOTE, "Note %d from channel %d on stepper %d ON\n", note[1], message.channel, note[0]);
+        } else {
+            logMessage(LOG_NOTE, "Note on stepper %d OFF\n", note[0]);
+        }
+    }
+    // The notes start when the jitter buffer releases them, the delay before is on purpose
+    if (length > 0 && latency != NULL) latencyAllocated(latency, 0, now);
+    return length;
+}
+
+// Opens a non-blocking UDP socket on the port of every interface
+// Returns 0 on faliure, 1 on success
+int netInit(netMidi_t *net, unsigned short port, unsigned int delayMs, unsigned int steppers,
+            unsigned char policy, unsigned int bendWindowMs) {
+    memset(net, 0, sizeof(*net));
+    net->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (net->socket < 0) {
+        fprintf(stderr, "Cannot open a UDP socket: %s\n", strerror(errno));
+        return 0;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(net->socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "Cannot listen on UDP port %u: %s\n", port, strerror(errno));
+        close(net->socket);
+        return 0;
+    }
+    net->delay = delayMs * 1000000ULL;
+    initVoiceAllocator(&net->voices, steppers <= MAX_STEPPERS && steppers != 0 ? steppers : 1, policy);
+    initBendCoalescer(&net->bends, bendWindowMs);
+    logMessage(LOG_INFO, "Listening for MIDI on UDP port %u, playout delay %ums\n", port, delayMs);
+    return 1;
+}
+
+// Logs the network and stepper statistics and closes the socket
+void netClose(netMidi_t *net) {
+    logMessage(LOG_INFO, "Network: %u datagrams, %u messages, %u datagrams lost, %u reordered, %u messages late, "
+                         "%u dropped, %u invalid datagrams\n",
+               net->datagrams, net->messages, net->lost, net->reordered, net->late, net->dropped, net->invalid);
+    logVoiceStats(&net->voices);
+    logBendStats(&net->bends);
+    close(net->socket);
+}
+
+// Gets the next command to be sent to the steppatron driver, the notes that reached their playout time
+// or a DRIVER_PERIOD pitch bend
+// Waits for the next playout time, pitch bend or input, at most NET_POLL_MS
+// Returns -1 if the socket failed, 0 if there is no command, the length of the command on success
+int getNetCommand(unsigned char *command, netMidi_t *net, liveLatency_t *latency) {
+    if (bendCommand(&net->bends, command, monotonicNs())) return DRIVER_PERIOD_LEN;
+    int length = playDue(net, command, latency);
+    if (length > 0) return length;
+
+    unsigned long long wait = NET_POLL_MS * 1000000ULL;
+    unsigned long long now = monotonicNs();
+    unsigned long long due[2] = {net->pendingN > 0 ? net->pending[net->head].due : 0, net->bends.due};
+    for (int i = 0; i < 2; i++) {
+        if (due[i] == 0) continue;
+        if (due[i] <= now) wait = 0;
+        else if (due[i] - now < wait) wait = due[i] - now;
+    }
+    struct timespec timeout = {wait / NS_PER_S, wait % NS_PER_S};
+    struct pollfd pollFd = {net->socket, POLLIN, 0};
+    int ready = ppoll(&pollFd, 1, &timeout, NULL);
+    if (ready < 0) {
+        if (errno == EINTR) return 0;
+        logMessage(LOG_ERROR, "Problem waiting for network input: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ready > 0 && !drainSocket(net)) return -1;
+    return playDue(net, command, latency);
+}
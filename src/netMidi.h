@@ -0,0 +1,104 @@
+#ifndef NETMIDI_H
+#define NETMIDI_H
+
+#include <stdio.h>
+#include "midi.h"
+#include "voiceAlloc.h"
+#include "pitchBend.h"
+#include "latency.h"
+
+// MIDI over UDP from a sequencing machine on the network
+//
+// Datagram, all fields big-endian:
+//  0  'S' 'M'
+//  2  version, NET_VERSION
+//  3  number of messages
+//  4  sequence number, one more for every datagram of a sender
+//  8  send time of the first message in ns, on the sender's clock
+// 16  messages, 5 bytes each: offset from the send time in us (2 bytes), status, data 1, data 2
+// Like RTP-MIDI, the send time and the offsets let the receiver play every message at its original spacing
+// after a fixed delay, however late the datagram that carried it arrived
+
+#define NET_DEFAULT_PORT 5004
+#define NET_VERSION 1
+#define NET_HEADER_SIZE 16
+#define NET_MESSAGE_SIZE 5
+#define NET_MAX_MESSAGES 255
+#define NET_DATAGRAM_SIZE (NET_HEADER_SIZE + NET_MAX_MESSAGES * NET_MESSAGE_SIZE)
+// Playout delay if none is given, covers the jitter of a wired LAN
+#define NET_DEFAULT_DELAY_MS 20
+// Messages waiting for their playout time, must be a power of two
+#define NET_BUFFER_SIZE 1024
+// Longest wait for input, so the caller can check for the end of the program
+#define NET_POLL_MS 100
+// A sequence number this far from the expected one is a restarted sender, not reordering or loss
+// Senders start from a random sequence number, so a restart can't land near the old one
+#define NET_RESTART_GAP 1000
+
+// Channel message with its offset from the send time of the datagram
+typedef struct {
+    unsigned short offset; // us
+    midiMessage_t message;
+} netMessage_t;
+
+// Message in the jitter buffer
+typedef struct {
+    unsigned long long due; // Playout time, CLOCK_MONOTONIC ns
+    midiMessage_t message;
+} netPending_t;
+
+typedef struct {
+    int socket;
+    unsigned long long delay; // Playout delay in ns
+    // Local clock minus sender clock, from the fastest datagram seen
+    long long offset;
+    unsigned char synced;     // A datagram was received, expected and offset are set
+    unsigned int expected;    // Next sequence number
+    // Jitter buffer, a ring sorted by playout time
+    netPending_t pending[NET_BUFFER_SIZE];
+    unsigned int head;
+    unsigned int pendingN;
+    voiceAllocator_t voices; // The source of a note is its channel
+    bendCoalescer_t bends;
+    // Statistics
+    unsigned int datagrams;
+    unsigned int messages;
+    unsigned int lost;      // Datagrams missing from the sequence
+    unsigned int reordered; // Datagrams that came after a later one
+    unsigned int late;      // Messages that arrived after their playout time, played at once
+    unsigned int dropped;   // Messages that didn't fit in the jitter buffer
+    unsigned int invalid;   // Datagrams that aren't in the format
+} netMidi_t;
+
+// Writes a datagram with the messages to buffer, which must hold NET_DATAGRAM_SIZE bytes
+// Returns the size of the datagram, 0 if there are too many messages
+unsigned int packNetDatagram(unsigned char *buffer, unsigned int sequence, unsigned long long time,
+                             const netMessage_t *messages, unsigned int messageN);
+
+// Reads the header of a datagram
+// Returns the number of messages, -1 if the datagram isn't in the format
+int unpackNetHeader(const unsigned char *buffer, unsigned int size, unsigned int *sequence,
+                    unsigned long long *time);
+
+// Reads message i of a datagram that unpackNetHeader accepted
+void unpackNetMessage(const unsigned char *buffer, unsigned int i, netMessage_t *message);
+
+// Opens a non-blocking UDP socket on the port of every interface
+// delayMs is the playout delay, policy is the STEAL_* policy used when more notes play than there are steppers
+// Pitch bend and mod wheel updates of a stepper within bendWindowMs are sent as one
+// Returns 0 on faliure, 1 on success
+int netInit(netMidi_t *net, unsigned short port, unsigned int delayMs, unsigned int steppers,
+            unsigned char policy, unsigned int bendWindowMs);
+
+// Logs the network and stepper statistics and closes the socket
+void netClose(netMidi_t *net);
+
+// Gets the next command to be sent to the steppatron driver, the notes that reached their playout time
+// or a DRIVER_PERIOD pitch bend
+// Waits for the next playout time, pitch bend or input, at most NET_POLL_MS
+// latency gets the playout and allocation times of notes if it's not NULL
+// command must hold DRIVER_BATCH_LEN bytes
+// Returns -1 if the socket failed, 0 if there is no command, the length of the command on success
+int getNetCommand(unsigned char *command, netMidi_t *net, liveLatency_t *latency);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * Sends a MIDI file over UDP in the format steppatron n mode listens for,
+ * for testing network input over loopback or from another machine.
+ *
+ * The file is compiled for MAX_STEPPERS steppers like f mode does, and
+ * the notes of stepper i are sent on channel i in real time. Notes within
+ * --batch ms of each other share a datagram. Lost datagrams and network
+ * jitter can be simulated to see how the receiver copes.
+ *
+ * Use:
+ *  ./bin/netSend FILE.mid [--host ADDRESS] [--port N] [--batch MS] [--loss PERCENT] [--jitter MS]
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "midiParser.h"
+#include "netMidi.h"
+
+// Longest batch window, the offsets of the messages in a datagram are 16 bit us
+#define BATCH_MAX_MS 65
+#define DEFAULT_VELOCITY 100
+
+typedef struct {
+    int socket;
+    struct sockaddr_in address;
+    unsigned long long start;  // CLOCK_MONOTONIC ns the song starts at
+    unsigned int sequence;
+    unsigned int lossPercent;
+    unsigned long long jitter; // ns
+    unsigned int sent;
+    unsigned int lost;
+    unsigned int messageN;
+} sender_t;
+
+static void sleepUntil(unsigned long long time) {
+    struct timespec due = {time / NS_PER_S, time % NS_PER_S};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+    }
+}
+
+// Sends the batch when its first message is due, unless the simulated network loses it
+// Returns 0 on faliure, 1 on success
+static int sendBatch(sender_t *sender, unsigned long long time, const netMessage_t *messages,
+                     unsigned int messageN) {
+    if (messageN == 0) return 1;
+    unsigned char buffer[NET_DATAGRAM_SIZE];
+    unsigned int size = packNetDatagram(buffer, sender->sequence++, time, messages, messageN);
+    sender->messageN += messageN;
+    unsigned long long delay = sender->jitter ? (unsigned long long)rand() % sender->jitter : 0;
+    sleepUntil(time + delay);
+    if ((unsigned int)(rand() % 100) < sender->lossPercent) {
+        sender->lost++;
+        return 1;
+    }
+    if (sendto(sender->socket, buffer, size, 0, (struct sockaddr *)&sender->address, sizeof(sender->address)) < 0) {
+        fprintf(stderr, "Problem sending datagram: %s\n", strerror(errno));
+        return 0;
+    }
+    sender->sent++;
+    return 1;
+}
+
+static void addMessage(netMessage_t *messages, unsigned int *messageN, unsigned long long offset,
+                       unsigned char type, unsigned char channel, unsigned char note, unsigned char velocity) {
+    netMessage_t *message = &messages[(*messageN)++];
+    message->offset = offset / 1000;
+    message->message.type = type;
+    message->message.channel = channel;
+    message->message.param1 = note;
+    message->message.param2 = velocity;
+}
+
+// Sends the notes of the timeline in real time, batchNs apart at most in one datagram
+// Returns 0 on faliure, 1 on success
+static int sendSong(sender_t *sender, const midiTimeline_t *timeline, unsigned long long batchNs) {
+    netMessage_t messages[NET_MAX_MESSAGES];
+    unsigned int messageN = 0;
+    unsigned long long batchTime = 0;
+    unsigned char notes[MAX_STEPPERS]; // Note sounding on each stepper, its channel
+    memset(notes, NOTE_OFF, sizeof(notes));
+
+    for (unsigned int i = 0; i < timeline->commandN; i++) {
+        const midiCommand_t *command = &timeline->commands[i];
+        if (command->type != CMD_NOTE) continue;
+        unsigned long long time = sender->start + command->time;
+        // A new note on a stepper can take it without a note off, the receiver needs one, so up to 2 messages
+        if (messageN > 0 && (time - batchTime > batchNs || messageN + 2 > NET_MAX_MESSAGES)) {
+            if (!sendBatch(sender, batchTime, messages, messageN)) return 0;
+            messageN = 0;
+        }
+        if (messageN == 0) batchTime = time;
+        unsigned char stepper = command->stepper;
+        if (notes[stepper] != NOTE_OFF) {
+            addMessage(messages, &messageN, time - batchTime, MSG_NOTE_OFF, stepper, notes[stepper], 0);
+        }
+        if (command->note != NOTE_OFF) {
+            addMessage(messages, &messageN, time - batchTime, MSG_NOTE_ON, stepper, command->note,
+                       command->size ? command->size : DEFAULT_VELOCITY);
+        }
+        notes[stepper] = command->note;
+    }
+    // Nothing is left sounding on the receiver
+    for (unsigned int i = 0; i < MAX_STEPPERS; i++) {
+        if (notes[i] != NOTE_OFF && messageN < NET_MAX_MESSAGES) {
+            addMessage(messages, &messageN, 0, MSG_NOTE_OFF, i, notes[i], 0);
+        }
+    }
+    return sendBatch(sender, batchTime, messages, messageN);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        printf("Use: netSend [FILE.mid] [OPTIONS]\n");
+        printf("  --host ADDRESS  IPv4 address of the steppatron, default is 127.0.0.1\n");
+        printf("  --port N        UDP port, default is %d\n", NET_DEFAULT_PORT);
+        printf("  --batch MS      notes within MS of the first share a datagram, at most %d, default is 0 (chords)\n",
+               BATCH_MAX_MS);
+        printf("  --loss PERCENT  datagrams dropped at random, default is 0\n");
+        printf("  --jitter MS     datagrams are sent up to MS late at random, default is 0\n");
+        return EXIT_FAILURE;
+    }
+    const char *host = "127.0.0.1";
+    int port = NET_DEFAULT_PORT, batch = 0, loss = 0, jitter = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) host = argv[++i];
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) loss = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc) jitter = atoi(argv[++i]);
+    }
+    if (port < 1 || port > 65535 || batch < 0 || batch > BATCH_MAX_MS || loss < 0 || loss > 100 || jitter < 0) {
+        printf("Port must be in range [1,65535], batch in range [0,%d], loss in range [0,100] and jitter positive\n",
+               BATCH_MAX_MS);
+        return EXIT_FAILURE;
+    }
+
+    sender_t sender;
+    memset(&sender, 0, sizeof(sender));
+    sender.address.sin_family = AF_INET;
+    sender.address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &sender.address.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", host);
+        return EXIT_FAILURE;
+    }
+    midi_t song;
+    if (!readMidiFile(&song, argv[1])) return EXIT_FAILURE;
+    if (!initPlayer(&song)) {
+        freeMidi(&song);
+        return EXIT_FAILURE;
+    }
+    sender.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sender.socket < 0) {
+        fprintf(stderr, "Cannot open a UDP socket: %s\n", strerror(errno));
+        freeMidi(&song);
+        return EXIT_FAILURE;
+    }
+
+    srand(time(NULL) ^ getpid());
+    // A restarted sender must not look like a reordered one, see NET_RESTART_GAP
+    sender.sequence = rand();
+    sender.lossPercent = loss;
+    sender.jitter = jitter * 1000000ULL;
+    sender.start = monotonicNs();
+    int ret = sendSong(&sender, &song.timeline, batch * 1000000ULL);
+    fprintf(stderr, "Sent %u messages in %u datagrams to %s:%d, %u datagrams dropped\n", sender.messageN,
+            sender.sent, host, port, sender.lost);
+
+    close(sender.socket);
+    freeMidi(&song);
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,150 @@
+#include <string.h>
+#include <math.h>
+#include "pitchBend.h"
+#include "logger.h"
+
+// Initializes the coalescer with all steppers silent, a window of 0 sends every update
+void initBendCoalescer(bendCoalescer_t *bends, unsigned int windowMs) {
+    memset(bends, 0, sizeof(*bends));
+    for (int i = 0; i < MAX_STEPPERS; i++) bends->steppers[i].note = NOTE_OFF;
+    bends->window = windowMs * 1000000ULL;
+}
+
+// State of the source, NULL if it never sent a bend or mod wheel message
+static bendSource_t *findSource(bendCoalescer_t *bends, unsigned int source) {
+    for (int i = 0; i < BEND_SOURCES; i++) {
+        if (bends->sources[i].used && bends->sources[i].source == source) return &bends->sources[i];
+    }
+    return NULL;
+}
+
+// State of the source, a new one takes a free entry or one at rest, the oldest otherwise
+static bendSource_t *addSource(bendCoalescer_t *bends, unsigned int source) {
+    bendSource_t *entry = findSource(bends, source);
+    if (entry != NULL) return entry;
+    for (int i = 0; i < BEND_SOURCES && entry == NULL; i++) {
+        bendSource_t *candidate = &bends->sources[i];
+        if (!candidate->used || (candidate->bend == BEND_CENTER && candidate->modulation == 0)) entry = candidate;
+    }
+    if (entry == NULL) {
+        entry = &bends->sources[bends->nextSource];
+        bends->nextSource = (bends->nextSource + 1) % BEND_SOURCES;
+    }
+    entry->source = source;
+    entry->bend = BEND_CENTER;
+    entry->modulation = 0;
+    entry->used = 1;
+    return entry;
+}
+
+static int isBent(const bendSource_t *entry) {
+    return entry != NULL && (entry->bend != BEND_CENTER || entry->modulation != 0);
+}
+
+// Half period in ns of the note moved by cents, equal temperament from A4 = 440Hz like the driver table
+static unsigned int bentPeriod(unsigned char note, double cents) {
+    double frequency = 440.0 * pow(2.0, (note - 69 + cents / 100.0) / 12.0);
+    double period = NS_PER_S / (2.0 * frequency);
+    if (period < DRIVER_PERIOD_MIN) return DRIVER_PERIOD_MIN;
+    if (period > DRIVER_PERIOD_MAX) return DRIVER_PERIOD_MAX;
+    return (unsigned int)period;
+}
+
+// Tracks the note a driver command starts or stops, a note from a bent source gets its period at once
+void bendNoteCommand(bendCoalescer_t *bends, unsigned int source, const unsigned char *command,
+                     unsigned long long now) {
+    if (command[0] >= MAX_STEPPERS) return;
+    bendStepper_t *stepper = &bends->steppers[command[0]];
+    // The driver starts every note at its own period
+    stepper->source = source;
+    stepper->note = command[1];
+    stepper->period = 0;
+    stepper->dirty = 0;
+    if (command[1] != NOTE_OFF && isBent(findSource(bends, source))) {
+        stepper->dirty = 1;
+        bends->due = now;
+    }
+}
+
+// Takes pitch bend and mod wheel messages, other messages are ignored
+void bendMessage(bendCoalescer_t *bends, unsigned int source, const midiMessage_t *message,
+                 unsigned long long now) {
+    bendSource_t *entry;
+    if (message->type == MSG_PITCH_BEND) {
+        entry = addSource(bends, source);
+        entry->bend = message->param1 | message->param2 << 7;
+    } else if (message->type == MSG_CONTROLLER && message->param1 == CONTROLLER_MODULATION) {
+        entry = addSource(bends, source);
+        entry->modulation = message->param2;
+    } else {
+        return;
+    }
+
+    int playing = 0;
+    for (int i = 0; i < MAX_STEPPERS; i++) {
+        bendStepper_t *stepper = &bends->steppers[i];
+        if (stepper->note == NOTE_OFF || stepper->source != source) continue;
+        stepper->dirty = 1;
+        playing = 1;
+    }
+    if (!playing) return;
+    bends->messages++;
+    // The window starts with the first update, later ones only replace the value that will be sent
+    if (bends->due == 0) bends->due = now + bends->window;
+}
+
+// Writes the next period update that is due to command, DRIVER_PERIOD_LEN bytes
+// Returns 1 if there was one, 0 otherwise
+int bendCommand(bendCoalescer_t *bends, unsigned char *command, unsigned long long now) {
+    if (bends->due == 0 || now < bends->due) return 0;
+    for (int i = 0; i < MAX_STEPPERS; i++) {
+        bendStepper_t *stepper = &bends->steppers[i];
+        if (!stepper->dirty) continue;
+        stepper->dirty = 0;
+        const bendSource_t *entry = findSource(bends, stepper->source);
+        double cents = 0;
+        if (entry != NULL) {
+            cents = ((int)entry->bend - BEND_CENTER) * (double)BEND_RANGE_CENTS / BEND_CENTER;
+            cents += entry->modulation * (double)VIBRATO_DEPTH_CENTS / 127 *
+                     sin(2 * M_PI * VIBRATO_HZ * (double)now / NS_PER_S);
+        }
+        unsigned int period = bentPeriod(stepper->note, cents);
+        if (period == stepper->period) continue;
+        stepper->period = period;
+        command[0] = DRIVER_PERIOD;
+        command[1] = i;
+        command[2] = 0;
+        command[3] = 0;
+        for (int j = 0; j < 4; j++) command[4 + j] = period >> (8 * j);
+        bends->writes++;
+        return 1;
+    }
+
+    // Vibrato keeps changing the period without new messages
+    bends->due = 0;
+    for (int i = 0; i < MAX_STEPPERS; i++) {
+        bendStepper_t *stepper = &bends->steppers[i];
+        if (stepper->note == NOTE_OFF) continue;
+        const bendSource_t *entry = findSource(bends, stepper->source);
+        if (entry == NULL || entry->modulation == 0) continue;
+        stepper->dirty = 1;
+        unsigned long long interval = bends->window;
+        if (interval < VIBRATO_MIN_INTERVAL_MS * 1000000ULL) interval = VIBRATO_MIN_INTERVAL_MS * 1000000ULL;
+        bends->due = now + interval;
+    }
+    return 0;
+}
+
+// Time to wait for input before the next update is due, at most maxMs
+int bendWaitMs(const bendCoalescer_t *bends, unsigned long long now, int maxMs) {
+    if (bends->due == 0) return maxMs;
+    if (bends->due <= now) return 0;
+    unsigned long long wait = (bends->due - now + 999999) / 1000000;
+    return wait < (unsigned long long)maxMs ? (int)wait : maxMs;
+}
+
+// Logs how many messages the period commands replaced
+void logBendStats(const bendCoalescer_t *bends) {
+    if (bends->messages == 0) return;
+    logMessage(LOG_INFO, "Pitch bend: %u messages sent as %u period changes\n", bends->messages, bends->writes);
+}
@@ -0,0 +1,70 @@
+#ifndef PITCHBEND_H
+#define PITCHBEND_H
+
+#include "midi.h"
+
+// Pitch bend and mod wheel of live input, turned into DRIVER_PERIOD commands for the steppers that play
+// A bend wheel sends hundreds of messages a second, the updates of a stepper within a window are
+// coalesced so only the latest period is written
+
+// Window if none is given, short enough that a bend still sounds continuous
+#define BEND_DEFAULT_WINDOW_MS 10
+// Pitch bend range, the General MIDI default of 2 semitones
+#define BEND_RANGE_CENTS 200
+// Mod wheel vibrato, the full wheel is a quarter tone either way
+#define VIBRATO_HZ 6
+#define VIBRATO_DEPTH_CENTS 50
+// Shortest interval between vibrato updates, used when the window is 0
+#define VIBRATO_MIN_INTERVAL_MS 5
+// Sources whose bend and mod wheel are remembered, a source is a channel of a device
+#define BEND_SOURCES 16
+#define BEND_CENTER 8192
+#define CONTROLLER_MODULATION 1
+
+typedef struct {
+    unsigned int source;
+    unsigned short bend;      // 14 bit, BEND_CENTER is no bend
+    unsigned char modulation; // Mod wheel, 0 is no vibrato
+    unsigned char used;
+} bendSource_t;
+
+// Note playing on a stepper
+typedef struct {
+    unsigned int source;
+    unsigned char note;   // NOTE_OFF if the stepper is silent
+    unsigned char dirty;  // The period has to be sent when the window ends
+    unsigned int period;  // Half period last sent in ns, 0 if the note plays unbent
+} bendStepper_t;
+
+typedef struct {
+    bendSource_t sources[BEND_SOURCES];
+    unsigned int nextSource; // Entry replaced when all are used
+    bendStepper_t steppers[MAX_STEPPERS];
+    unsigned long long window; // ns
+    unsigned long long due;    // When the dirty steppers are sent, CLOCK_MONOTONIC ns, 0 if none is
+    unsigned int messages;     // Bend and mod wheel messages that changed a playing note
+    unsigned int writes;       // Period commands produced
+} bendCoalescer_t;
+
+// Initializes the coalescer with all steppers silent, a window of 0 sends every update
+void initBendCoalescer(bendCoalescer_t *bends, unsigned int windowMs);
+
+// Tracks the note a driver command starts or stops, a note from a bent source gets its period at once
+void bendNoteCommand(bendCoalescer_t *bends, unsigned int source, const unsigned char *command,
+                     unsigned long long now);
+
+// Takes pitch bend and mod wheel messages, other messages are ignored
+void bendMessage(bendCoalescer_t *bends, unsigned int source, const midiMessage_t *message,
+                 unsigned long long now);
+
+// Writes the next period update that is due to command, DRIVER_PERIOD_LEN bytes
+// Returns 1 if there was one, 0 otherwise
+int bendCommand(bendCoalescer_t *bends, unsigned char *command, unsigned long long now);
+
+// Time to wait for input before the next update is due, at most maxMs
+int bendWaitMs(const bendCoalescer_t *bends, unsigned long long now, int maxMs);
+
+// Logs how many messages the period commands replaced
+void logBendStats(const bendCoalescer_t *bends);
+
+#endif
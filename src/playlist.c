@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "playlist.h"
+#include "scoreCache.h"
+#include "logger.h"
+
+// Adds dir/name to the playlist, name alone if dir is NULL
+// Returns 0 on faliure, 1 on success
+static int addPath(playlist_t *list, const char *dir, const char *name) {
+    size_t size = (dir != NULL ? strlen(dir) + 1 : 0) + strlen(name) + 1;
+    char *path = (char *)malloc(size);
+    char **grown = (char **)realloc(list->paths, sizeof(char *) * (list->pathN + 1));
+    if (grown != NULL) list->paths = grown;
+    if (path == NULL || grown == NULL) {
+        free(path);
+        fprintf(stderr, "Not enough memory available!\n");
+        return 0;
+    }
+    if (dir != NULL) snprintf(path, size, "%s/%s", dir, name);
+    else memcpy(path, name, size);
+    list->paths[list->pathN++] = path;
+    return 1;
+}
+
+static void freePaths(playlist_t *list) {
+    for (unsigned int i = 0; i < list->pathN; i++) free(list->paths[i]);
+    free(list->paths);
+    list->paths = NULL;
+    list->pathN = 0;
+}
+
+static int isMidiEntry(const struct dirent *entry) {
+    const char *dot = strrchr(entry->d_name, '.');
+    return dot != NULL && (strcasecmp(dot, ".mid") == 0 || strcasecmp(dot, ".midi") == 0);
+}
+
+// Adds the .mid files of the directory in name order
+// Returns 0 on faliure, 1 on success
+static int readDirectory(playlist_t *list, const char *path) {
+    struct dirent **entries;
+    int n = scandir(path, &entries, isMidiEntry, alphasort);
+    if (n < 0) {
+        fprintf(stderr, "Error while reading directory %s\n", path);
+        return 0;
+    }
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+        if (ok) ok = addPath(list, path, entries[i]->d_name);
+        free(entries[i]);
+    }
+    free(entries);
+    return ok;
+}
+
+// Adds the paths listed in the file
+// Returns 0 on faliure, 1 on success
+static int readListFile(playlist_t *list, const char *path) {
+    FILE *file = fopen(path, "r");
+    char *dir = strdup(path);
+    if (file == NULL || dir == NULL) {
+        fprintf(stderr, "Error while opening playlist %s\n", path);
+        if (file != NULL) fclose(file);
+        free(dir);
+        return 0;
+    }
+    // Relative paths start at the directory of the playlist
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL) *slash = '\0';
+
+    int ok = 1;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while (ok && (length = getline(&line, &capacity, file)) >= 0) {
+        while (length > 0 && isspace((unsigned char)line[length - 1])) line[--length] = '\0';
+        char *start = line;
+        while (isspace((unsigned char)*start)) start++;
+        if (*start == '\0' || *start == '#') continue;
+        ok = addPath(list, *start == '/' || slash == NULL ? NULL : dir, start);
+    }
+    free(line);
+    free(dir);
+    fclose(file);
+    return ok;
+}
+
+// Reads the playlist: a directory of .mid files in name order, or a text file with one path per line
+// Empty lines and lines starting with # are skipped, relative paths are relative to the playlist
+// Returns 0 on faliure, 1 on success
+int readPlaylist(playlist_t *list, const char *path) {
+    memset(list, 0, sizeof(*list));
+    list->threads = 1;
+    list->steppers = MAX_STEPPERS;
+    list->policy = VOICE_SKYLINE;
+    list->outFile = -1;
+    initPlayerState(&list->total);
+
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        fprintf(stderr, "Error while opening playlist %s\n", path);
+        return 0;
+    }
+    int ok = S_ISDIR(info.st_mode) ? readDirectory(list, path) : readListFile(list, path);
+    if (ok && list->pathN == 0) {
+        fprintf(stderr, "Playlist %s has no songs\n", path);
+        ok = 0;
+    }
+    if (!ok) freePaths(list);
+    return ok;
+}
+
+// Reads and compiles the song into the slot
+// Returns 0 on faliure, 1 on success
+static int loadSong(playlist_t *list, unsigned char slot, const char *path) {
+    midi_t *song = &list->songs[slot];
+    int loaded = list->cacheDir != NULL
+                     ? loadCachedScore(song, path, list->cacheDir, list->threads, list->steppers, list->policy)
+                     : readMidiFileThreads(song, path, list->threads);
+    if (!loaded) return 0;
+    song->steppers = list->steppers;
+    song->policy = list->policy;
+    if (!initPlayer(song)) {
+        freeMidi(song);
+        return 0;
+    }
+    song->player.spinNs = list->spinNs;
+    song->player.lookahead = list->lookahead;
+    list->names[slot] = path;
+    list->loaded[slot] = 1;
+    return 1;
+}
+
+// Frees the song that is not playing and loads the next path that can be played in its slot
+static void prefetch(playlist_t *list) {
+    unsigned char slot = !list->current;
+    if (list->loaded[slot]) {
+        freeMidi(&list->songs[slot]);
+        list->loaded[slot] = 0;
+    }
+    while (list->nextPath < list->pathN) {
+        const char *path = list->paths[list->nextPath++];
+        if (loadSong(list, slot, path)) break;
+        fprintf(stderr, "Skipping %s\n", path);
+    }
+}
+
+static void *prefetchMain(void *arg) {
+    // Parsing can wait, playback can't
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+    prefetch((playlist_t *)arg);
+    return NULL;
+}
+
+static void startPrefetch(playlist_t *list) {
+    if (pthread_create(&list->prefetchThread, NULL, prefetchMain, list) == 0) {
+        list->prefetching = 1;
+    } else {
+        prefetch(list);
+    }
+}
+
+static void waitPrefetch(playlist_t *list) {
+    if (!list->prefetching) return;
+    pthread_join(list->prefetchThread, NULL);
+    list->prefetching = 0;
+}
+
+// Loads the first song and starts preparing the next one
+// Returns 0 on faliure, 1 on success
+int startPlaylist(playlist_t *list) {
+    list->current = 1;
+    prefetch(list);
+    list->current = 0;
+    if (!list->loaded[0]) {
+        fprintf(stderr, "No song in the playlist could be played\n");
+        return 0;
+    }
+    logMessage(LOG_INFO, "Playing %s\n", list->names[0]);
+    startPrefetch(list);
+    return 1;
+}
+
+// Absolute time of the next command of the song in ns
+static unsigned long long nextCommandTime(const midi_t *song) {
+    struct timespec due;
+    playerDueTime(&song->player, song->timeline.commands[song->position].time, &due);
+    return (unsigned long long)due.tv_sec * NS_PER_S + due.tv_nsec;
+}
+
+// Starts the next song gap - crossfade ns after the end of the current one, not before the current one started
+static void scheduleNext(playlist_t *list) {
+    midi_t *song = &list->songs[list->current];
+    midi_t *next = &list->songs[!list->current];
+    const midiTimeline_t *timeline = &song->timeline;
+    struct timespec *start = &song->player.startTime;
+    if (start->tv_sec == 0 && start->tv_nsec == 0) {
+        // Nothing played yet, the song starts now like in playerWait
+        clock_gettime(CLOCK_MONOTONIC, start);
+        unsigned long long nsec = start->tv_nsec + song->player.lookahead;
+        start->tv_sec += nsec / NS_PER_S;
+        start->tv_nsec = nsec % NS_PER_S;
+    }
+    unsigned long long duration = timeline->commandN != 0 ? timeline->commands[timeline->commandN - 1].time : 0;
+    struct timespec end;
+    playerDueTime(&song->player, duration, &end);
+    unsigned long long startNs = (unsigned long long)start->tv_sec * NS_PER_S + start->tv_nsec;
+    unsigned long long nextStart = (unsigned long long)end.tv_sec * NS_PER_S + end.tv_nsec + list->gap;
+    nextStart = nextStart > startNs + list->crossfade ? nextStart - list->crossfade : startNs;
+    next->player.startTime.tv_sec = nextStart / NS_PER_S;
+    next->player.startTime.tv_nsec = nextStart % NS_PER_S;
+    list->fading = 1;
+    logMessage(LOG_INFO, "Playing %s\n", list->names[!list->current]);
+}
+
+// Stops the notes of the current song and adds its drift to the total
+static void finishSong(playlist_t *list) {
+    midi_t *song = &list->songs[list->current];
+    playerSilence(&song->player, list->outFile);
+    mergeDrift(&list->total.drift, &song->player.drift);
+}
+
+// Plays the next commands of the playlist, this function is blocking
+// Returns 0 when the last song ended, 1 otherwise
+int playlistNext(playlist_t *list) {
+    midi_t *song = &list->songs[list->current];
+    midi_t *next = &list->songs[!list->current];
+    const midiTimeline_t *timeline = &song->timeline;
+
+    if (!list->fading) {
+        unsigned long long duration = timeline->commandN != 0 ? timeline->commands[timeline->commandN - 1].time : 0;
+        if (song->position < timeline->commandN && timeline->commands[song->position].time + list->crossfade < duration) {
+            playNext(song, list->outFile);
+            return 1;
+        }
+        // The end of the song is near, the next one must be ready now
+        waitPrefetch(list);
+        if (!list->loaded[!list->current]) {
+            if (song->position < timeline->commandN) {
+                playNext(song, list->outFile);
+                return 1;
+            }
+            finishSong(list);
+            return 0;
+        }
+        scheduleNext(list);
+    }
+
+    // Both songs play, the earlier command goes first
+    if (song->position < timeline->commandN) {
+        if (next->position >= next->timeline.commandN || nextCommandTime(song) <= nextCommandTime(next)) {
+            playNext(song, list->outFile);
+        } else {
+            playNext(next, list->outFile);
+            // Steppers the next song plays on are taken from the current one
+            for (unsigned char i = 0; i < MAX_STEPPERS; i++) {
+                if (next->player.notes[i] != NOTE_OFF) song->player.mutedSteppers |= 1 << i;
+            }
+        }
+        return 1;
+    }
+    finishSong(list);
+    list->current = !list->current;
+    list->fading = 0;
+    // Frees the finished song and loads the one after the next
+    startPrefetch(list);
+    return 1;
+}
+
+// Stops the playing notes and frees the songs
+void freePlaylist(playlist_t *list) {
+    waitPrefetch(list);
+    for (unsigned char slot = 0; slot < 2; slot++) {
+        if (!list->loaded[slot]) continue;
+        playerSilence(&list->songs[slot].player, list->outFile);
+        mergeDrift(&list->total.drift, &list->songs[slot].player.drift);
+        freeMidi(&list->songs[slot]);
+        list->loaded[slot] = 0;
+    }
+    freePaths(list);
+}
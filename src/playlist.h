@@ -0,0 +1,50 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include "midiParser.h"
+
+// Songs played one after another on the same driver file
+// The next song is read and compiled on a background thread while the current one plays
+typedef struct {
+    char **paths;
+    unsigned int pathN;
+    unsigned int nextPath; // Next path the prefetch thread loads
+
+    // Settings, set before startPlaylist
+    const char *cacheDir; // NULL to always parse
+    unsigned int threads;
+    unsigned char steppers;
+    unsigned char policy;
+    unsigned int spinNs;
+    unsigned long long lookahead;
+    unsigned long long gap;       // Silence between songs in ns
+    unsigned long long crossfade; // Overlap of songs in ns, the next song takes over the steppers one by one
+    int outFile;
+
+    midi_t songs[2];         // Current and next song
+    const char *names[2];
+    unsigned char loaded[2];
+    unsigned char current;   // Slot of the playing song
+    unsigned char fading;    // The next song is scheduled and both are playing
+    pthread_t prefetchThread;
+    unsigned char prefetching;
+    midiPlayer_t total;      // Drift of the finished songs
+} playlist_t;
+
+// Reads the playlist: a directory of .mid files in name order, or a text file with one path per line
+// Empty lines and lines starting with # are skipped, relative paths are relative to the playlist
+// Returns 0 on faliure, 1 on success
+int readPlaylist(playlist_t *list, const char *path);
+
+// Loads the first song and starts preparing the next one
+// Returns 0 on faliure, 1 on success
+int startPlaylist(playlist_t *list);
+
+// Plays the next commands of the playlist, this function is blocking
+// Returns 0 when the last song ended, 1 otherwise
+int playlistNext(playlist_t *list);
+
+// Stops the playing notes and frees the songs
+void freePlaylist(playlist_t *list);
+
+#endif
@@ -1,103 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "rawMidi.h"
+#include "logger.h"
 
 // RawMidi ALSA hardware port to be used
 #define MIDI_PORT "hw:1,0,0"
 
-// Notes being played
-unsigned char *currNotes;
-// Number of steppers
-unsigned int stepperN;
+// Notes on the steppers, the source of a note is its channel
+static voiceAllocator_t voices;
+static bendCoalescer_t bends;
 
-unsigned char readUsbByte(snd_rawmidi_t *device) {
-    unsigned char buffer;
-    if (snd_rawmidi_read(device, &buffer, 1) < 0) {
-        fprintf(stderr, "Problem reading RawMIDI input!\n");
-        return 0;
-    }
-    return buffer;
+// Bytes read from the port and not decoded yet
+static unsigned char readBuffer[RAWMIDI_READ_SIZE];
+static unsigned int readSize;
+static unsigned int readPosition;
+static unsigned long long readTime; // When the buffer was read, CLOCK_MONOTONIC ns
+static midiDecoder_t decoder;
+static struct pollfd *pollFds;
+static int pollFdN;
+
+// Initializes the decoder without a running status
+void initMidiDecoder(midiDecoder_t *decoder) {
+    memset(decoder, 0, sizeof(*decoder));
 }
 
-int readUsbMessage(midiMessage_t *message, snd_rawmidi_t *device) {
-    unsigned char buffer = readUsbByte(device);
-    if (buffer != MSG_NOTE_ON && buffer != MSG_NOTE_OFF &&
-        buffer != MSG_PITCH_BEND && buffer != MSG_CONTROLLER) {
-        return buffer;
+// Data bytes of a channel message
+static unsigned char messageLength(unsigned char status) {
+    switch (status & 0xF0) {
+    case MSG_PROGRAM_CHANGE:
+    case MSG_CHANNEL_AFTERTOUCH:
+        return 1;
+    default:
+        return 2;
     }
-    message->type = buffer & 0xF0;
-    message->channel = buffer & 0x0F;
-    message->param1 = readUsbByte(device);
-    message->param2 = readUsbByte(device);
-    return -1;
 }
 
-int rawmidiInit(snd_rawmidi_t **handler, unsigned int steppers) {
-    if (snd_rawmidi_open(handler, NULL, MIDI_PORT, SND_RAWMIDI_SYNC) < 0) {
-        fprintf(stderr, "Cannot open port: %s\n", MIDI_PORT);
+// Feeds one byte of the stream to the decoder
+// Handles running status on all 16 channels, and real-time bytes and SysEx interrupting other messages
+// Returns 1 and fills message when a channel message is complete, 0 otherwise
+int decodeMidiByte(midiDecoder_t *decoder, unsigned char byte, midiMessage_t *message) {
+    if (byte >= 0xF8) {
+        // Real-time bytes can come between any two bytes and don't change the state
         return 0;
     }
-    if (steppers <= MAX_STEPPERS && steppers != 0) {
-        stepperN = steppers;
-    } else {
-        stepperN = 1;
-    }
-    currNotes = (unsigned char *)malloc(sizeof(unsigned char) * stepperN);
-    for (size_t i = 0; i < stepperN; i++) {
-        currNotes[i] = NOTE_OFF;
+    if (byte & 0x80) {
+        decoder->sysex = byte == STATUS_SYSEX;
+        decoder->dataN = 0;
+        if (byte < STATUS_SYSEX) {
+            decoder->status = byte;
+            decoder->expected = messageLength(byte);
+        } else {
+            // SysEx and system common messages cancel the running status, their data is skipped
+            decoder->status = 0;
+        }
+        return 0;
     }
+    if (decoder->sysex || decoder->status == 0) return 0;
+
+    decoder->data[decoder->dataN++] = byte;
+    if (decoder->dataN < decoder->expected) return 0;
+    // The status stays, more data bytes start another message of the same type
+    decoder->dataN = 0;
+    message->type = decoder->status & 0xF0;
+    message->channel = decoder->status & 0x0F;
+    message->param1 = decoder->data[0];
+    message->param2 = decoder->expected > 1 ? decoder->data[1] : 0;
     return 1;
 }
 
-void rawmidiClose(snd_rawmidi_t *handler) {
-    snd_rawmidi_close(handler);
-    free(currNotes);
-    handler = NULL;
+// Reads everything available from the port into the buffer, waits for input if there is none
+// Returns -1 if the device failed, the number of bytes read otherwise
+static int fillBuffer(snd_rawmidi_t *device) {
+    readPosition = 0;
+    readSize = 0;
+    ssize_t read = snd_rawmidi_read(device, readBuffer, sizeof(readBuffer));
+    if (read == -EAGAIN) {
+        // Pending pitch bends are sent when their window ends, even if no input comes
+        if (poll(pollFds, pollFdN, bendWaitMs(&bends, monotonicNs(), RAWMIDI_POLL_MS)) <= 0) return 0;
+        unsigned short events = 0;
+        snd_rawmidi_poll_descriptors_revents(device, pollFds, pollFdN, &events);
+        if (events & (POLLERR | POLLHUP)) {
+            logMessage(LOG_ERROR, "RawMIDI device disconnected!\n");
+            return -1;
+        }
+        if (!(events & POLLIN)) return 0;
+        read = snd_rawmidi_read(device, readBuffer, sizeof(readBuffer));
+        if (read == -EAGAIN) return 0;
+    }
+    if (read < 0) {
+        logMessage(LOG_ERROR, "Problem reading RawMIDI input: %s\n", snd_strerror(read));
+        return -1;
+    }
+    readSize = read;
+    readTime = monotonicNs();
+    return read;
 }
 
-static inline int dist(unsigned char a, unsigned char b) {
-    return a > b ? a - b : b - a;
+// Decodes the next channel message from the bytes already read
+// Returns 1 if there was one, 0 otherwise
+static int nextBufferedMessage(midiMessage_t *message) {
+    while (readPosition < readSize) {
+        if (decodeMidiByte(&decoder, readBuffer[readPosition++], message)) return 1;
+    }
+    return 0;
 }
 
-size_t getFreeStepper(unsigned char note) {
-    for (size_t i = 0; i < stepperN; i++) {
-        if (currNotes[i] == NOTE_OFF) return i;
+// Reads the next channel message from usb, waits at most RAWMIDI_POLL_MS or until a pitch bend is due
+// if none is buffered
+// Returns -1 if the device failed, 0 if no message arrived, 1 on success
+int readUsbMessage(midiMessage_t *message, snd_rawmidi_t *device) {
+    while (1) {
+        if (nextBufferedMessage(message)) return 1;
+        int read = fillBuffer(device);
+        if (read <= 0) return read;
     }
-    size_t nearest = 0;
-    for (size_t i = 0; i < stepperN; i++) {
-        if (dist(currNotes[i], note) < dist(currNotes[nearest], note)) nearest = i;
+}
+
+// Sets a small wakeup threshold, so every byte is read as soon as it arrives
+static void setRawmidiParams(snd_rawmidi_t *device) {
+    snd_rawmidi_params_t *params;
+    if (snd_rawmidi_params_malloc(&params) < 0) return;
+    snd_rawmidi_params_current(device, params);
+    snd_rawmidi_params_set_buffer_size(device, params, RAWMIDI_BUFFER_SIZE);
+    snd_rawmidi_params_set_avail_min(device, params, 1);
+    if (snd_rawmidi_params(device, params) < 0) {
+        logMessage(LOG_WARNING, "Warning: Can't set the RawMIDI buffer parameters\n");
     }
-    return nearest;
+    snd_rawmidi_params_free(params);
 }
 
-int getRawmidiCommand(unsigned char *command, snd_rawmidi_t *handler) {
-    midiMessage_t message;
-    int byte = readUsbMessage(&message, handler);
-    if (byte != -1) {
-        fprintf(stderr, "Invalid byte read: %d\n", byte);
+// Initializes the RawMIDI module, the port is opened non-blocking
+// Returns 0 on faliure, 1 on success
+int rawmidiInit(snd_rawmidi_t **handler, unsigned int steppers, unsigned char policy, unsigned int bendWindowMs) {
+    if (snd_rawmidi_open(handler, NULL, MIDI_PORT, SND_RAWMIDI_NONBLOCK) < 0) {
+        fprintf(stderr, "Cannot open port: %s\n", MIDI_PORT);
         return 0;
     }
-
-    int found = 0;
-    switch (message.type) {
-    case MSG_NOTE_ON:
-        command[1] = message.param1;
-        command[0] = getFreeStepper(command[1]);
-        currNotes[command[0]] = command[1];
-        break;
-    case MSG_NOTE_OFF:
-        for (size_t i = 0; i < stepperN; i++) {
-            if (currNotes[i] == message.param1) {
-                command[0] = i;
-                currNotes[i] = NOTE_OFF;
-                found = 1;
-                break;
-            }
-        }
-        if (!found) return 0;
-        command[1] = NOTE_OFF;
-        break;
-    default:
+    setRawmidiParams(*handler);
+    pollFdN = snd_rawmidi_poll_descriptors_count(*handler);
+    pollFds = (struct pollfd *)malloc(sizeof(struct pollfd) * pollFdN);
+    if (pollFds == NULL) {
+        fprintf(stderr, "Not enough memory available!\n");
+        rawmidiClose(*handler);
         return 0;
     }
+    snd_rawmidi_poll_descriptors(*handler, pollFds, pollFdN);
+    initVoiceAllocator(&voices, steppers <= MAX_STEPPERS && steppers != 0 ? steppers : 1, policy);
+    initBendCoalescer(&bends, bendWindowMs);
+    initMidiDecoder(&decoder);
+    readSize = 0;
+    readPosition = 0;
+    return 1;
+}
 
-    return message.param1;
-}
\ No newline at end of file
+void rawmidiClose(snd_rawmidi_t *handler) {
+    logVoiceStats(&voices);
+    logBendStats(&bends);
+    snd_rawmidi_close(handler);
+    free(pollFds);
+    pollFds = NULL;
+}
+
+// Gets the next command to be sent to the steppatron driver, the notes that were read together
+// or a DRIVER_PERIOD pitch bend, from the RawMIDI interface
+// latency gets the read and allocation times of notes if it's not NULL
+// Returns -1 if the device failed, 0 if there is no command, the length of the command on success
+int getRawmidiCommand(unsigned char *command, snd_rawmidi_t *handler, liveLatency_t *latency) {
+    if (bendCommand(&bends, command, monotonicNs())) return DRIVER_PERIOD_LEN;
+    midiMessage_t message;
+    int result = readUsbMessage(&message, handler);
+    if (result <= 0) return result;
+
+    // A chord comes in one read, its notes go to the driver in one write and start on the same tick
+    int length = 0;
+    do {
+        // Keyboards send note off as note on with velocity 0, which running status makes shorter
+        if (voiceMessageCommand(&voices, message.channel, &message, command + length)) {
+            bendNoteCommand(&bends, message.channel, command + length, readTime);
+            length += 2;
+        } else {
+            bendMessage(&bends, message.channel, &message, readTime);
+        }
+    } while (length < DRIVER_BATCH_LEN && nextBufferedMessage(&message));
+    if (length == 0) return 0;
+    // RawMIDI has no kernel timestamps, the message starts when its bytes were read
+    if (latency != NULL) latencyAllocated(latency, 0, readTime);
+    return length;
+}
@@ -4,20 +4,52 @@
 #include <stdio.h>
 #include <alsa/asoundlib.h>
 #include "midi.h"
+#include "voiceAlloc.h"
+#include "pitchBend.h"
+#include "latency.h"
 
-// Initializes the RawMIDI module
-int rawmidiInit(snd_rawmidi_t **handler, unsigned int steppers);
+// Bytes read from the port at once, everything available is drained per poll
+#define RAWMIDI_READ_SIZE 256
+// ALSA input buffer, large enough that a burst never overruns while the reader is busy
+#define RAWMIDI_BUFFER_SIZE 4096
+// Longest wait for input, so the caller can check for the end of the program
+#define RAWMIDI_POLL_MS 100
 
-// Deinitializes the RawMIDI module
+// State of the MIDI byte stream decoder
+typedef struct {
+    unsigned char status;   // Running status, 0 if there is none
+    unsigned char data[2];
+    unsigned char dataN;    // Data bytes received for the current message
+    unsigned char expected; // Data bytes the current message needs
+    unsigned char sysex;    // Inside a SysEx message, its data bytes are skipped
+} midiDecoder_t;
+
+// Initializes the decoder without a running status
+void initMidiDecoder(midiDecoder_t *decoder);
+
+// Feeds one byte of the stream to the decoder
+// Handles running status on all 16 channels, and real-time bytes and SysEx interrupting other messages
+// Returns 1 and fills message when a channel message is complete, 0 otherwise
+int decodeMidiByte(midiDecoder_t *decoder, unsigned char byte, midiMessage_t *message);
+
+// Initializes the RawMIDI module, the port is opened non-blocking
+// policy is the STEAL_* policy used when more notes play than there are steppers
+// Pitch bend and mod wheel updates of a stepper within bendWindowMs are sent as one
+// Returns 0 on faliure, 1 on success
+int rawmidiInit(snd_rawmidi_t **handler, unsigned int steppers, unsigned char policy, unsigned int bendWindowMs);
+
+// Deinitializes the RawMIDI module and logs the stepper steals
 void rawmidiClose(snd_rawmidi_t *handler);
 
-// Reads a midi message from usb
-// Returns -1 in case of success, and the read byte in case of error
+// Reads the next channel message from usb, waits at most RAWMIDI_POLL_MS if none is buffered
+// Returns -1 if the device failed, 0 if no message arrived, 1 on success
 int readUsbMessage(midiMessage_t *message, snd_rawmidi_t *handler);
 
-// Gets the next command to be sent to the steppatron driver
-// from the RawMIDI interface
-// Returns 0 on faliure, note number on success
-int getRawmidiCommand(unsigned char *command, snd_rawmidi_t *handler);
+// Gets the next command to be sent to the steppatron driver, the notes that were read together
+// or a DRIVER_PERIOD pitch bend, from the RawMIDI interface
+// latency gets the read and allocation times of notes if it's not NULL
+// command must hold DRIVER_BATCH_LEN bytes
+// Returns -1 if the device failed, 0 if there is no command, the length of the command on success
+int getRawmidiCommand(unsigned char *command, snd_rawmidi_t *handler, liveLatency_t *latency);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <malloc.h>
+#include <errno.h>
+#include "rtThread.h"
+
+// Set by the main thread to end playback
+static volatile int stopPlayback;
+static pthread_t mainThread;
+static pthread_t playbackThreadId;
+static volatile int playbackRunning;
+
+typedef struct {
+    const rtConfig_t *config;
+    playStep_t step;
+    void *arg;
+} playbackArgs_t;
+
+// SIGUSR2 only interrupts the sleep of the playback thread, and wakes the main thread when playback ends
+static void wakeHandler(int signal) {
+    (void)signal;
+}
+
+// Initializes the settings of a normal priority thread on any CPU
+void initRtConfig(rtConfig_t *config) {
+    config->realtime = 0;
+    config->priority = RT_DEFAULT_PRIORITY;
+    config->cpu = -1;
+    config->memoryBudget = RT_DEFAULT_MEMORY;
+}
+
+// Applies the settings to the calling thread, settings that fail are reported and skipped
+// Returns 0 if any setting failed, 1 on success
+int applyRtConfig(const rtConfig_t *config) {
+    int ok = 1;
+    if (config->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(config->cpu, &cpus);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (error != 0) {
+            fprintf(stderr, "Warning: Can't pin the playback thread to CPU %d: %s\n", config->cpu, strerror(error));
+            ok = 0;
+        }
+    }
+    if (!config->realtime) return ok;
+
+    // Freed memory stays in the heap, so the budget remains faulted in and locked
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "Warning: Can't lock the memory, playback may page fault: %s\n", strerror(errno));
+        ok = 0;
+    }
+    if (config->memoryBudget != 0) {
+        volatile unsigned char *budget = (volatile unsigned char *)malloc(config->memoryBudget);
+        if (budget == NULL) {
+            fprintf(stderr, "Warning: Can't reserve %zu bytes of memory for playback\n", config->memoryBudget);
+            ok = 0;
+        } else {
+            long page = sysconf(_SC_PAGESIZE);
+            for (size_t i = 0; i < config->memoryBudget; i += page) budget[i] = 0;
+            free((void *)budget);
+        }
+    }
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config->priority;
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0) {
+        fprintf(stderr, "Warning: Can't run the playback thread with SCHED_FIFO priority %d: %s\n", config->priority,
+                strerror(error));
+        ok = 0;
+    }
+    return ok;
+}
+
+static void *playbackThread(void *data) {
+    playbackArgs_t *args = (playbackArgs_t *)data;
+    sigset_t wake;
+    sigemptyset(&wake);
+    sigaddset(&wake, SIGUSR2);
+    pthread_sigmask(SIG_UNBLOCK, &wake, NULL);
+
+    applyRtConfig(args->config);
+    while (!stopPlayback) {
+        if (!args->step(args->arg)) {
+            break;
+        }
+    }
+    pthread_kill(mainThread, SIGUSR2);
+    return NULL;
+}
+
+// Calls step on a new playback thread until it returns 0 or SIGINT is received
+// SIGUSR1 prints the drift report of player while playing, this function is blocking
+// Returns 0 on faliure, 1 on success
+int runPlaybackThread(const rtConfig_t *config, playStep_t step, void *arg, const midiPlayer_t *player) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wakeHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+
+    // Signals are handled here, the playback thread inherits the mask and only takes SIGUSR2
+    sigset_t signals, oldSignals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, &oldSignals);
+
+    stopPlayback = 0;
+    mainThread = pthread_self();
+    playbackArgs_t args = {config, step, arg};
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, playbackThread, &args);
+    playbackThreadId = thread;
+    playbackRunning = error == 0;
+    if (error != 0) {
+        fprintf(stderr, "Error creating the playback thread: %s\n", strerror(error));
+        pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+        return 0;
+    }
+
+    const struct timespec retry = {0, 50000000};
+    while (1) {
+        int signal = sigtimedwait(&signals, NULL, stopPlayback ? &retry : NULL);
+        if (signal == SIGUSR2) break;
+        if (signal == SIGUSR1) printDriftReport(player);
+        else if (signal == SIGINT) stopPlayback = 1;
+        // The playback thread may be asleep until its next command, wake it until it stops
+        if (stopPlayback) pthread_kill(thread, SIGUSR2);
+    }
+    playbackRunning = 0;
+    pthread_join(thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    return 1;
+}
+
+// Interrupts the sleep of the playback thread, so a request from another thread is applied right away
+void wakePlayback(void) {
+    if (playbackRunning) pthread_kill(playbackThreadId, SIGUSR2);
+}
@@ -0,0 +1,38 @@
+#ifndef RTTHREAD_H
+#define RTTHREAD_H
+
+#include "midiParser.h"
+
+// Default SCHED_FIFO priority, above the interrupt threads of a PREEMPT_RT kernel (50)
+#define RT_DEFAULT_PRIORITY 80
+// Default heap faulted in and locked before playback
+#define RT_DEFAULT_MEMORY (16 * 1024 * 1024)
+
+// Scheduling and memory settings of the playback thread
+typedef struct {
+    unsigned char realtime; // SCHED_FIFO and locked memory
+    int priority;           // SCHED_FIFO priority
+    int cpu;                // CPU the thread is pinned to, -1 for any
+    size_t memoryBudget;    // Heap bytes faulted in before playback, so playback doesn't page fault
+} rtConfig_t;
+
+// One step of the playback loop
+// Returns 0 when playback is over, 1 to continue
+typedef int (*playStep_t)(void *arg);
+
+// Initializes the settings of a normal priority thread on any CPU
+void initRtConfig(rtConfig_t *config);
+
+// Applies the settings to the calling thread, settings that fail are reported and skipped
+// Returns 0 if any setting failed, 1 on success
+int applyRtConfig(const rtConfig_t *config);
+
+// Calls step on a new playback thread until it returns 0 or SIGINT is received
+// SIGUSR1 prints the drift report of player while playing, this function is blocking
+// Returns 0 on faliure, 1 on success
+int runPlaybackThread(const rtConfig_t *config, playStep_t step, void *arg, const midiPlayer_t *player);
+
+// Interrupts the sleep of the playback thread, so a request from another thread is applied right away
+void wakePlayback(void);
+
+#endif
@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <string.h>
+#include "scoreCache.h"
+
+// Compile settings the cached timeline depends on, scores compiled with other settings are separate files
+static unsigned int scoreConfigKey(const midi_t *handler) {
+    return handler->steppers | handler->policy << 8 | MAX_STEPPERS << 16;
+}
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+// FNV-1a over 8 byte words, the tail is hashed byte by byte
+unsigned long long hashBytes(const unsigned char *bytes, size_t size) {
+    unsigned long long hash = FNV_OFFSET;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+    for (; i < size; i++) hash = (hash ^ bytes[i]) * FNV_PRIME;
+    return hash ^ size;
+}
+
+// Default cache directory, the first of $STEPPATRON_CACHE, $XDG_CACHE_HOME/steppatron and ~/.cache/steppatron
+const char *defaultCacheDir(void) {
+    static char path[4096];
+    const char *dir = getenv("STEPPATRON_CACHE");
+    if (dir != NULL && dir[0] != '\0') return dir;
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir != NULL && dir[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/steppatron", dir);
+        return path;
+    }
+    dir = getenv("HOME");
+    if (dir != NULL && dir[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/.cache/steppatron", dir);
+        return path;
+    }
+    return NULL;
+}
+
+// Creates the directory and its missing parents
+// Returns 0 on faliure, 1 on success
+static int makeDirs(const char *dir) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) return 0;
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) return 0;
+        *p = '/';
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// Maps the cached score if it exists and matches the source
+// Returns 0 on a miss, 1 on a hit
+static int mapScore(midi_t *handler, const char *cacheName, unsigned long long hash, size_t sourceSize) {
+    unsigned int configKey = scoreConfigKey(handler);
+    int fd = open(cacheName, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0 || (size_t)fileStat.st_size < sizeof(scoreCacheHeader_t)) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const scoreCacheHeader_t *header = (const scoreCacheHeader_t *)map;
+    size_t expected = sizeof(scoreCacheHeader_t) + (size_t)header->commandN * sizeof(midiCommand_t) + header->textSize;
+    if (header->magic != SCORE_CACHE_MAGIC || header->version != SCORE_CACHE_VERSION ||
+        header->sourceHash != hash || header->sourceSize != sourceSize || header->configKey != configKey ||
+        header->commandSize != sizeof(midiCommand_t) || header->commandN == 0 || expected != (size_t)fileStat.st_size) {
+        munmap(map, fileStat.st_size);
+        return 0;
+    }
+    madvise(map, fileStat.st_size, MADV_WILLNEED);
+
+    midiTimeline_t *timeline = &handler->timeline;
+    timeline->cacheMap = map;
+    timeline->cacheMapSize = fileStat.st_size;
+    timeline->commands = (midiCommand_t *)((unsigned char *)map + sizeof(scoreCacheHeader_t));
+    timeline->commandN = header->commandN;
+    timeline->text = (const unsigned char *)(timeline->commands + header->commandN);
+
+    // The source is not kept, only the header is needed by the player
+    handler->data.header.format = header->format;
+    handler->data.header.trackN = header->trackN;
+    handler->data.header.timediv = header->timeDiv;
+    return 1;
+}
+
+// Writes the compiled timeline to a temporary file and renames it over the cached score
+// Track names are copied out of the source so the score stands on its own
+// Returns 0 on faliure, 1 on success
+static int writeScore(const midi_t *handler, const char *cacheName, unsigned long long hash, size_t sourceSize) {
+    const midiTimeline_t *timeline = &handler->timeline;
+    midiCommand_t *commands = (midiCommand_t *)malloc(sizeof(midiCommand_t) * timeline->commandN);
+    if (commands == NULL) return 0;
+    memcpy(commands, timeline->commands, sizeof(midiCommand_t) * timeline->commandN);
+
+    unsigned int textSize = 0;
+    for (unsigned int i = 0; i < timeline->commandN; i++) {
+        if (commands[i].type == CMD_TRACK_NAME) textSize += commands[i].size;
+    }
+    unsigned char *text = (unsigned char *)malloc(textSize ? textSize : 1);
+    if (text == NULL) {
+        free(commands);
+        return 0;
+    }
+    textSize = 0;
+    for (unsigned int i = 0; i < timeline->commandN; i++) {
+        if (commands[i].type != CMD_TRACK_NAME) continue;
+        memcpy(text + textSize, timeline->text + commands[i].value, commands[i].size);
+        commands[i].value = textSize;
+        textSize += commands[i].size;
+    }
+
+    scoreCacheHeader_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SCORE_CACHE_MAGIC;
+    header.version = SCORE_CACHE_VERSION;
+    header.sourceHash = hash;
+    header.sourceSize = sourceSize;
+    header.duration = timeline->commands[timeline->commandN - 1].time;
+    header.configKey = scoreConfigKey(handler);
+    header.commandSize = sizeof(midiCommand_t);
+    header.commandN = timeline->commandN;
+    header.textSize = textSize;
+    header.format = handler->data.header.format;
+    header.trackN = handler->data.header.trackN;
+    header.timeDiv = handler->data.header.timediv;
+
+    char tempName[4096 + 32];
+    snprintf(tempName, sizeof(tempName), "%s.%d.tmp", cacheName, (int)getpid());
+    FILE *file = fopen(tempName, "wb");
+    int ok = file != NULL;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(commands, sizeof(midiCommand_t), timeline->commandN, file) == timeline->commandN &&
+             (textSize == 0 || fwrite(text, textSize, 1, file) == 1);
+        ok = fclose(file) == 0 && ok;
+        // Readers only ever see a complete score
+        if (!ok || rename(tempName, cacheName) < 0) {
+            unlink(tempName);
+            ok = 0;
+        }
+    }
+    free(text);
+    free(commands);
+    return ok;
+}
+
+// Loads the compiled timeline of the MIDI file from cacheDir on a hit,
+// otherwise reads and compiles the file and stores the result in cacheDir
+// Returns 0 on faliure, 1 on success
+int loadCachedScore(midi_t *handler, const char *midiFileName, const char *cacheDir, unsigned int threads,
+                    unsigned char steppers, unsigned char policy) {
+    handler->timeline.commands = NULL;
+    handler->timeline.commandN = 0;
+    handler->timeline.cacheMap = NULL;
+    handler->checkpoints = NULL;
+    handler->meters = NULL;
+    handler->steppers = steppers;
+    handler->policy = policy;
+    handler->data.tracks = NULL;
+    handler->data.map = NULL;
+    handler->data.mapSize = 0;
+
+    // The key is the content of the source, so edited files are rebuilt even if the name is the same
+    int fd = open(midiFileName, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error while opening file %s\n", midiFileName);
+        return 0;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0 || fileStat.st_size == 0) {
+        fprintf(stderr, "Error while reading file %s\n", midiFileName);
+        close(fd);
+        return 0;
+    }
+    void *source = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (source == MAP_FAILED) {
+        fprintf(stderr, "Error while mapping file %s\n", midiFileName);
+        return 0;
+    }
+    madvise(source, fileStat.st_size, MADV_SEQUENTIAL);
+    size_t sourceSize = fileStat.st_size;
+    unsigned long long hash = hashBytes((const unsigned char *)source, sourceSize);
+    munmap(source, sourceSize);
+
+    char cacheName[4096];
+    snprintf(cacheName, sizeof(cacheName), "%s/%016llx-%08x.stc", cacheDir, hash, scoreConfigKey(handler));
+    if (mapScore(handler, cacheName, hash, sourceSize)) return 1;
+
+    if (!readMidiFileThreads(handler, midiFileName, threads)) return 0;
+    handler->steppers = steppers;
+    handler->policy = policy;
+    if (handler->data.header.format > 2) {
+        // Let initPlayer report the unsupported format
+        return 1;
+    }
+    if (!compileTimeline(handler)) {
+        freeMidi(handler);
+        return 0;
+    }
+    if (handler->timeline.commandN == 0) return 1;
+    if (!makeDirs(cacheDir) || !writeScore(handler, cacheName, hash, sourceSize)) {
+        fprintf(stderr, "Warning: Could not write compiled score to %s\n", cacheDir);
+    }
+    return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef SCORECACHE_H
+#define SCORECACHE_H
+
+#include "midiParser.h"
+
+#define SCORE_CACHE_MAGIC 0x43505453 // "STPC"
+#define SCORE_CACHE_VERSION 3
+
+// Compiled score file: header, commandN timeline commands, textSize bytes of track names
+// Track name commands point into the text, so the source file is not needed for playback
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long sourceHash; // Content hash of the .mid file
+    unsigned long long sourceSize;
+    unsigned long long duration;   // Time of the last command in ns
+    unsigned int configKey;        // Steppers | voice policy << 8 | MAX_STEPPERS << 16
+    unsigned int commandSize;      // sizeof(midiCommand_t) when the file was written
+    unsigned int commandN;
+    unsigned int textSize;
+    unsigned short format;
+    unsigned short trackN;
+    unsigned short timeDiv;
+    unsigned short reserved;
+} scoreCacheHeader_t;
+
+// Default cache directory: $STEPPATRON_CACHE, $XDG_CACHE_HOME/steppatron or ~/.cache/steppatron
+// Returns NULL if none can be found
+const char *defaultCacheDir(void);
+
+// Content hash of a memory region, used as the cache key
+unsigned long long hashBytes(const unsigned char *bytes, size_t size);
+
+// Loads the compiled timeline of the MIDI file from cacheDir on a hit,
+// otherwise reads and compiles the file and stores the result in cacheDir
+// Notes are allocated to steppers with the policy, each setting has its own cached score
+// initPlayer must be called after this, like after readMidiFile
+// Returns 0 on faliure, 1 on success
+int loadCachedScore(midi_t *handler, const char *midiFileName, const char *cacheDir, unsigned int threads,
+                    unsigned char steppers, unsigned char policy);
+
+#endif
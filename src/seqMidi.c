@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "seqMidi.h"
+#include "logger.h"
+
+// Input port of the client and the queue whose real time stamps its events
+static int inPort;
+static int queue;
+// Name pattern of the source ports, NULL for the hardware ports
+static const char *portPattern;
+static unsigned int sourceN;
+static struct pollfd *pollFds;
+static int pollFdN;
+
+// Notes on the steppers, the source of a note is its port and channel so players on different keyboards
+// share the steppers
+static voiceAllocator_t voices;
+static bendCoalescer_t bends;
+
+// A port is a source if others can subscribe to its output and it's a hardware port or matches the pattern
+static int isSourcePort(snd_seq_t *seq, snd_seq_client_info_t *client, const snd_seq_port_info_t *port) {
+    int id = snd_seq_port_info_get_client(port);
+    if (id == SND_SEQ_CLIENT_SYSTEM || id == snd_seq_client_id(seq)) return 0;
+    unsigned int caps = snd_seq_port_info_get_capability(port);
+    unsigned int readable = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+    if ((caps & readable) != readable || (caps & SND_SEQ_PORT_CAP_NO_EXPORT)) return 0;
+    if (portPattern != NULL) {
+        return strcasestr(snd_seq_client_info_get_name(client), portPattern) != NULL ||
+               strcasestr(snd_seq_port_info_get_name(port), portPattern) != NULL;
+    }
+    return (snd_seq_port_info_get_type(port) & SND_SEQ_PORT_TYPE_HARDWARE) != 0;
+}
+
+static void subscribePort(snd_seq_t *seq, snd_seq_client_info_t *client, const snd_seq_port_info_t *port) {
+    int id = snd_seq_port_info_get_client(port);
+    int number = snd_seq_port_info_get_port(port);
+    if (snd_seq_connect_from(seq, inPort, id, number) < 0) {
+        logMessage(LOG_WARNING, "Warning: Can't subscribe to %d:%d\n", id, number);
+        return;
+    }
+    sourceN++;
+    logMessage(LOG_INFO, "Listening to %d:%d %s - %s\n", id, number, snd_seq_client_info_get_name(client),
+               snd_seq_port_info_get_name(port));
+}
+
+// Subscribes to all source ports that exist now
+static void subscribeSources(snd_seq_t *seq) {
+    snd_seq_client_info_t *client;
+    snd_seq_port_info_t *port;
+    snd_seq_client_info_alloca(&client);
+    snd_seq_port_info_alloca(&port);
+    snd_seq_client_info_set_client(client, -1);
+    while (snd_seq_query_next_client(seq, client) >= 0) {
+        snd_seq_port_info_set_client(port, snd_seq_client_info_get_client(client));
+        snd_seq_port_info_set_port(port, -1);
+        while (snd_seq_query_next_port(seq, port) >= 0) {
+            if (isSourcePort(seq, client, port)) subscribePort(seq, client, port);
+        }
+    }
+}
+
+// Subscribes to a port announced by the system client if it's a source
+static void portStarted(snd_seq_t *seq, const snd_seq_addr_t *address) {
+    snd_seq_client_info_t *client;
+    snd_seq_port_info_t *port;
+    snd_seq_client_info_alloca(&client);
+    snd_seq_port_info_alloca(&port);
+    if (snd_seq_get_any_client_info(seq, address->client, client) < 0) return;
+    if (snd_seq_get_any_port_info(seq, address->client, address->port, port) < 0) return;
+    if (isSourcePort(seq, client, port)) subscribePort(seq, client, port);
+}
+
+// Opens a sequencer client with a timestamped input port and subscribes to the source ports
+// Hardware ports are used if pattern is NULL, otherwise the ports whose client or port name contains it
+// Matching ports that appear later are subscribed too
+// policy is the STEAL_* policy used when more notes play than there are steppers
+// Pitch bend and mod wheel updates of a stepper within bendWindowMs are sent as one
+// Returns 0 on faliure, 1 on success
+int seqInit(snd_seq_t **handler, unsigned int steppers, unsigned char policy, const char *pattern,
+            unsigned int bendWindowMs) {
+    if (snd_seq_open(handler, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK) < 0) {
+        fprintf(stderr, "Cannot open the ALSA sequencer\n");
+        return 0;
+    }
+    snd_seq_t *seq = *handler;
+    snd_seq_set_client_name(seq, SEQ_CLIENT_NAME);
+    queue = snd_seq_alloc_named_queue(seq, SEQ_CLIENT_NAME);
+
+    snd_seq_port_info_t *info;
+    snd_seq_port_info_alloca(&info);
+    snd_seq_port_info_set_name(info, "input");
+    snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+    snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    // The kernel stamps every event with the real time of the queue when it reaches the port
+    snd_seq_port_info_set_timestamping(info, 1);
+    snd_seq_port_info_set_timestamp_real(info, 1);
+    snd_seq_port_info_set_timestamp_queue(info, queue);
+    if (queue < 0 || snd_seq_create_port(seq, info) < 0) {
+        fprintf(stderr, "Cannot create the sequencer input port\n");
+        snd_seq_close(seq);
+        return 0;
+    }
+    inPort = snd_seq_port_info_get_port(info);
+    snd_seq_start_queue(seq, queue, NULL);
+    snd_seq_drain_output(seq);
+
+    pollFdN = snd_seq_poll_descriptors_count(seq, POLLIN);
+    pollFds = (struct pollfd *)malloc(sizeof(struct pollfd) * pollFdN);
+    if (pollFds == NULL) {
+        fprintf(stderr, "Not enough memory available!\n");
+        snd_seq_close(seq);
+        return 0;
+    }
+    snd_seq_poll_descriptors(seq, pollFds, pollFdN, POLLIN);
+
+    initVoiceAllocator(&voices, steppers <= MAX_STEPPERS && steppers != 0 ? steppers : 1, policy);
+    initBendCoalescer(&bends, bendWindowMs);
+
+    // New keyboards are announced by the system client
+    snd_seq_connect_from(seq, inPort, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+    portPattern = pattern;
+    sourceN = 0;
+    subscribeSources(seq);
+    if (sourceN == 0) {
+        logMessage(LOG_WARNING, "Warning: No input ports found yet, connect one with: aconnect SOURCE %d:%d\n",
+                   snd_seq_client_id(seq), inPort);
+    }
+    return 1;
+}
+
+// Reports the stepper steals and closes the client
+void seqClose(snd_seq_t *handler) {
+    logVoiceStats(&voices);
+    logBendStats(&bends);
+    snd_seq_close(handler);
+    free(pollFds);
+    pollFds = NULL;
+}
+
+// Time since the kernel stamped the event in ns, -1 if it has no real time stamp
+static long long eventLatency(snd_seq_t *seq, const snd_seq_event_t *event) {
+    if ((event->flags & SND_SEQ_TIME_STAMP_MASK) != SND_SEQ_TIME_STAMP_REAL || event->queue != queue) return -1;
+    snd_seq_queue_status_t *status;
+    snd_seq_queue_status_alloca(&status);
+    if (snd_seq_get_queue_status(seq, queue, status) < 0) return -1;
+    const snd_seq_real_time_t *now = snd_seq_queue_status_get_real_time(status);
+    return (long long)(now->tv_sec - event->time.time.tv_sec) * 1000000000LL +
+           ((long long)now->tv_nsec - event->time.time.tv_nsec);
+}
+
+// Converts a note event to a steppatron command
+// Returns 1 if the event produced a command, 0 otherwise
+static int noteCommand(snd_seq_t *seq, const snd_seq_event_t *event, unsigned char *command,
+                       liveLatency_t *latency) {
+    // The queue time and the read time are taken together, so the input time is the stamp on CLOCK_MONOTONIC
+    long long waited = eventLatency(seq, event);
+    unsigned long long read = monotonicNs();
+    const snd_seq_ev_note_t *note = &event->data.note;
+    unsigned int source = event->source.client << 16 | event->source.port << 8 | note->channel;
+    // Keyboards send note off as note on with velocity 0
+    int stepper;
+    if (event->type == SND_SEQ_EVENT_NOTEON && note->velocity != 0) {
+        stepper = voiceNoteOn(&voices, source, note->note, note->velocity);
+        if (stepper < 0) return 0;
+        command[0] = stepper;
+        command[1] = note->note;
+    } else {
+        stepper = voiceNoteOff(&voices, source, note->note);
+        if (stepper < 0) return 0;
+        command[0] = stepper;
+        command[1] = NOTE_OFF;
+    }
+
+    bendNoteCommand(&bends, source, command, read);
+    if (latency != NULL) latencyAllocated(latency, waited >= 0 ? read - waited : 0, read);
+    if (command[1] != NOTE_OFF) {
+        logMessage(LOG_NOTE, "Note %d from %d:%d on stepper %d ON, %lldus after input\n", command[1],
+                   event->source.client, event->source.port, command[0], waited / 1000);
+    } else {
+        logMessage(LOG_NOTE, "Note on stepper %d OFF, %lldus after input\n", command[0], waited / 1000);
+    }
+    return 1;
+}
+
+// Passes pitch bend and mod wheel events to the coalescer as the messages they came from
+static void controlEvent(const snd_seq_event_t *event) {
+    const snd_seq_ev_ctrl_t *control = &event->data.control;
+    unsigned int source = event->source.client << 16 | event->source.port << 8 | control->channel;
+    midiMessage_t message;
+    message.channel = control->channel;
+    if (event->type == SND_SEQ_EVENT_PITCHBEND) {
+        // The sequencer centers the bend on 0
+        unsigned int bend = control->value + BEND_CENTER;
+        message.type = MSG_PITCH_BEND;
+        message.param1 = bend & 0x7F;
+        message.param2 = bend >> 7 & 0x7F;
+    } else {
+        message.type = MSG_CONTROLLER;
+        message.param1 = control->param;
+        message.param2 = control->value;
+    }
+    bendMessage(&bends, source, &message, monotonicNs());
+}
+
+// Gets the next command to be sent to the steppatron driver from the merged input of all ports
+// Waits at most SEQ_POLL_MS if no event is pending
+// latency gets the kernel timestamp, read and allocation times if it's not NULL
+// Returns -1 if the sequencer failed, 0 if there is no command, 1 on success
+int getSeqCommand(unsigned char *command, snd_seq_t *handler, liveLatency_t *latency) {
+    int waited = 0;
+    while (1) {
+        if (bendCommand(&bends, command, monotonicNs())) return DRIVER_PERIOD_LEN;
+        snd_seq_event_t *event;
+        int result = snd_seq_event_input(handler, &event);
+        if (result == -EAGAIN) {
+            if (waited || poll(pollFds, pollFdN, bendWaitMs(&bends, monotonicNs(), SEQ_POLL_MS)) <= 0) return 0;
+            waited = 1;
+            continue;
+        }
+        if (result == -ENOSPC) {
+            logMessage(LOG_WARNING, "Warning: Sequencer input overrun, events were lost\n");
+            continue;
+        }
+        if (result < 0) {
+            logMessage(LOG_ERROR, "Problem reading sequencer input: %s\n", snd_strerror(result));
+            return -1;
+        }
+        switch (event->type) {
+        case SND_SEQ_EVENT_PORT_START:
+            portStarted(handler, &event->data.addr);
+            break;
+        case SND_SEQ_EVENT_NOTEON:
+        case SND_SEQ_EVENT_NOTEOFF:
+            if (noteCommand(handler, event, command, latency)) return 2;
+            break;
+        case SND_SEQ_EVENT_PITCHBEND:
+        case SND_SEQ_EVENT_CONTROLLER:
+            controlEvent(event);
+            break;
+        default:
+            break;
+        }
+    }
+}
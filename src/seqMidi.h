@@ -0,0 +1,36 @@
+#ifndef SEQMIDI_H
+#define SEQMIDI_H
+
+#include <stdio.h>
+#include <alsa/asoundlib.h>
+#include "midi.h"
+#include "voiceAlloc.h"
+#include "pitchBend.h"
+#include "latency.h"
+
+// Name of the sequencer client, other clients can be connected to it with aconnect
+#define SEQ_CLIENT_NAME "steppatron"
+// Longest wait for input, so the caller can check for the end of the program
+#define SEQ_POLL_MS 100
+
+// Opens a sequencer client with a timestamped input port and subscribes to the source ports
+// Hardware ports are used if pattern is NULL, otherwise the ports whose client or port name contains it
+// Matching ports that appear later are subscribed too
+// policy is the STEAL_* policy used when more notes play than there are steppers
+// Pitch bend and mod wheel updates of a stepper within bendWindowMs are sent as one
+// Returns 0 on faliure, 1 on success
+int seqInit(snd_seq_t **handler, unsigned int steppers, unsigned char policy, const char *pattern,
+            unsigned int bendWindowMs);
+
+// Reports the stepper steals and closes the client
+void seqClose(snd_seq_t *handler);
+
+// Gets the next command to be sent to the steppatron driver, a note or a DRIVER_PERIOD pitch bend,
+// from the merged input of all ports
+// Waits at most SEQ_POLL_MS or until a pitch bend is due if no event is pending
+// latency gets the kernel timestamp, read and allocation times of notes if it's not NULL
+// command must hold DRIVER_PERIOD_LEN bytes
+// Returns -1 if the sequencer failed, 0 if there is no command, the length of the command on success
+int getSeqCommand(unsigned char *command, snd_seq_t *handler, liveLatency_t *latency);
+
+#endif
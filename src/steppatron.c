@@ -3,8 +3,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <sched.h>
 #include "midiParser.h"
+#include "midiStream.h"
+#include "scoreCache.h"
+#include "playlist.h"
+#include "rtThread.h"
+#include "logger.h"
 #include "rawMidi.h"
+#include "seqMidi.h"
+#include "netMidi.h"
 #include "getch.h"
 
 // Output file name (driver node)
@@ -148,56 +157,475 @@ void interruptHandler(int a) {
     end = 1;
 }
 
+// SIGUSR1 received flag, the live modes print the latency report
+static volatile sig_atomic_t report = 0;
+
+static void reportHandler(int a) {
+    report = 1;
+}
+
+// Song played by the playback thread
+typedef struct {
+    midi_t *midi;
+    midiStream_t *stream; // Used instead of midi when streaming
+    playlist_t *playlist; // Used instead of midi in playlist mode
+    int outFile;
+} playback_t;
+
+static int playStep(void *arg) {
+    playback_t *playback = (playback_t *)arg;
+    if (playback->stream != NULL) return streamNext(playback->stream, playback->outFile);
+    if (playback->playlist != NULL) return playlistNext(playback->playlist);
+    return playNext(playback->midi, playback->outFile);
+}
+
+// Transport keys read from the terminal while a file plays
+typedef struct {
+    midiPlayer_t *player;
+    volatile int stop;
+    pthread_t thread;
+} transport_t;
+
+// Reads the keys and posts the requests to the player, never waits for the playback thread
+// Space pauses and resumes, + and - change the speed by 10%, 0 restores it and q stops
+static void *transportMain(void *arg) {
+    transport_t *transport = (transport_t *)arg;
+    midiPlayer_t *player = transport->player;
+    // Signals stay with the main thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    while (!transport->stop) {
+        if (poll(&input, 1, 100) <= 0) continue;
+        char key;
+        if (read(STDIN_FILENO, &key, 1) != 1) break;
+        unsigned int speed = __atomic_load_n(&player->requestedSpeed, __ATOMIC_RELAXED);
+        switch (key) {
+        case ' ':
+            playerSetPause(player, !__atomic_load_n(&player->requestedPause, __ATOMIC_RELAXED));
+            break;
+        case '+':
+        case '=':
+            playerSetSpeed(player, speed + SPEED_NORMAL / 10);
+            break;
+        case '-':
+            playerSetSpeed(player, speed > SPEED_NORMAL / 10 ? speed - SPEED_NORMAL / 10 : SPEED_MIN);
+            break;
+        case '0':
+            playerSetSpeed(player, SPEED_NORMAL);
+            break;
+        case 'q':
+            kill(getpid(), SIGINT);
+            break;
+        default:
+            continue;
+        }
+        wakePlayback();
+    }
+    return NULL;
+}
+
+// Starts reading the transport keys if the input is a terminal
+static void startTransport(transport_t *transport, midiPlayer_t *player) {
+    transport->player = player;
+    transport->stop = 0;
+    transport->thread = 0;
+    if (!isatty(STDIN_FILENO)) return;
+    initTermios(0);
+    if (pthread_create(&transport->thread, NULL, transportMain, transport) != 0) {
+        resetTermios();
+        transport->thread = 0;
+        return;
+    }
+    logMessage(LOG_INFO, "Keys: space pause, + faster, - slower, 0 normal speed, q stop\n");
+}
+
+static void stopTransport(transport_t *transport) {
+    if (transport->thread == 0) return;
+    transport->stop = 1;
+    pthread_join(transport->thread, NULL);
+    resetTermios();
+}
+
+// Plays the song as fast as possible and writes each driver command with its time in the song to fileName
+// The log is CSV: time_ns,stepper,note with note 255 for off
+// Returns 0 on faliure, 1 on success
+static int renderSong(playback_t *playback, midiPlayer_t *player, const char *fileName) {
+    FILE *file = fopen(fileName, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error while opening %s\n", fileName);
+        return 0;
+    }
+    player->freeRun = 1;
+    player->lookahead = 0;
+    player->render = file;
+    fprintf(file, "time_ns,stepper,note\n");
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (playStep(playback)) {
+    }
+    // Notes still held at the end stop with the last command
+    playerSilence(player, playback->outFile);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    player->render = NULL;
+    int ok = !ferror(file);
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "Error writing to %s\n", fileName);
+        return 0;
+    }
+    logMessage(LOG_INFO, "Rendered to %s in %.1fms\n", fileName,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 1;
+}
+
+// Stealing policy of the live modes from --steal, nearest in pitch by default
+// Returns the STEAL_* policy or -1 if the name is unknown
+static int parseStealArgs(int argc, char **argv) {
+    int policy = STEAL_NEAREST;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--steal") == 0 && i + 1 < argc) policy = parseStealPolicy(argv[++i]);
+    }
+    if (policy < 0) printf("Steal policy must be one of oldest, quietest, nearest, bass\n");
+    return policy;
+}
+
+// Pitch bend window of the live modes from --bend-window, BEND_DEFAULT_WINDOW_MS by default
+// Returns the window in ms or -1 if it's negative
+static int parseBendArgs(int argc, char **argv) {
+    int window = BEND_DEFAULT_WINDOW_MS;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--bend-window") == 0 && i + 1 < argc) window = atoi(argv[++i]);
+    }
+    if (window < 0) printf("Bend window can't be negative\n");
+    return window;
+}
+
 // Arguments:
-// 1. - u for USB, k for keyboard, f for file
-// 2. - filename
+// 1. - u for USB, s for the ALSA sequencer, n for the network, k for keyboard, f for file, p for playlist
+// 2. - filename, playlist file or directory
 int main(int argc, char **argv) {
-    int file_desc = open(FILE_NAME, O_RDWR);
+    // Rendering writes the commands to a log instead, so it runs without the driver
+    const char *renderName = NULL;
+    if (argc > 1 && strcmp(argv[1], "f") == 0) {
+        for (int i = 3; i + 1 < argc; i++) {
+            if (strcmp(argv[i], "--render") == 0) renderName = argv[i + 1];
+        }
+    }
+    int exitCode = EXIT_SUCCESS;
+    int file_desc = renderName != NULL ? -1 : open(FILE_NAME, O_RDWR);
 
-    if (file_desc < 0) {
+    if (renderName == NULL && file_desc < 0) {
         printf("Error, %s not opened\n", FILE_NAME);
         return EXIT_FAILURE;
     }
 
     signal(SIGINT, interruptHandler);
 
+    // Console output is written by the logger thread, so it can't stall playback or input
+    int logLevel = LOG_NOTE;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--quiet") == 0) logLevel = LOG_WARNING;
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            int level = parseLogLevel(argv[++i]);
+            if (level < 0) {
+                printf("Log level must be one of error, warning, info, note\n");
+                close(file_desc);
+                return EXIT_FAILURE;
+            }
+            logLevel = level;
+        }
+    }
+    // Rendered notes are in the log, printing them too would only slow the render down
+    if (renderName != NULL && logLevel > LOG_INFO) logLevel = LOG_INFO;
+    setLogLevel(logLevel);
+    startLogger();
+    atexit(stopLogger);
+
     if (argc == 1 || strcmp(argv[1], "u") == 0) {
         // Read from USB
         snd_rawmidi_t *midiIn = NULL;
         unsigned int steppers;
         if (argc > 2) steppers = atoi(argv[2]);
         else steppers = 1;
-        if (rawmidiInit(&midiIn, steppers)) {
-            unsigned char buffer[2];
+        int stealPolicy = parseStealArgs(argc, argv);
+        int bendWindow = parseBendArgs(argc, argv);
+        if (stealPolicy < 0 || bendWindow < 0) {
+            close(file_desc);
+            return EXIT_FAILURE;
+        }
+        if (rawmidiInit(&midiIn, steppers, stealPolicy, bendWindow)) {
+            unsigned char buffer[DRIVER_BATCH_LEN];
+            liveLatency_t latency;
+            initLiveLatency(&latency);
+            signal(SIGUSR1, reportHandler);
             while (!end) {
-                if (getRawmidiCommand(buffer, midiIn)) {
-                    // Send to file
-                    int ret_val = write(file_desc, buffer, 2);
+                if (report) {
+                    report = 0;
+                    printLatencyReport(&latency);
+                }
+                int got = getRawmidiCommand(buffer, midiIn, &latency);
+                if (got < 0) break;
+                if (got) {
+                    // Send to file, notes or a pitch bend
+                    long ret_val = writeDriverCommand(file_desc, buffer, got);
 
-                    if (ret_val == 0) {
+                    if (ret_val < 0) {
                         printf("Error writing to file\n");
                         close(file_desc);
                         return EXIT_FAILURE;
                     }
+                    latencyWritten(&latency);
                 }
             }
             rawmidiClose(midiIn);
+            stopLogger();
+            printLatencyReport(&latency);
+            printf("\nDone!\n");
+        }
+    } else if (strcmp(argv[1], "s") == 0) {
+        // Read from the ALSA sequencer, merging every subscribed keyboard
+        snd_seq_t *seqIn = NULL;
+        unsigned int steppers = 1;
+        const char *pattern = NULL;
+        if (argc > 2 && argv[2][0] != '-') steppers = atoi(argv[2]);
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--ports") == 0 && i + 1 < argc) pattern = argv[++i];
+        }
+        int stealPolicy = parseStealArgs(argc, argv);
+        int bendWindow = parseBendArgs(argc, argv);
+        if (stealPolicy < 0 || bendWindow < 0) {
+            close(file_desc);
+            return EXIT_FAILURE;
+        }
+        if (seqInit(&seqIn, steppers, stealPolicy, pattern, bendWindow)) {
+            unsigned char buffer[DRIVER_PERIOD_LEN];
+            liveLatency_t latency;
+            initLiveLatency(&latency);
+            signal(SIGUSR1, reportHandler);
+            while (!end) {
+                if (report) {
+                    report = 0;
+                    printLatencyReport(&latency);
+                }
+                int got = getSeqCommand(buffer, seqIn, &latency);
+                if (got < 0) break;
+                if (got) {
+                    int ret_val = write(file_desc, buffer, got);
+
+                    if (ret_val == 0) {
+                        printf("Error writing to file\n");
+                        close(file_desc);
+                        return EXIT_FAILURE;
+                    }
+                    latencyWritten(&latency);
+                }
+            }
+            seqClose(seqIn);
+            stopLogger();
+            printLatencyReport(&latency);
             printf("\nDone!\n");
         }
-    } else if (strcmp(argv[1], "f") == 0 && argc > 2) {
-        // Read from file
-        midi_t midi;
-        if (readMidiFile(&midi, argv[2])) {
-            if (initPlayer(&midi)) {
-                while (!end) {
-                    if (!playNext(&midi, file_desc)) {
-                        break;
+    } else if (strcmp(argv[1], "n") == 0) {
+        // Receive from the network, played after the jitter buffer delay
+        netMidi_t *netIn = (netMidi_t *)malloc(sizeof(netMidi_t));
+        unsigned int steppers = 1;
+        int port = NET_DEFAULT_PORT, delay = NET_DEFAULT_DELAY_MS;
+        if (argc > 2 && argv[2][0] != '-') steppers = atoi(argv[2]);
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) delay = atoi(argv[++i]);
+        }
+        int stealPolicy = parseStealArgs(argc, argv);
+        int bendWindow = parseBendArgs(argc, argv);
+        if (netIn == NULL || stealPolicy < 0 || bendWindow < 0 || port < 1 || port > 65535 || delay < 0) {
+            if (netIn == NULL) fprintf(stderr, "Not enough memory available!\n");
+            else if (stealPolicy >= 0 && bendWindow >= 0) {
+                printf("Port must be in range [1,65535] and the delay positive\n");
+            }
+            free(netIn);
+            close(file_desc);
+            return EXIT_FAILURE;
+        }
+        if (netInit(netIn, port, delay, steppers, stealPolicy, bendWindow)) {
+            unsigned char buffer[DRIVER_BATCH_LEN];
+            liveLatency_t latency;
+            initLiveLatency(&latency);
+            signal(SIGUSR1, reportHandler);
+            while (!end) {
+                if (report) {
+                    report = 0;
+                    printLatencyReport(&latency);
+                }
+                int got = getNetCommand(buffer, netIn, &latency);
+                if (got < 0) break;
+                if (got) {
+                    long ret_val = writeDriverCommand(file_desc, buffer, got);
+
+                    if (ret_val < 0) {
+                        printf("Error writing to file\n");
+                        close(file_desc);
+                        return EXIT_FAILURE;
                     }
+                    latencyWritten(&latency);
                 }
             }
-            freeMidi(&midi);
+            netClose(netIn);
+            stopLogger();
+            printLatencyReport(&latency);
             printf("\nDone!\n");
         }
+        free(netIn);
+    } else if ((strcmp(argv[1], "f") == 0 || strcmp(argv[1], "p") == 0) && argc > 2) {
+        // Read from file, or play a playlist without closing the driver between songs
+        int playlistMode = strcmp(argv[1], "p") == 0;
+        int streaming = 0;
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        const char *cacheDir = defaultCacheDir();
+        double seekSeconds = -1, loopStart = 0, loopEnd = 0;
+        int seekBar = 0;
+        int steppers = MAX_STEPPERS, policy = VOICE_SKYLINE;
+        rtConfig_t rt;
+        initRtConfig(&rt);
+        int spinUs = 0;
+        int lookaheadMs = 0;
+        int gapMs = 0, crossfadeMs = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--stream") == 0) streaming = 1;
+            else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) cacheDir = argv[++i];
+            else if (strcmp(argv[i], "--no-cache") == 0) cacheDir = NULL;
+            else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc) seekSeconds = atof(argv[++i]);
+            else if (strcmp(argv[i], "--bar") == 0 && i + 1 < argc) seekBar = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--steppers") == 0 && i + 1 < argc) steppers = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) policy = parseVoicePolicy(argv[++i]);
+            else if (strcmp(argv[i], "--rt") == 0) rt.realtime = 1;
+            else if (strcmp(argv[i], "--priority") == 0 && i + 1 < argc) rt.priority = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) rt.cpu = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) rt.memoryBudget = (size_t)atoi(argv[++i]) << 20;
+            else if (strcmp(argv[i], "--spin-us") == 0 && i + 1 < argc) spinUs = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--lookahead") == 0 && i + 1 < argc) lookaheadMs = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) i++;
+            else if (strcmp(argv[i], "--gap") == 0 && i + 1 < argc) gapMs = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--crossfade") == 0 && i + 1 < argc) crossfadeMs = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--loop") == 0 && i + 1 < argc) {
+                if (sscanf(argv[++i], "%lf:%lf", &loopStart, &loopEnd) != 2 || loopStart < 0 || loopEnd <= loopStart) {
+                    printf("Invalid loop %s, use --loop START:END in seconds\n", argv[i]);
+                    close(file_desc);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        if (threads < 1) threads = 1;
+        if (steppers < 1 || steppers > MAX_STEPPERS || policy < 0) {
+            printf("Steppers must be in range [1,%d] and the policy one of skyline, bass, first\n", MAX_STEPPERS);
+            close(file_desc);
+            return EXIT_FAILURE;
+        }
+        if (rt.priority < sched_get_priority_min(SCHED_FIFO) || rt.priority > sched_get_priority_max(SCHED_FIFO) ||
+            spinUs < 0 || spinUs > 1000000 || lookaheadMs < 0 || lookaheadMs > 10000) {
+            printf("Priority must be in range [%d,%d], spin time in range [0,1000000]us and lookahead in range "
+                   "[0,10000]ms\n", sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+            close(file_desc);
+            return EXIT_FAILURE;
+        }
+        if (gapMs < 0 || crossfadeMs < 0) {
+            printf("Gap and crossfade can't be negative\n");
+            close(file_desc);
+            return EXIT_FAILURE;
+        }
+        if (renderName != NULL && (seekSeconds >= 0 || seekBar > 0 || loopEnd > 0 || lookaheadMs > 0 || rt.realtime)) {
+            fprintf(stderr, "Warning: --seek, --bar, --loop, --lookahead and --rt are ignored with --render\n");
+        }
+        if (playlistMode) {
+            if (streaming || seekSeconds >= 0 || seekBar > 0 || loopEnd > 0) {
+                fprintf(stderr, "Warning: --stream, --seek, --bar and --loop are ignored for playlists\n");
+            }
+            playlist_t list;
+            if (readPlaylist(&list, argv[2])) {
+                list.cacheDir = cacheDir;
+                list.threads = threads;
+                list.steppers = steppers;
+                list.policy = policy;
+                list.spinNs = spinUs * 1000;
+                list.lookahead = lookaheadMs * 1000000ULL;
+                list.gap = gapMs * 1000000ULL;
+                list.crossfade = crossfadeMs * 1000000ULL;
+                list.outFile = file_desc;
+                if (startPlaylist(&list)) {
+                    playback_t playback = {NULL, NULL, &list, file_desc};
+                    runPlaybackThread(&rt, playStep, &playback, &list.total);
+                }
+                freePlaylist(&list);
+                stopLogger();
+                printDriftReport(&list.total);
+                printf("\nDone!\n");
+            }
+        } else if (streaming) {
+            // Decode the file while playing, for songs too big to load
+            if (seekSeconds >= 0 || seekBar > 0 || loopEnd > 0) {
+                fprintf(stderr, "Warning: --seek, --bar and --loop are ignored with --stream\n");
+            }
+            midiStream_t stream;
+            if (openMidiStream(&stream, argv[2])) {
+                stream.compiler.steppers = steppers;
+                stream.compiler.policy = policy;
+                stream.player.spinNs = spinUs * 1000;
+                stream.player.lookahead = lookaheadMs * 1000000ULL;
+                playback_t playback = {NULL, &stream, NULL, file_desc};
+                if (renderName != NULL) {
+                    if (!renderSong(&playback, &stream.player, renderName)) exitCode = EXIT_FAILURE;
+                    stopLogger();
+                } else {
+                    runPlaybackThread(&rt, playStep, &playback, &stream.player);
+                    stopLogger();
+                    printDriftReport(&stream.player);
+                }
+                closeMidiStream(&stream);
+                printf("\nDone!\n");
+            } else {
+                exitCode = EXIT_FAILURE;
+            }
+        } else {
+            midi_t midi;
+            int loaded = cacheDir != NULL ? loadCachedScore(&midi, argv[2], cacheDir, threads, steppers, policy)
+                                          : readMidiFileThreads(&midi, argv[2], threads);
+            if (loaded) {
+                midi.steppers = steppers;
+                midi.policy = policy;
+                if (initPlayer(&midi)) {
+                    playback_t playback = {&midi, NULL, NULL, file_desc};
+                    if (renderName != NULL) {
+                        if (!renderSong(&playback, &midi.player, renderName)) exitCode = EXIT_FAILURE;
+                        stopLogger();
+                    } else {
+                        midi.player.lookahead = lookaheadMs * 1000000ULL;
+                        if (loopEnd > 0) setLoop(&midi, loopStart * NS_PER_S, loopEnd * NS_PER_S);
+                        // Rehearsals start at the loop unless asked otherwise
+                        if (seekBar > 0) seekTime(&midi, tickTime(&midi, barTick(&midi, seekBar)), file_desc);
+                        else if (seekSeconds >= 0) seekTime(&midi, seekSeconds * NS_PER_S, file_desc);
+                        else if (loopEnd > 0) seekTime(&midi, midi.loopStart, file_desc);
+                        midi.player.spinNs = spinUs * 1000;
+                        transport_t transport;
+                        startTransport(&transport, &midi.player);
+                        runPlaybackThread(&rt, playStep, &playback, &midi.player);
+                        stopTransport(&transport);
+                        playerStop(&midi.player, file_desc);
+                        stopLogger();
+                        printDriftReport(&midi.player);
+                    }
+                }
+                freeMidi(&midi);
+                printf("\nDone!\n");
+            } else {
+                exitCode = EXIT_FAILURE;
+            }
+        }
     } else if (strcmp(argv[1], "k") == 0) {
         // Read from keyboard
         int ret_val;
@@ -237,7 +665,7 @@ int main(int argc, char **argv) {
 
         while (1) {
             input[1] = getch();
-            printf("Pressed: %c\n", input[1]);
+            logMessage(LOG_NOTE, "Pressed: %c\n", input[1]);
 
             switch (input[1]) {
             //donji red
@@ -293,19 +721,21 @@ int main(int argc, char **argv) {
                 if(++stepper == 4)
                     stepper = 0;
 
-                if(input[1] == 0xFF){
-
-                    for(int i = 0; i<4; i++){
-                        input[0] = i;
-                        ret_val = write(file_desc, input, 2);
+                if((unsigned char)input[1] == NOTE_OFF){
+                    /* All steppers stop with one write, the ones the driver doesn't have are left out */
+                    unsigned char stop[MAX_STEPPERS * 2];
+                    for(int i = 0; i<MAX_STEPPERS; i++){
+                        stop[i * 2] = i;
+                        stop[i * 2 + 1] = NOTE_OFF;
+                    }
+                    ret_val = writeDriverCommand(file_desc, stop, sizeof(stop));
 
-                        if (ret_val == 0) {
-                            printf("Error writing to file\n");
-                            close(file_desc);
-                            return 2;
-                        }
+                    if (ret_val < 0) {
+                        printf("Error writing to file\n");
+                        close(file_desc);
+                        return 2;
                     }
-                    
+
                     continue;
                 }
                 else
@@ -322,10 +752,50 @@ int main(int argc, char **argv) {
         }
     } else {
         printf("Invalid arguments!\n");
-        printf("Use: steppatron [MODE] [FILENAME]\n");
+        printf("Use: steppatron [MODE] [FILENAME] [OPTIONS]\n");
+        printf("  f options: --stream       decode the file while playing\n");
+        printf("             --threads N    threads used to decode tracks, default is the number of cores\n");
+        printf("             --cache DIR    compiled score cache, default is ~/.cache/steppatron\n");
+        printf("             --no-cache     always parse the MIDI file\n");
+        printf("             --steppers N   steppers to play on, default is %d\n", MAX_STEPPERS);
+        printf("             --policy NAME  notes kept when too many play at once: skyline (highest, default),\n");
+        printf("                            bass (lowest) or first (earliest)\n");
+        printf("             --seek SECONDS start playing at this time\n");
+        printf("             --bar N        start playing at bar N\n");
+        printf("             --loop A:B     play from A to B seconds in a loop\n");
+        printf("             --rt           play with SCHED_FIFO and locked memory, needs root or CAP_SYS_NICE\n");
+        printf("             --priority N   SCHED_FIFO priority with --rt, default is %d\n", RT_DEFAULT_PRIORITY);
+        printf("             --cpu N        pin the playback thread to CPU N\n");
+        printf("             --memory MB    memory locked for playback with --rt, default is %d\n",
+               RT_DEFAULT_MEMORY >> 20);
+        printf("             --spin-us N    busy wait the last N us before each note instead of sleeping\n");
+        printf("             --lookahead MS send notes MS early, the driver plays them on time from its queue\n");
+        printf("             --render FILE  don't play, write each driver command and its time in the song to\n");
+        printf("                            FILE as CSV (time_ns,stepper,note), as fast as possible\n");
+        printf("             keys while playing (not with --stream): space pause, + faster, - slower,\n");
+        printf("             0 normal speed, q stop\n");
+        printf("  p: plays the files listed in FILENAME (one per line) or the .mid files of a directory,\n");
+        printf("     takes the f options except --stream, --seek, --bar and --loop, and:\n");
+        printf("             --gap MS       silence between songs, default is 0\n");
+        printf("             --crossfade MS start the next song MS before the current one ends\n");
+        printf("             SIGUSR1 prints the wakeup latency while playing\n");
+        printf("  u, s and n options: --steal NAME  note that loses its stepper when all play: oldest, quietest,\n");
+        printf("                                    nearest (in pitch, default) or bass (oldest, never the lowest)\n");
+        printf("                    --bend-window MS  pitch bend and mod wheel changes of a stepper within MS\n");
+        printf("                                      are sent as one, default is %d\n", BEND_DEFAULT_WINDOW_MS);
+        printf("                    SIGUSR1 prints the input to driver latency by stage\n");
+        printf("  s: plays the keyboards of the ALSA sequencer, [FILENAME] is the number of steppers:\n");
+        printf("             --ports NAME   listen to the ports whose client or port name contains NAME,\n");
+        printf("                            default is every hardware port, others can be added with aconnect\n");
+        printf("  n: plays MIDI received over UDP (sent by netSend), [FILENAME] is the number of steppers:\n");
+        printf("             --port N       UDP port to listen on, default is %d\n", NET_DEFAULT_PORT);
+        printf("             --delay MS     playout delay that absorbs network jitter, default is %d\n",
+               NET_DEFAULT_DELAY_MS);
+        printf("  all modes: --quiet        only show warnings and errors\n");
+        printf("             --log-level L  error, warning, info (tempo and track names) or note (default)\n");
         return EXIT_FAILURE;
     }
 
-    close(file_desc);
-    return EXIT_SUCCESS;
+    if (file_desc >= 0) close(file_desc);
+    return exitCode;
 }
@@ -0,0 +1,230 @@
+#include <string.h>
+#include "voiceAlloc.h"
+#include "logger.h"
+
+static const char *policyNames[STEAL_POLICY_N] = {"oldest", "quietest", "nearest", "bass"};
+
+static inline unsigned int hashKey(unsigned int key) {
+    return (key * 2654435761u) >> (32 - VOICE_HASH_BITS);
+}
+
+// Slot holding the key, or the empty slot where it would go
+static unsigned int findSlot(const voiceAllocator_t *alloc, unsigned int key) {
+    unsigned int slot = hashKey(key);
+    while (alloc->table[slot] >= 0 && alloc->voices[alloc->table[slot]].key != key) {
+        slot = (slot + 1) & (VOICE_HASH_SIZE - 1);
+    }
+    return slot;
+}
+
+// Removes the key by shifting back the entries after it, so lookups never need tombstones
+static void removeKey(voiceAllocator_t *alloc, unsigned int key) {
+    unsigned int hole = findSlot(alloc, key);
+    if (alloc->table[hole] < 0) return;
+    unsigned int slot = hole;
+    while (1) {
+        slot = (slot + 1) & (VOICE_HASH_SIZE - 1);
+        if (alloc->table[slot] < 0) break;
+        unsigned int home = hashKey(alloc->voices[alloc->table[slot]].key);
+        // The entry can fill the hole if its home isn't between the hole and its slot
+        if (((slot - home) & (VOICE_HASH_SIZE - 1)) >= ((slot - hole) & (VOICE_HASH_SIZE - 1))) {
+            alloc->table[hole] = alloc->table[slot];
+            hole = slot;
+        }
+    }
+    alloc->table[hole] = -1;
+}
+
+static void setBit(unsigned long long *bits, unsigned char index) {
+    bits[index >> 6] |= 1ULL << (index & 63);
+}
+
+static void clearBit(unsigned long long *bits, unsigned char index) {
+    bits[index >> 6] &= ~(1ULL << (index & 63));
+}
+
+// Lowest set bit, -1 if there is none
+static int lowestBit(const unsigned long long *bits) {
+    if (bits[0] != 0) return __builtin_ctzll(bits[0]);
+    if (bits[1] != 0) return 64 + __builtin_ctzll(bits[1]);
+    return -1;
+}
+
+// Set bit nearest to index, the higher one on a tie, -1 if there is none
+static int nearestBit(const unsigned long long *bits, unsigned char index) {
+    int below = -1, above = -1;
+    for (int word = index >> 6; word >= 0 && below < 0; word--) {
+        unsigned long long mask = bits[word];
+        if (word == index >> 6) mask &= (index & 63) == 63 ? ~0ULL : (2ULL << (index & 63)) - 1;
+        if (mask != 0) below = word * 64 + 63 - __builtin_clzll(mask);
+    }
+    for (int word = index >> 6; word < 2 && above < 0; word++) {
+        unsigned long long mask = bits[word];
+        if (word == index >> 6) mask &= ~0ULL << (index & 63);
+        if (mask != 0) above = word * 64 + __builtin_ctzll(mask);
+    }
+    if (below < 0) return above;
+    if (above < 0) return below;
+    return above - index <= index - below ? above : below;
+}
+
+static void listAppend(voiceAllocator_t *alloc, voiceList_t *list, int which, short voice) {
+    liveVoice_t *v = &alloc->voices[voice];
+    v->prev[which] = list->tail;
+    v->next[which] = -1;
+    if (list->tail >= 0) alloc->voices[list->tail].next[which] = voice;
+    else list->head = voice;
+    list->tail = voice;
+}
+
+static void listRemove(voiceAllocator_t *alloc, voiceList_t *list, int which, short voice) {
+    liveVoice_t *v = &alloc->voices[voice];
+    if (v->prev[which] >= 0) alloc->voices[v->prev[which]].next[which] = v->next[which];
+    else list->head = v->next[which];
+    if (v->next[which] >= 0) alloc->voices[v->next[which]].prev[which] = v->prev[which];
+    else list->tail = v->prev[which];
+}
+
+// Adds an active voice to the age, velocity and pitch lists
+static void linkVoice(voiceAllocator_t *alloc, short voice) {
+    liveVoice_t *v = &alloc->voices[voice];
+    listAppend(alloc, &alloc->age, VOICE_LIST_AGE, voice);
+    listAppend(alloc, &alloc->velocities[v->velocity], VOICE_LIST_VELOCITY, voice);
+    listAppend(alloc, &alloc->pitches[v->note], VOICE_LIST_PITCH, voice);
+    setBit(alloc->velocityBits, v->velocity);
+    setBit(alloc->pitchBits, v->note);
+}
+
+static void unlinkVoice(voiceAllocator_t *alloc, short voice) {
+    liveVoice_t *v = &alloc->voices[voice];
+    listRemove(alloc, &alloc->age, VOICE_LIST_AGE, voice);
+    listRemove(alloc, &alloc->velocities[v->velocity], VOICE_LIST_VELOCITY, voice);
+    listRemove(alloc, &alloc->pitches[v->note], VOICE_LIST_PITCH, voice);
+    if (alloc->velocities[v->velocity].head < 0) clearBit(alloc->velocityBits, v->velocity);
+    if (alloc->pitches[v->note].head < 0) clearBit(alloc->pitchBits, v->note);
+}
+
+// Initializes the allocator with all voices free, voices is clamped to 1..VOICE_ALLOC_MAX
+void initVoiceAllocator(voiceAllocator_t *alloc, unsigned int voices, unsigned char policy) {
+    memset(alloc, 0, sizeof(*alloc));
+    memset(alloc->table, 0xFF, sizeof(alloc->table));
+    alloc->voiceN = voices == 0 ? 1 : (voices > VOICE_ALLOC_MAX ? VOICE_ALLOC_MAX : voices);
+    alloc->policy = policy < STEAL_POLICY_N ? policy : STEAL_NEAREST;
+    alloc->age.head = alloc->age.tail = -1;
+    for (int i = 0; i < 128; i++) {
+        alloc->velocities[i].head = alloc->velocities[i].tail = -1;
+        alloc->pitches[i].head = alloc->pitches[i].tail = -1;
+    }
+    for (unsigned int i = 0; i < alloc->voiceN; i++) alloc->freeVoices[i] = i;
+    alloc->freeN = alloc->voiceN;
+}
+
+// Active voice that loses its note to a new one, following the policy
+// Returns the voice or -1 if no voice may be taken
+static short stealVoice(const voiceAllocator_t *alloc, unsigned char note) {
+    switch (alloc->policy) {
+    case STEAL_QUIETEST:
+        return alloc->velocities[lowestBit(alloc->velocityBits)].head;
+    case STEAL_NEAREST:
+        return alloc->pitches[nearestBit(alloc->pitchBits, note)].head;
+    case STEAL_KEEP_BASS: {
+        int lowest = lowestBit(alloc->pitchBits);
+        // A lower note becomes the bass itself
+        if (note < lowest) return alloc->age.head;
+        short bass = alloc->pitches[lowest].head;
+        short voice = alloc->age.head;
+        return voice != bass ? voice : alloc->voices[voice].next[VOICE_LIST_AGE];
+    }
+    default:
+        return alloc->age.head;
+    }
+}
+
+// Finds a voice for a starting note, source tells apart the same note from different channels or devices
+// and must fit in 24 bits. The same note from the same source gets its voice again
+// Returns the voice or -1 if the note is dropped
+int voiceNoteOn(voiceAllocator_t *alloc, unsigned int source, unsigned char note, unsigned char velocity) {
+    note &= 0x7F;
+    velocity &= 0x7F;
+    unsigned int key = source << 7 | note;
+    unsigned int slot = findSlot(alloc, key);
+    short voice = alloc->table[slot];
+    if (voice >= 0) {
+        unlinkVoice(alloc, voice);
+    } else if (alloc->freeN != 0) {
+        voice = alloc->freeVoices[alloc->freeHead];
+        alloc->freeHead = (alloc->freeHead + 1) % VOICE_ALLOC_MAX;
+        alloc->freeN--;
+        alloc->table[slot] = voice;
+    } else {
+        voice = stealVoice(alloc, note);
+        if (voice < 0) {
+            alloc->drops[alloc->policy]++;
+            return -1;
+        }
+        alloc->steals[alloc->policy]++;
+        unlinkVoice(alloc, voice);
+        removeKey(alloc, alloc->voices[voice].key);
+        alloc->table[findSlot(alloc, key)] = voice;
+    }
+    liveVoice_t *v = &alloc->voices[voice];
+    v->key = key;
+    v->note = note;
+    v->velocity = velocity;
+    v->active = 1;
+    linkVoice(alloc, voice);
+    return voice;
+}
+
+// Frees the voice of the note
+// Returns the voice or -1 if the note has no voice
+int voiceNoteOff(voiceAllocator_t *alloc, unsigned int source, unsigned char note) {
+    unsigned int key = source << 7 | (note & 0x7F);
+    short voice = alloc->table[findSlot(alloc, key)];
+    if (voice < 0) return -1;
+    unlinkVoice(alloc, voice);
+    removeKey(alloc, key);
+    alloc->voices[voice].active = 0;
+    alloc->freeVoices[(alloc->freeHead + alloc->freeN) % VOICE_ALLOC_MAX] = voice;
+    alloc->freeN++;
+    return voice;
+}
+
+// Converts a channel message to a steppatron command, only note on and note off produce one
+// Note on with velocity 0 is a note off
+// Returns 1 if the message produced a command, 0 otherwise
+int voiceMessageCommand(voiceAllocator_t *alloc, unsigned int source, const midiMessage_t *message,
+                        unsigned char *command) {
+    int stepper;
+    if (message->type == MSG_NOTE_ON && message->param2 != 0) {
+        stepper = voiceNoteOn(alloc, source, message->param1, message->param2);
+        if (stepper < 0) return 0;
+        command[0] = stepper;
+        command[1] = message->param1;
+        return 1;
+    }
+    if (message->type != MSG_NOTE_ON && message->type != MSG_NOTE_OFF) return 0;
+    stepper = voiceNoteOff(alloc, source, message->param1);
+    if (stepper < 0) return 0;
+    command[0] = stepper;
+    command[1] = NOTE_OFF;
+    return 1;
+}
+
+// Stealing policy from its name: oldest, quietest, nearest or bass
+// Returns the STEAL_* policy or -1 if the name is unknown
+int parseStealPolicy(const char *name) {
+    for (int i = 0; i < STEAL_POLICY_N; i++) {
+        if (strcmp(name, policyNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Logs the steal and drop counters of the policies that were used
+void logVoiceStats(const voiceAllocator_t *alloc) {
+    for (int i = 0; i < STEAL_POLICY_N; i++) {
+        if (alloc->steals[i] == 0 && alloc->drops[i] == 0) continue;
+        logMessage(LOG_INFO, "Voices (%s): %u notes stolen, %u dropped\n", policyNames[i], alloc->steals[i],
+                   alloc->drops[i]);
+    }
+}
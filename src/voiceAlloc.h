@@ -0,0 +1,83 @@
+#ifndef VOICEALLOC_H
+#define VOICEALLOC_H
+
+#include "midi.h"
+
+// Stepper allocation for live input, every operation is O(1) in the number of steppers
+
+// Stealing policies, decide which playing note loses its stepper when a note starts and none is free
+#define STEAL_OLDEST 0    // The note that started first
+#define STEAL_QUIETEST 1  // The note with the lowest velocity, the oldest of them on a tie
+#define STEAL_NEAREST 2   // The note nearest in pitch
+#define STEAL_KEEP_BASS 3 // The oldest note, but the lowest playing note is never taken
+#define STEAL_POLICY_N 4
+
+// Most steppers an allocator can handle
+#define VOICE_ALLOC_MAX 256
+// Note to voice lookup slots, a power of two at least twice VOICE_ALLOC_MAX
+#define VOICE_HASH_BITS 9
+#define VOICE_HASH_SIZE (1 << VOICE_HASH_BITS)
+
+// Lists each active voice is linked in
+#define VOICE_LIST_AGE 0
+#define VOICE_LIST_VELOCITY 1
+#define VOICE_LIST_PITCH 2
+#define VOICE_LISTS 3
+
+typedef struct {
+    short head, tail; // -1 if the list is empty
+} voiceList_t;
+
+// Note playing on a stepper
+typedef struct {
+    unsigned int key; // Source << 7 | note
+    short prev[VOICE_LISTS];
+    short next[VOICE_LISTS];
+    unsigned char note;
+    unsigned char velocity;
+    unsigned char active;
+} liveVoice_t;
+
+typedef struct {
+    liveVoice_t voices[VOICE_ALLOC_MAX];
+    short table[VOICE_HASH_SIZE];      // Voice of each key with linear probing, -1 for empty slots
+    short freeVoices[VOICE_ALLOC_MAX]; // Ring of free voices, the one free the longest comes first
+    unsigned int freeHead;
+    unsigned int freeN;
+    voiceList_t age;             // Active voices from the oldest to the newest
+    voiceList_t velocities[128]; // Active voices of each velocity, oldest first
+    voiceList_t pitches[128];    // Active voices of each note, oldest first
+    unsigned long long velocityBits[2]; // Velocities with active voices
+    unsigned long long pitchBits[2];    // Notes with active voices
+    unsigned int voiceN;
+    unsigned char policy;                // STEAL_*
+    unsigned int steals[STEAL_POLICY_N]; // Notes that took the stepper of another note, by policy
+    unsigned int drops[STEAL_POLICY_N];  // Notes that got no stepper, by policy
+} voiceAllocator_t;
+
+// Initializes the allocator with all voices free, voices is clamped to 1..VOICE_ALLOC_MAX
+void initVoiceAllocator(voiceAllocator_t *alloc, unsigned int voices, unsigned char policy);
+
+// Finds a voice for a starting note, source tells apart the same note from different channels or devices
+// and must fit in 24 bits. The same note from the same source gets its voice again
+// Returns the voice or -1 if the note is dropped
+int voiceNoteOn(voiceAllocator_t *alloc, unsigned int source, unsigned char note, unsigned char velocity);
+
+// Frees the voice of the note
+// Returns the voice or -1 if the note has no voice
+int voiceNoteOff(voiceAllocator_t *alloc, unsigned int source, unsigned char note);
+
+// Converts a channel message to a steppatron command, only note on and note off produce one
+// Note on with velocity 0 is a note off
+// Returns 1 if the message produced a command, 0 otherwise
+int voiceMessageCommand(voiceAllocator_t *alloc, unsigned int source, const midiMessage_t *message,
+                        unsigned char *command);
+
+// Stealing policy from its name: oldest, quietest, nearest or bass
+// Returns the STEAL_* policy or -1 if the name is unknown
+int parseStealPolicy(const char *name);
+
+// Logs the steal and drop counters of the policies that were used
+void logVoiceStats(const voiceAllocator_t *alloc);
+
+#endif